@@ -0,0 +1,1129 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_bench.c
+//  Description    : This is the benchmark harness of the CART driver: it
+//                   generates synthetic workloads (written out in the trace
+//                   format cart_sim replays) and runs them, or a trace, against
+//                   the driver, reporting throughput, latency and bus round
+//                   trips per operation.  Runs go to an in-process loopback
+//                   controller unless a server is given, so they are
+//                   repeatable without the network.
+//
+//   Author        : Patrick McDaniel
+//   Last Modified : Thu Sep 15 14:49:37 EDT 2016
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+// Project Includes
+#include <cart_driver.h>
+#include <cart_cache.h>
+#include <cart_network.h>
+#include <cart_trace.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define CART_BENCH_MAX_FILES 128            // files of a workload (cart_sim opens no more)
+#define CART_BENCH_MAX_SIZE (1024 * 1024)   // largest file a generated workload grows
+#define CART_BENCH_MAX_WRITE 256            // longest generated write (a trace line holds < 1024 bytes)
+#define CART_BENCH_MAX_READ 1024            // longest generated read
+#define CART_BENCH_LOCALITY 4096            // a local WRITEAT lands this close to its file's last write
+#define CART_BENCH_CRASH_CYCLES 3000        // files a crash test opens, writes and closes (wrapping the journal)
+#define CART_BENCH_CRASH_NAMES 40           // crash tests run, one per filename length from 1
+#define CART_BENCH_CRASH_KEPT "crash-kept"  // file the crash tests leave open across the crash
+#define CART_BENCH_CRASH_SIZE 3089          // bytes written to the kept file
+#define CART_ARGUMENTS "hvwl:g:s:n:o:d:m:r:a:z:c:P:i:p:T:x:k:"
+#define USAGE \
+	"USAGE: cart_bench [-h] [-v] [-w] [-l <logfile>] [-g <trace>] [-s <seed>] [-n <files>] [-o <ops>]\n" \
+	"                  [-d <dist>] [-m <bytes>] [-r <percent>] [-a <percent>] [-z <skew>]\n" \
+	"                  [-c <sz>] [-P <policy>] [-i <address>] [-p <port>] [-T <entries>] [-x <bytes>]\n" \
+	"                  [-k <store>] [<trace>]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -v - verbose output\n" \
+	"    -w - write-back cache mode\n" \
+	"    -l - write log messages to the filename <logfile>\n" \
+	"    -g - write the generated workload to <trace> (its files beside it, for cart_sim to validate) and exit\n" \
+	"    -s - seed of the generator (runs with the same seed and options are the same workload)\n" \
+	"    -n - number of files (default 16)\n" \
+	"    -o - number of reads and writes (default 20000, the seeks they need come on top)\n" \
+	"    -d - distribution of the file sizes: fixed, uniform (up to twice the mean) or exp (default exp)\n" \
+	"    -m - mean file size in bytes (default 65536)\n" \
+	"    -r - percent of the operations that are reads (default 10)\n" \
+	"    -a - percent of the WRITEATs landing near their file's last write, the rest anywhere (default 50)\n" \
+	"    -z - Zipf skew of the files the operations go to, 0 for uniform (default 1.0)\n" \
+	"    -c - set the cart block cache to size <sz>\n" \
+	"    -P - set the cache replacement policy to <policy> (lru, clock, 2q, arc)\n" \
+	"    -i - IP address of a server to run against (instead of the loopback controller)\n" \
+	"    -p - port number of the server to run against\n" \
+	"    -T - keep the last <entries> hot path traces in memory (with -v), logged after the run\n" \
+	"    -x - send and read at most <bytes> at a time over the bus, so requests and responses move in pieces\n" \
+	"    -k - crash test: open, write and close files on loopback carts kept in the file <store> until the\n" \
+	"         metadata journal wraps, stop without powering off, and check the store mounts (instead of a run)\n" \
+	"\n" \
+	"    <trace> - run this workload (cart_sim format) instead of generating one\n" \
+	"\n" \
+
+// The operations of a workload, in the order of the trace commands
+typedef enum {
+	CART_BENCH_READ    = 0,  // read at the file position
+	CART_BENCH_WRITE   = 1,  // write at the file position
+	CART_BENCH_WRITEAT = 2,  // seek, then write
+	CART_BENCH_SEEK    = 3,  // move the file position
+	CART_BENCH_KINDS   = 4,  // number of kinds
+} CartBenchKinds;
+
+// How the target sizes of the generated files are drawn
+typedef enum {
+	CART_BENCH_FIXED   = 0,  // every file the mean size
+	CART_BENCH_UNIFORM = 1,  // uniform up to twice the mean
+	CART_BENCH_EXP     = 2,  // exponential around the mean
+} CartBenchSizes;
+
+// One operation of a workload
+typedef struct {
+	int16_t         file;    // file of the workload it acts on
+	CartBenchKinds  kind;    // what it does
+	int32_t         length;  // bytes read or written
+	int32_t         offset;  // position of a SEEK or WRITEAT
+	char           *text;    // bytes written, NULL for reads and seeks
+} CartBenchOp;
+
+// A file of the workload, with what it should hold once the operations so
+// far have been applied
+typedef struct {
+	char            name[CART_MAX_PATH_LENGTH];  // filename in the trace
+	int16_t         fhandle;    // driver file handle while running
+	char           *contents;   // what the file holds
+	uint32_t        size;       // bytes of contents
+	uint32_t        capacity;   // bytes contents has room for
+	uint32_t        position;   // file position
+	uint32_t        target;     // size the generator grows the file to
+	uint32_t        lastWrite;  // position of the last write (WRITEAT locality)
+} CartBenchFile;
+
+// A workload: its files and operations
+typedef struct {
+	CartBenchFile   files[CART_BENCH_MAX_FILES];
+	int             fileCount;
+	CartBenchOp    *ops;
+	int             opCount;
+	int             opMax;
+} CartBenchWorkload;
+
+// How the workload is generated
+typedef struct {
+	uint64_t        seed;          // generator seed
+	int             files;         // files to spread the operations over
+	int             operations;    // reads and writes to generate
+	CartBenchSizes  sizes;         // distribution of the file sizes
+	uint32_t        meanSize;      // mean file size
+	double          readPercent;   // share of reads
+	double          localPercent;  // share of WRITEATs near the last write
+	double          skew;          // Zipf exponent of the file popularity
+} CartBenchOptions;
+
+//
+// Global Data
+static const char *benchKindNames[CART_BENCH_KINDS] = { "READ", "WRITE", "WRITEAT", "SEEK" };
+uint64_t  benchRandom = 0;              // state of the generator's xorshift64*
+pthread_t benchController;              // thread serving the loopback controller
+int       benchControllerRunning = 0;   // the thread has been started and not joined
+char     *benchStore = NULL;            // backing file of the loopback carts, NULL for zeroed carts
+
+//
+// Functional Prototypes
+
+int generate_workload(CartBenchWorkload *wload, CartBenchOptions *opts);  // generate a synthetic workload
+int load_workload(CartBenchWorkload *wload, char *trace);     // read a workload from a cart_sim trace
+int save_workload(CartBenchWorkload *wload, char *trace);     // write a workload out as a cart_sim trace
+int find_bench_file(CartBenchWorkload *wload, char *name);    // find (or add) a file of the workload
+int add_bench_op(CartBenchWorkload *wload, int file, CartBenchKinds kind, int32_t len, int32_t off, char *text);
+                                                              // append an operation, applying it to its file
+int apply_bench_op(CartBenchFile *file, CartBenchOp *op);     // what an operation does to a file's contents
+int run_workload(CartBenchWorkload *wload);                   // run a workload on the driver and report it
+int run_bench_op(CartBenchFile *file, CartBenchOp *op, char *buf);  // perform one operation on the driver
+int validate_bench_files(CartBenchWorkload *wload);           // check the driver's files against the workload's
+int run_crash_test(char *store);                              // crash the driver over a store, checking it mounts
+int run_crash_step(int (*step)(int), int length);             // run one step of a crash test in a child process
+int crash_bench_store(int length);                            // fill the journal with files, then stop (crash)
+int mount_bench_store(int length);                            // mount the crashed store and check the kept file
+int start_bench_controller(int sock);                         // start the loopback controller on a socket
+void *serve_bench_controller(void *arg);                      // thread serving the loopback controller
+uint64_t bench_random(void);                                  // next 64 random bits of the generator
+double bench_uniform(void);                                   // next random number in [0, 1)
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the CART benchmark
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+
+	// Local variables
+	int ch, verbose = 0, log_initialized = 0, result;
+	uint32_t cache_size = 0, trace_entries = 0;
+	unsigned long transfer_limit = 0;
+	char *generate = NULL, *address = NULL, *ports = NULL, *crash = NULL;
+	static CartBenchWorkload wload;
+	CartBenchOptions opts = { 1, 16, 20000, CART_BENCH_EXP, 65536, 10.0, 50.0, 1.0 };
+
+	// Process the command line parameters
+	while ((ch = getopt(argc, argv, CART_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'v': // Verbose Flag
+			verbose = 1;
+			break;
+
+		case 'w': // Write-back cache mode
+			set_cart_cache_mode( CART_CACHE_WRITEBACK );
+			break;
+
+		case 'l': // Set the log filename
+			initializeLogWithFilename( optarg );
+			log_initialized = 1;
+			break;
+
+		case 'g': // Generate the workload into a trace
+			generate = optarg;
+			break;
+
+		case 's': // Set the generator seed
+			if ( sscanf( optarg, "%lu", (unsigned long *)&opts.seed ) != 1 ) {
+				fprintf( stderr, "Bad seed [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'n': // Set the number of files
+			if ( (sscanf( optarg, "%d", &opts.files ) != 1) || (opts.files < 1) ||
+					(opts.files > CART_BENCH_MAX_FILES) ) {
+				fprintf( stderr, "Bad file count [%s] (1 to %d), aborting.\n", optarg, CART_BENCH_MAX_FILES );
+				return( -1 );
+			}
+			break;
+
+		case 'o': // Set the number of operations
+			if ( (sscanf( optarg, "%d", &opts.operations ) != 1) || (opts.operations < 1) ) {
+				fprintf( stderr, "Bad operation count [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'd': // Set the size distribution
+			if ( strcmp( optarg, "fixed" ) == 0 ) {
+				opts.sizes = CART_BENCH_FIXED;
+			} else if ( strcmp( optarg, "uniform" ) == 0 ) {
+				opts.sizes = CART_BENCH_UNIFORM;
+			} else if ( strcmp( optarg, "exp" ) == 0 ) {
+				opts.sizes = CART_BENCH_EXP;
+			} else {
+				fprintf( stderr, "Bad size distribution [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'm': // Set the mean file size
+			if ( (sscanf( optarg, "%u", &opts.meanSize ) != 1) || (opts.meanSize < 1) ||
+					(opts.meanSize > CART_BENCH_MAX_SIZE) ) {
+				fprintf( stderr, "Bad mean file size [%s] (1 to %d), aborting.\n", optarg, CART_BENCH_MAX_SIZE );
+				return( -1 );
+			}
+			break;
+
+		case 'r': // Set the read percentage
+			if ( (sscanf( optarg, "%lf", &opts.readPercent ) != 1) || (opts.readPercent < 0) ||
+					(opts.readPercent > 100) ) {
+				fprintf( stderr, "Bad read percentage [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'a': // Set the WRITEAT locality
+			if ( (sscanf( optarg, "%lf", &opts.localPercent ) != 1) || (opts.localPercent < 0) ||
+					(opts.localPercent > 100) ) {
+				fprintf( stderr, "Bad locality percentage [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'z': // Set the Zipf skew
+			if ( (sscanf( optarg, "%lf", &opts.skew ) != 1) || (opts.skew < 0) ) {
+				fprintf( stderr, "Bad Zipf skew [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'c': // Set cache line size
+			if ( sscanf( optarg, "%u", &cache_size ) != 1 ) {
+				fprintf( stderr, "Bad cache size [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'P': // Set the cache replacement policy
+			if ( set_cart_cache_policy( optarg ) != 0 ) {
+				fprintf( stderr, "Bad cache policy [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'i': // Run against a server at this address
+			address = optarg;
+			break;
+
+		case 'p': // Run against a server on this port
+			ports = optarg;
+			break;
+
+		case 'T': // Trace into a ring buffer
+			if ( (sscanf( optarg, "%u", &trace_entries ) != 1) || (set_cart_trace_ring( trace_entries ) != 0) ) {
+				fprintf( stderr, "Bad trace buffer size [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'x': // Cut the bus transfers short
+			if ( (sscanf( optarg, "%lu", &transfer_limit ) != 1) || (transfer_limit < 1) ||
+					(client_cart_bus_transfer_limit( transfer_limit ) != 0) ) {
+				fprintf( stderr, "Bad transfer limit [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'k': // Crash test over a store
+			crash = optarg;
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+
+	// Setup the log as needed
+	if ( ! log_initialized ) {
+		initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	}
+	if ( verbose ) {
+		enableLogLevels(LOG_INFO_LEVEL);
+		set_cart_trace_levels(LOG_INFO_LEVEL);
+	}
+	if (cache_size != 0) {
+		set_cart_cache_size(cache_size);
+	}
+
+	// A crash test needs carts that outlive the process, so it runs on a loopback store
+	if ( crash != NULL ) {
+		if ( (address != NULL) || (ports != NULL) ) {
+			fprintf( stderr, "The crash test runs on the loopback controller, aborting.\n" );
+			return( -1 );
+		}
+		benchStore = crash;
+		if ( (client_cart_bus_loopback( start_bench_controller ) != 0) || (run_crash_test( crash ) != 0) ) {
+			logMessage( LOG_ERROR_LEVEL, "CART crash test failed." );
+			return( -1 );
+		}
+		return( 0 );
+	}
+
+	// Get the workload, from the trace given or the generator
+	if ( optind < argc ) {
+		result = load_workload( &wload, argv[optind] );
+	} else {
+		result = generate_workload( &wload, &opts );
+	}
+	if ( result != 0 ) {
+		return( -1 );
+	}
+	if ( generate != NULL ) {
+		return( save_workload( &wload, generate ) );
+	}
+
+	// Run it on the servers given, or in process
+	if ( (address != NULL) || (ports != NULL) ) {
+		result = client_cart_bus_servers( address, ports );
+	} else {
+		result = client_cart_bus_loopback( start_bench_controller );
+	}
+	if ( (result != 0) || (run_workload( &wload ) != 0) ) {
+		logMessage( LOG_ERROR_LEVEL, "CART benchmark failed." );
+		dump_cart_trace();
+		return( -1 );
+	}
+	dump_cart_trace();
+
+	// Return successfully
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : generate_workload
+// Description  : Generate a synthetic workload.  Each operation goes to a
+//                file drawn by Zipf popularity; a write appends until the
+//                file reaches its target size, then overwrites with a
+//                WRITEAT, near the file's last write or anywhere in it.  A
+//                read seeks anywhere in the file first, and a write that
+//                appends seeks back to the end if it has to.
+//
+// Inputs       : wload - the workload to fill
+//                opts - how to generate it
+// Outputs      : 0 if successful, -1 if failure
+
+int generate_workload(CartBenchWorkload *wload, CartBenchOptions *opts) {
+
+	// Local variables
+	double popularity[CART_BENCH_MAX_FILES], total = 0, pick, size;
+	char text[CART_BENCH_MAX_WRITE];
+	CartBenchFile *file;
+	int32_t len, off, low, high;
+	int i, f, lo, hi;
+
+	benchRandom = (opts->seed * 0x9E3779B97F4A7C15ULL) | 1;
+
+	// Name the files and draw their sizes and popularity (the cumulative weight of rank k is 1/k^skew)
+	for (i=0; i<opts->files; i++) {
+		snprintf(text, sizeof(text), "bench%02d.txt", i);
+		if ((f = find_bench_file(wload, text)) == -1) {
+			return(-1);
+		}
+		switch (opts->sizes) {
+		case CART_BENCH_FIXED:
+			size = opts->meanSize;
+			break;
+		case CART_BENCH_UNIFORM:
+			size = 1 + bench_uniform() * 2 * opts->meanSize;
+			break;
+		default:
+			size = 1 - log(1 - bench_uniform()) * opts->meanSize;
+			break;
+		}
+		wload->files[f].target = (size > CART_BENCH_MAX_SIZE) ? CART_BENCH_MAX_SIZE : (uint32_t)size;
+		total += 1 / pow(i + 1, opts->skew);
+		popularity[i] = total;
+	}
+
+	for (i=0; i<opts->operations; i++) {
+
+		// Pick the file by its popularity
+		pick = bench_uniform() * total;
+		for (lo=0, hi=opts->files-1; lo<hi; ) {
+			f = (lo + hi) / 2;
+			if (popularity[f] <= pick) {
+				lo = f + 1;
+			} else {
+				hi = f;
+			}
+		}
+		f = lo;
+		file = &wload->files[f];
+
+		// Read somewhere in the file (an empty file gets written instead)
+		if ((file->size > 0) && (bench_uniform() * 100 < opts->readPercent)) {
+			len = 1 + bench_random() % ((file->size < CART_BENCH_MAX_READ) ? file->size : CART_BENCH_MAX_READ);
+			off = bench_random() % (file->size - len + 1);
+			if ((add_bench_op(wload, f, CART_BENCH_SEEK, 0, off, NULL) != 0) ||
+					(add_bench_op(wload, f, CART_BENCH_READ, len, 0, NULL) != 0)) {
+				return(-1);
+			}
+			continue;
+		}
+
+		// Writes are runs of one character, like the assignment workload (and the frames compress as well)
+		len = 1 + bench_random() % CART_BENCH_MAX_WRITE;
+		memset(text, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"[bench_random() % 62], len);
+
+		// Grow the file to its target, then overwrite it
+		if (file->size < file->target) {
+			if (len > file->target - file->size) {
+				len = file->target - file->size;
+			}
+			if ((file->position != file->size) &&
+					(add_bench_op(wload, f, CART_BENCH_SEEK, 0, file->size, NULL) != 0)) {
+				return(-1);
+			}
+			if (add_bench_op(wload, f, CART_BENCH_WRITE, len, 0, text) != 0) {
+				return(-1);
+			}
+		} else {
+			if (len > file->size) {
+				len = file->size;
+			}
+			low = 0;
+			high = file->size - len;
+			if (bench_uniform() * 100 < opts->localPercent) {
+				low = (file->lastWrite > CART_BENCH_LOCALITY) ? file->lastWrite - CART_BENCH_LOCALITY : 0;
+				high = (high > file->lastWrite + CART_BENCH_LOCALITY) ? file->lastWrite + CART_BENCH_LOCALITY : high;
+				low = (low > high) ? high : low;
+			}
+			off = low + bench_random() % (high - low + 1);
+			if (add_bench_op(wload, f, CART_BENCH_WRITEAT, len, off, text) != 0) {
+				return(-1);
+			}
+		}
+	}
+
+	logMessage(LOG_OUTPUT_LEVEL, "Generated %d operations over %d files (seed %lu).", wload->opCount,
+		wload->fileCount, (unsigned long)opts->seed);
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : load_workload
+// Description  : Read a workload from a trace in the cart_sim format
+//
+// Inputs       : wload - the workload to fill
+//                trace - the trace file
+// Outputs      : 0 if successful, -1 if failure
+
+int load_workload(CartBenchWorkload *wload, char *trace) {
+
+	// Local variables
+	char line[1024], fname[128], command[128], *sep;
+	CartBenchKinds kind;
+	FILE *fhandle;
+	int32_t len, off;
+	int linecount = 0, f, i;
+
+	if ((fhandle = fopen(trace, "r")) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failure opening the workload file [%s], error: %s.", trace, strerror(errno));
+		return(-1);
+	}
+
+	while (fgets(line, 1024, fhandle) != NULL) {
+
+		// Parse the line the way cart_sim does
+		linecount++;
+		sep = strchr(line, ':');
+		if ((sscanf(line, "%127s %127s %d %d", fname, command, &len, &off) != 4) || (sep == NULL) ||
+				(len < 0) || (off < 0)) {
+			logMessage(LOG_ERROR_LEVEL, "CART un-parsable workload string, aborting [%s], line %d", line, linecount);
+			fclose(fhandle);
+			return(-1);
+		}
+		if (strcmp(command, "WRITEAT") == 0) {
+			kind = CART_BENCH_WRITEAT;
+		} else if (strcmp(command, "WRITE") == 0) {
+			kind = CART_BENCH_WRITE;
+		} else if (strcmp(command, "SEEK") == 0) {
+			kind = CART_BENCH_SEEK;
+		} else if (strcmp(command, "READ") == 0) {
+			kind = CART_BENCH_READ;
+		} else {
+			logMessage(LOG_ERROR_LEVEL, "CART unknown workload command [%s], line %d", command, linecount);
+			fclose(fhandle);
+			return(-1);
+		}
+		if ((kind == CART_BENCH_WRITE) || (kind == CART_BENCH_WRITEAT)) {
+			if ((len >= 1024) || (strnlen(sep+1, len) < len)) {
+				logMessage(LOG_ERROR_LEVEL, "CART workload write text too short, line %d", linecount);
+				fclose(fhandle);
+				return(-1);
+			}
+			for (i=0; i<len; i++) {
+				if (sep[i+1] == '^') {
+					sep[i+1] = '\n';
+				}
+			}
+		}
+
+		if (((f = find_bench_file(wload, fname)) == -1) ||
+				(add_bench_op(wload, f, kind, len, off, sep+1) != 0)) {
+			logMessage(LOG_ERROR_LEVEL, "CART workload operation out of place, line %d", linecount);
+			fclose(fhandle);
+			return(-1);
+		}
+	}
+
+	fclose(fhandle);
+	logMessage(LOG_OUTPUT_LEVEL, "Loaded %d operations over %d files from [%s].", wload->opCount,
+		wload->fileCount, trace);
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : save_workload
+// Description  : Write a workload out as a cart_sim trace, and beside it
+//                each file's final contents (what cart_sim validates the
+//                replayed file against)
+//
+// Inputs       : wload - the workload
+//                trace - the trace file
+// Outputs      : 0 if successful, -1 if failure
+
+int save_workload(CartBenchWorkload *wload, char *trace) {
+
+	// Local variables
+	char path[256], *slash;
+	CartBenchOp *op;
+	FILE *fhandle;
+	int i, j, dir;
+
+	if ((fhandle = fopen(trace, "w")) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failure creating the workload file [%s], error: %s.", trace, strerror(errno));
+		return(-1);
+	}
+	for (i=0; i<wload->opCount; i++) {
+		op = &wload->ops[i];
+		fprintf(fhandle, "%s %s %d %d :", wload->files[op->file].name, benchKindNames[op->kind],
+			(op->kind == CART_BENCH_SEEK) ? 0 : op->length,
+			((op->kind == CART_BENCH_SEEK) || (op->kind == CART_BENCH_WRITEAT)) ? op->offset : 0);
+		for (j=0; (op->text != NULL) && (j<op->length); j++) {
+			fputc((op->text[j] == '\n') ? '^' : op->text[j], fhandle);
+		}
+		fputc('\n', fhandle);
+	}
+	if (fclose(fhandle) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "Failure writing the workload file [%s].", trace);
+		return(-1);
+	}
+
+	// The files go in the trace's directory, where cart_sim looks for them
+	slash = strrchr(trace, '/');
+	dir = (slash == NULL) ? 0 : (int)(slash - trace + 1);
+	for (i=0; i<wload->fileCount; i++) {
+		snprintf(path, sizeof(path), "%.*s%s", dir, trace, wload->files[i].name);
+		if (((fhandle = fopen(path, "w")) == NULL) ||
+				(fwrite(wload->files[i].contents, 1, wload->files[i].size, fhandle) != wload->files[i].size) ||
+				(fclose(fhandle) != 0)) {
+			logMessage(LOG_ERROR_LEVEL, "Failure writing the workload source file [%s].", path);
+			return(-1);
+		}
+	}
+
+	logMessage(LOG_OUTPUT_LEVEL, "Wrote %d operations over %d files to [%s].", wload->opCount,
+		wload->fileCount, trace);
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_bench_file
+// Description  : Find a file of the workload by name, adding it if it is new
+//
+// Inputs       : wload - the workload
+//                name - the filename
+// Outputs      : index of the file, -1 if failure
+
+int find_bench_file(CartBenchWorkload *wload, char *name) {
+
+	// Local variables
+	int i;
+
+	for (i=0; i<wload->fileCount; i++) {
+		if (strcmp(wload->files[i].name, name) == 0) {
+			return( i );
+		}
+	}
+	if ((wload->fileCount == CART_BENCH_MAX_FILES) || (strlen(name) >= CART_MAX_PATH_LENGTH)) {
+		logMessage(LOG_ERROR_LEVEL, "Too many files, or too long a filename [%s], in the workload.", name);
+		return(-1);
+	}
+	strcpy(wload->files[wload->fileCount].name, name);
+	return( wload->fileCount++ );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : add_bench_op
+// Description  : Append an operation to the workload, applying it to its
+//                file (so the file holds what the driver's should after it)
+//
+// Inputs       : wload - the workload
+//                file - index of the file it acts on
+//                kind - what it does
+//                len - bytes read or written
+//                off - position of a SEEK or WRITEAT
+//                text - bytes written (copied), NULL for reads and seeks
+// Outputs      : 0 if successful, -1 if failure
+
+int add_bench_op(CartBenchWorkload *wload, int file, CartBenchKinds kind, int32_t len, int32_t off, char *text) {
+
+	// Local variables
+	CartBenchOp *grown, *op;
+
+	// Double the operations when they are full
+	if (wload->opCount == wload->opMax) {
+		grown = realloc(wload->ops, sizeof(CartBenchOp) * ((wload->opMax == 0) ? 1024 : wload->opMax * 2));
+		if (grown == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Failure allocating the workload operations.");
+			return(-1);
+		}
+		wload->ops = grown;
+		wload->opMax = (wload->opMax == 0) ? 1024 : wload->opMax * 2;
+	}
+
+	op = &wload->ops[wload->opCount];
+	op->file = file;
+	op->kind = kind;
+	op->length = ((kind == CART_BENCH_SEEK) ? 0 : len);
+	op->offset = (((kind == CART_BENCH_SEEK) || (kind == CART_BENCH_WRITEAT)) ? off : 0);
+	op->text = NULL;
+	if ((kind == CART_BENCH_WRITE) || (kind == CART_BENCH_WRITEAT)) {
+		if ((op->text = malloc(len)) == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Failure allocating the workload operations.");
+			return(-1);
+		}
+		memcpy(op->text, text, len);
+	}
+	if (apply_bench_op(&wload->files[file], op) != 0) {
+		free(op->text);
+		return(-1);
+	}
+	wload->opCount++;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : apply_bench_op
+// Description  : Carry out an operation on a file's contents, the way the
+//                driver does on the file (reads and seeks within the file,
+//                writes starting at most at its end)
+//
+// Inputs       : file - the file
+//                op - the operation
+// Outputs      : 0 if successful, -1 if the driver would refuse it
+
+int apply_bench_op(CartBenchFile *file, CartBenchOp *op) {
+
+	// Local variables
+	uint32_t capacity, position = file->position;
+	char *grown;
+
+	if ((op->kind == CART_BENCH_SEEK) || (op->kind == CART_BENCH_WRITEAT)) {
+		position = op->offset;
+	}
+	if ((position > file->size) || ((op->kind == CART_BENCH_READ) && (position + op->length > file->size))) {
+		return(-1);
+	}
+
+	if ((op->kind == CART_BENCH_WRITE) || (op->kind == CART_BENCH_WRITEAT)) {
+		if (position + op->length > file->capacity) {
+			for (capacity = (file->capacity == 0) ? 4096 : file->capacity; capacity < position + op->length; ) {
+				capacity *= 2;
+			}
+			if ((grown = realloc(file->contents, capacity)) == NULL) {
+				logMessage(LOG_ERROR_LEVEL, "Failure allocating the contents of file [%s].", file->name);
+				return(-1);
+			}
+			file->contents = grown;
+			file->capacity = capacity;
+		}
+		memcpy(&file->contents[position], op->text, op->length);
+		if (position + op->length > file->size) {
+			file->size = position + op->length;
+		}
+		file->lastWrite = position;
+	}
+	file->position = position + op->length;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : run_workload
+// Description  : Run a workload on the driver, timing each operation and
+//                counting the bus requests it completed, then validate the
+//                files and report throughput, latency and round trips
+//
+// Inputs       : wload - the workload (each file's contents its final ones)
+// Outputs      : 0 if successful, -1 if failure
+
+int run_workload(CartBenchWorkload *wload) {
+
+	// Local variables
+	static CartBusOpStats kinds[CART_BENCH_KINDS];
+	uint64_t trips[CART_BENCH_KINDS], started, finished, requests, elapsed = 0, bytes = 0, total;
+	char buf[1024];
+	CartBenchOp *op;
+	CartBusOpStats *stats;
+	int i, result = 0;
+
+	// Replay the contents from the beginning, checking each read against them
+	for (i=0; i<wload->fileCount; i++) {
+		wload->files[i].size = wload->files[i].position = 0;
+	}
+	memset(kinds, 0x0, sizeof(kinds));
+	memset(trips, 0x0, sizeof(trips));
+
+	if (cart_poweron() != 0) {
+		logMessage(LOG_ERROR_LEVEL, "CART benchmark failed initialization.");
+		result = -1;
+	}
+	for (i=0; (result == 0) && (i<wload->fileCount); i++) {
+		if ((wload->files[i].fhandle = cart_open(wload->files[i].name)) == -1) {
+			logMessage(LOG_ERROR_LEVEL, "Open of new file [%s] failed, aborting benchmark.", wload->files[i].name);
+			result = -1;
+		}
+	}
+	total = client_cart_bus_requests();
+
+	for (i=0; (result == 0) && (i<wload->opCount); i++) {
+		op = &wload->ops[i];
+
+		// Time the operation and count the requests that completed during it
+		requests = client_cart_bus_requests();
+		started = client_cart_bus_clock();
+		result = run_bench_op(&wload->files[op->file], op, buf);
+		finished = client_cart_bus_clock();
+		trips[op->kind] += client_cart_bus_requests() - requests;
+
+		stats = &kinds[op->kind];
+		stats->requests++;
+		stats->bytesSent += (op->kind == CART_BENCH_READ) ? 0 : op->length;
+		stats->bytesReceived += (op->kind == CART_BENCH_READ) ? op->length : 0;
+		stats->latencyTotal += finished - started;
+		if (finished - started > stats->latencyMax) {
+			stats->latencyMax = finished - started;
+		}
+		stats->latency[cart_bus_latency_bucket(finished - started)]++;
+		elapsed += finished - started;
+		bytes += op->length;
+	}
+	total = client_cart_bus_requests() - total;
+
+	// Check all of every file, then shut down and wait for the loopback controller
+	if (result == 0) {
+		result = validate_bench_files(wload);
+	}
+	if ((cart_poweroff() != 0) && (result == 0)) {
+		logMessage(LOG_ERROR_LEVEL, "CART benchmark failed shutdown.");
+		result = -1;
+	}
+	if (benchControllerRunning) {
+		pthread_join(benchController, NULL);
+		benchControllerRunning = 0;
+	}
+	if (result != 0) {
+		return(-1);
+	}
+
+	logMessage(LOG_OUTPUT_LEVEL, "Bench : %d operations over %d files in %.3f s, %.1f ops/s, %.2f MB/s, "
+		"%.2f bus round trips per operation", wload->opCount, wload->fileCount, elapsed / 1e9,
+		wload->opCount / (elapsed / 1e9), bytes / (elapsed / 1e9) / (1024 * 1024),
+		(double)total / wload->opCount);
+	for (i=0; i<CART_BENCH_KINDS; i++) {
+		stats = &kinds[i];
+		if (stats->requests == 0) {
+			continue;
+		}
+		logMessage(LOG_OUTPUT_LEVEL, "Bench [%s] : %lu operations (%lu bytes), latency us mean %.1f p50 %.1f "
+			"p99 %.1f max %.1f, %.2f bus round trips per operation", benchKindNames[i],
+			(unsigned long)stats->requests, (unsigned long)(stats->bytesSent + stats->bytesReceived),
+			stats->latencyTotal / 1e3 / stats->requests, cart_bus_latency_percentile(stats, 50) / 1e3,
+			cart_bus_latency_percentile(stats, 99) / 1e3, stats->latencyMax / 1e3,
+			(double)trips[i] / stats->requests);
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : run_bench_op
+// Description  : Perform one operation of the workload on the driver,
+//                checking what a read returns
+//
+// Inputs       : file - the file it acts on (contents as of the operation)
+//                op - the operation
+//                buf - room for a read (1024 bytes)
+// Outputs      : 0 if successful, -1 if failure
+
+int run_bench_op(CartBenchFile *file, CartBenchOp *op, char *buf) {
+
+	// Local variables
+	uint32_t position = file->position;
+
+	switch (op->kind) {
+	case CART_BENCH_SEEK:
+		if (cart_seek(file->fhandle, op->offset) != 0) {
+			logMessage(LOG_ERROR_LEVEL, "Seek in file [%s] to position %d failed.", file->name, op->offset);
+			return(-1);
+		}
+		break;
+
+	case CART_BENCH_READ:
+		if ((op->length > 1024) || (cart_read(file->fhandle, buf, op->length) != op->length) ||
+				(memcmp(buf, &file->contents[position], op->length) != 0)) {
+			logMessage(LOG_ERROR_LEVEL, "Read of file [%s], length %d at %u failed or differs.", file->name,
+				op->length, position);
+			return(-1);
+		}
+		break;
+
+	case CART_BENCH_WRITEAT:
+		if (cart_seek(file->fhandle, op->offset) != 0) {
+			logMessage(LOG_ERROR_LEVEL, "Seek/WriteAt file [%s] to position %d failed.", file->name, op->offset);
+			return(-1);
+		}
+		// Fall through to the write
+
+	default:
+		if (cart_write(file->fhandle, op->text, op->length) != op->length) {
+			logMessage(LOG_ERROR_LEVEL, "Write of file [%s], length %d failed.", file->name, op->length);
+			return(-1);
+		}
+		break;
+	}
+	return( apply_bench_op(file, op) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : validate_bench_files
+// Description  : Read every file of the workload back from the driver and
+//                compare it with what the workload left in it
+//
+// Inputs       : wload - the workload, run
+// Outputs      : 0 if successful, -1 if failure
+
+int validate_bench_files(CartBenchWorkload *wload) {
+
+	// Local variables
+	CartBenchFile *file;
+	char *membuf;
+	int i;
+
+	for (i=0; i<wload->fileCount; i++) {
+		file = &wload->files[i];
+		if ((membuf = malloc(file->size + 1)) == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], failed buffer allocation.", file->name);
+			return(-1);
+		}
+		if ((cart_seek(file->fhandle, 0) != 0) ||
+				(cart_read(file->fhandle, membuf, file->size) != (int32_t)file->size) ||
+				(memcmp(membuf, file->contents, file->size) != 0)) {
+			logMessage(LOG_ERROR_LEVEL, "Validation of [%s], length %u failed.", file->name, file->size);
+			free(membuf);
+			return(-1);
+		}
+		free(membuf);
+	}
+	logMessage(LOG_OUTPUT_LEVEL, "Validated %d files.", wload->fileCount);
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : run_crash_test
+// Description  : Crash the driver while files come and go, once for each
+//                filename length (so the journal fills at a different
+//                record each time), and check each store mounts with the
+//                file left open in it intact
+//
+// Inputs       : store - the backing file of the loopback carts
+// Outputs      : 0 if successful, -1 if failure
+
+int run_crash_test(char *store) {
+
+	// Local variables
+	int length;
+
+	// The write-through cache has every frame on the carts when the crash comes
+	set_cart_cache_mode(CART_CACHE_WRITETHROUGH);
+	for (length=1; length<=CART_BENCH_CRASH_NAMES; length++) {
+		unlink(store);
+		if ((run_crash_step(crash_bench_store, length) != 0) || (run_crash_step(mount_bench_store, length) != 0)) {
+			logMessage(LOG_ERROR_LEVEL, "Crash test with %d character filenames failed.", length);
+			return(-1);
+		}
+	}
+	unlink(store);
+	logMessage(LOG_OUTPUT_LEVEL, "Crash test : the store mounted after each of %d crashes.", CART_BENCH_CRASH_NAMES);
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : run_crash_step
+// Description  : Run a step of a crash test in a child process, which ends
+//                without powering off or cleaning up, as a crash would
+//
+// Inputs       : step - the step
+//                length - filename length of the test
+// Outputs      : 0 if the step succeeded, -1 if failure
+
+int run_crash_step(int (*step)(int), int length) {
+
+	// Local variables
+	pid_t child;
+	int status;
+
+	if ((child = fork()) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "Failure starting a crash test: %s.", strerror(errno));
+		return(-1);
+	}
+	if (child == 0) {
+		_exit((step(length) == 0) ? 0 : 1);
+	}
+	if ((waitpid(child, &status, 0) != child) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+		return(-1);
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crash_bench_store
+// Description  : Format the store and leave a file open in it, then open,
+//                write and close files of one name until the metadata
+//                journal has been checkpointed over and over
+//
+// Inputs       : length - length of the filename
+// Outputs      : 0 if successful, -1 if failure
+
+int crash_bench_store(int length) {
+
+	// Local variables
+	char name[CART_MAX_PATH_LENGTH], kept[CART_BENCH_CRASH_SIZE], text[10] = "0123456789";
+	int16_t fh;
+	int i;
+
+	for (i=0; i<CART_BENCH_CRASH_SIZE; i++) {
+		kept[i] = (char)(i % 251);
+	}
+	memset(name, 'f', length);
+	name[length] = '\0';
+
+	if ((cart_poweron() != 0) || ((fh = cart_open(CART_BENCH_CRASH_KEPT)) == -1) ||
+			(cart_write(fh, kept, CART_BENCH_CRASH_SIZE) != CART_BENCH_CRASH_SIZE)) {
+		logMessage(LOG_ERROR_LEVEL, "Failure setting up the crash test store.");
+		return(-1);
+	}
+	for (i=0; i<CART_BENCH_CRASH_CYCLES; i++) {
+		if (((fh = cart_open(name)) == -1) || (cart_write(fh, text, sizeof(text)) != sizeof(text)) ||
+				(cart_close(fh) != 0)) {
+			logMessage(LOG_ERROR_LEVEL, "Crash test file [%s] failed at cycle %d.", name, i);
+			return(-1);
+		}
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mount_bench_store
+// Description  : Mount the store a crash left, and check the file left open
+//                in it still holds what was written
+//
+// Inputs       : length - length of the filename the crash test used
+// Outputs      : 0 if successful, -1 if failure
+
+int mount_bench_store(int length) {
+
+	// Local variables
+	char buf[CART_BENCH_CRASH_SIZE];
+	int16_t fh;
+	int i;
+
+	set_cart_poweron_mode(CART_POWERON_MOUNT);
+	if (cart_poweron() != 0) {
+		logMessage(LOG_ERROR_LEVEL, "Mounting the store crashed with %d character filenames failed.", length);
+		return(-1);
+	}
+	if (((fh = cart_open(CART_BENCH_CRASH_KEPT)) == -1) ||
+			(cart_read(fh, buf, CART_BENCH_CRASH_SIZE) != CART_BENCH_CRASH_SIZE)) {
+		logMessage(LOG_ERROR_LEVEL, "File [%s] missing from the mounted store.", CART_BENCH_CRASH_KEPT);
+		return(-1);
+	}
+	for (i=0; i<CART_BENCH_CRASH_SIZE; i++) {
+		if (buf[i] != (char)(i % 251)) {
+			logMessage(LOG_ERROR_LEVEL, "File [%s] of the mounted store differs at offset %d.", CART_BENCH_CRASH_KEPT, i);
+			return(-1);
+		}
+	}
+	return( cart_poweroff() );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : start_bench_controller
+// Description  : Start the loopback controller serving the bus's socket pair
+//                (called by the bus at INITMS)
+//
+// Inputs       : sock - the controller's end of the socket pair
+// Outputs      : 0 if successful, -1 if failure
+
+int start_bench_controller(int sock) {
+
+	// The carts of each run start out zeroed, kept by no file (unless crash testing)
+	cart_server_store = benchStore;
+	if (pthread_create(&benchController, NULL, serve_bench_controller, (void *)(intptr_t)sock) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "Failure starting the loopback controller: %s.", strerror(errno));
+		close(sock);
+		return(-1);
+	}
+	benchControllerRunning = 1;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serve_bench_controller
+// Description  : Thread serving the loopback controller until the bus
+//                closes its end at POWOFF
+//
+// Inputs       : arg - the controller's socket
+// Outputs      : NULL
+
+void *serve_bench_controller(void *arg) {
+
+	cart_server_loopback((int)(intptr_t)arg);
+	return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_random
+// Description  : Next value of the generator (xorshift64*), the same on
+//                every platform so a seed always gives the same workload
+//
+// Inputs       : none
+// Outputs      : 64 random bits
+
+uint64_t bench_random(void) {
+
+	benchRandom ^= benchRandom >> 12;
+	benchRandom ^= benchRandom << 25;
+	benchRandom ^= benchRandom >> 27;
+	return( benchRandom * 0x2545F4914F6CDD1DULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_uniform
+// Description  : Next value of the generator as a number in [0, 1)
+//
+// Inputs       : none
+// Outputs      : the number
+
+double bench_uniform(void) {
+
+	return( (bench_random() >> 11) * (1.0 / 9007199254740992.0) );
+}
@@ -13,17 +13,38 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 // Project includes
 #include "cart_cache.h"
 #include "cart_driver.h"
 #include "cart_controller.h"
+#include "cart_trace.h"
 #include "cmpsc311_log.h"
 #include "cmpsc311_util.h"
 
 // Defines
-#define CACHE_MAX_OPEN_FILES 128
+#define CACHE_MAX_FRAMES (CART_MAX_CARTRIDGES * CART_CARTRIDGE_SIZE)	// enough to cache every frame in CART memory
+#define CACHE_SLAB_FRAMES 64		// number of frames allocated together in one slab of frame storage
+#define CACHE_LINE_SIZE 64			// CPU cache line size used to align metadata and frame slabs
+#define CACHE_NO_ENTRY -1			// marks an empty hash bucket or the end of a hash chain or list
+#define CACHE_HASH_MULTIPLIER 0x9E3779B1	// Fibonacci hashing multiplier for spreading cart/frame tags
+#define CACHE_MAX_SHARDS 64			// most lock stripes the cache can be split into
+
+// Policy lists, shared by the replacement policies (resident lists T1/T2, ghost lists B1/B2)
+#define CACHE_LIST_T1 0				// LRU and CLOCK list, 2Q A1in, ARC T1 (resident)
+#define CACHE_LIST_T2 1				// 2Q Am, ARC T2 (resident)
+#define CACHE_LIST_B1 2				// 2Q A1out, ARC B1 (ghost tags)
+#define CACHE_LIST_B2 3				// ARC B2 (ghost tags)
+#define CACHE_MAX_LISTS 4
+#define CACHE_LIST_NONE 0x07		// entry is not on any list
+
+// Per entry state bits
+#define CACHE_STATE_LIST 0x07		// which policy list the entry is on
+#define CACHE_STATE_REF 0x08		// CLOCK reference bit
+#define CACHE_STATE_DIRTY 0x10		// frame was written in write-back mode and not yet sent to CART memory
 
 // Enumerations
 typedef enum Flag {
@@ -32,31 +53,140 @@ typedef enum Flag {
 } Flag;
 
 // Structures
+//   Cache metadata is kept apart from the frame slabs and packed into 16 bytes
+//   per entry (four entries per cache line), so hash probes and recency list
+//   updates never pull the 1 KB cached frames into the CPU cache.
 typedef struct CacheTable{
-		CartFrame			cachedFrame;		// holds the cached frame
-		uint32_t			cacheHandle;		// holds a unique identifier for cart/frame 
-
-		CartridgeIndex		cartIndex;			// tracks where the frame belongs in CART memory
-		CartFrameIndex		frameIndex;			// tracks where the frame belongs in CART memory
-
-		Flag				isUsed;				// holds state if the frame is in the cache
-		int					lru;				// holds lruCounter, lower number is LRU
-} CacheTable;
+		uint32_t			cacheHandle;		// holds a unique identifier for cart/frame (see create_cache_tag)
+		int32_t				hashNext;			// next entry in the same hash bucket chain
+		int32_t				lruPrev;			// next more recently used entry on the entry's list
+		int32_t				lruNext;			// next less recently used entry (or next free entry)
+} __attribute__((aligned(16))) CacheTable;
+
+typedef struct CacheIndex{
+		CacheTable			*entries;			// metadata array, indexed by entry
+		uint8_t				*state;				// policy list and state bits for each entry
+		int32_t				*buckets;			// hash index of cacheHandle tags to entries
+		uint32_t			hashBits;			// log2 of the number of buckets in the hash index
+		uint32_t			capacity;			// maximum number of entries
+		uint32_t			highWater;			// number of entries handed out so far; entries above it are untouched
+		int32_t				freeHead;			// first entry of the list of unused entries
+} CacheIndex;
+
+typedef struct CacheList{
+		int32_t				head;				// most recently used (or inserted) entry
+		int32_t				tail;				// least recently used entry, next to be evicted
+		uint32_t			length;				// number of entries on the list
+} CacheList;
+
+typedef struct CachePolicy{
+		const char			*name;				// name used to select the policy
+		void				(*hit)(int32_t entry);				// a resident frame was referenced
+		int32_t				(*admit)(uint32_t tag, Flag full);	// a missing frame is coming in, chooses the victim if full
+		void				(*insert)(int32_t entry);			// link the admitted frame's new entry
+} CachePolicy;
+
+//   The cache is striped over shards by tag, each a complete cache of its share
+//   of the frames run by the policy under its own lock, so callers working on
+//   different frames rarely contend.  The functions below the interface work on
+//   the shard the calling thread has locked (cacheShard).
+typedef struct CacheShard{
+		pthread_mutex_t		lock;				// held while the shard is used
+		CacheIndex			cacheIndex;			// resident frames, indexed by tag
+		CacheIndex			ghostIndex;			// tags of recently evicted frames (2Q and ARC history)
+		CacheList			cacheLists[CACHE_MAX_LISTS];	// policy lists (T1/T2 over cacheIndex, B1/B2 over ghostIndex)
+		CartFrame			**cacheSlabs;		// slabs of frame storage, allocated as the shard fills
+		uint16_t			*cachePins;			// outstanding pin_cart_cache references to each resident entry
+		uint32_t			shardSize;			// frames the shard holds
+		uint32_t			cacheSlabCount;		// number of frame slabs allocated so far
+		int					cacheAdmitList;		// list the admitted frame goes onto once it has an entry
+		int32_t				cacheAdmitGhost;	// ghost of the admitted frame, forgotten once the admission commits
+		uint32_t			cacheAdmitTarget;	// ARC target size of T1 once the admission commits
+		int					cacheAdmitTrim;		// ghost list whose oldest tag the admission forgets, or CACHE_LIST_NONE
+		int					cacheVictimGhost;	// ghost list remembering the victim's tag, or CACHE_LIST_NONE
+		uint32_t			cacheVictimLimit;	// length the victim's ghost list is trimmed back to
+		uint32_t			arcTarget;			// ARC adaptive target size of T1
+		uint64_t			cacheHits;			// lookups that found the frame cached
+		uint64_t			cacheMisses;		// lookups that did not
+		uint64_t			cacheInserts;		// frames placed in the shard
+		uint64_t			cacheEvictions;		// frames evicted to make room
+		uint64_t			cacheWritebacks;	// dirty frames written back
+		CartFrame			last_cached_frame;	// holds the last cached frame if needed when deleting from cache
+} __attribute__((aligned(CACHE_LINE_SIZE))) CacheShard;
+
+// A dirty frame found by flush_cart_cache
+typedef struct CacheDirtyFrame{
+		uint32_t			tag;				// cart/frame of the frame
+		uint32_t			shard;				// shard holding it
+		int32_t				entry;				// its entry in the shard
+} CacheDirtyFrame;
 
 // Global Structures
-CacheTable		*cacheMemory = NULL;
+CacheShard		*cacheShards = NULL;		// the lock stripes of the cache
+__thread CacheShard	*cacheShard = NULL;		// shard locked by the calling thread
 
 // Global Variables
-CartFrame		last_cached_frame;	// holds the last cached frame if needed when deleting from cache
 uint32_t		cacheSize = 0;		// holds the size of the cache in number of frames
+uint32_t		cacheShardCount = 1;	// number of shards the cache is striped over
 Flag			cacheInit = NO;		// holds the state if cache is initialized or not
-int				lruCounter = 0;		// updates every access to maintain cache policy
+CartCacheStats	cacheTotals;		// counted by the shards of the caches already closed
+uint32_t		unitTestWrites = 0;	// frames written back through unit_test_writer
+uint32_t		unitTestLastTag = 0;	// tag of the last frame written back through unit_test_writer
+uint32_t		unitTestFailures = 0;	// writes unit_test_writer fails before it succeeds again
+CartCacheModes	cacheMode = CART_CACHE_WRITETHROUGH;	// when written frames reach CART memory
+CartCacheWriter	cacheWriter = NULL;	// driver callback writing a frame to CART memory
 
 // Local Project Functions
 void * delete_cart_cache(CartridgeIndex cart, CartFrameIndex blk);
 
 // My Project Functions
+CacheShard * lock_cache_shard(CartridgeIndex cart, CartFrameIndex frm);
+void unlock_cache_shard(void);
+int32_t lookup_cache_entry(CartridgeIndex cart, CartFrameIndex frm, Flag reference);
+int store_cache_frame(CartridgeIndex cart, CartFrameIndex frm, void *buf, Flag dirty);
+int write_back_entry(int32_t entry);
+int compare_cache_tags(const void *a, const void *b);
+int unit_test_writer(CartridgeIndex cart, CartFrameIndex frm, void *frame);
 uint32_t create_cache_tag(CartridgeIndex cart, CartFrameIndex frame);
+uint32_t hash_cache_tag(CacheIndex *idx, uint32_t tag);
+int init_cache_index(CacheIndex *idx, uint32_t capacity);
+void close_cache_index(CacheIndex *idx);
+int32_t find_cache_entry(CacheIndex *idx, uint32_t tag);
+void insert_cache_entry(CacheIndex *idx, int32_t entry);
+void remove_cache_entry(CacheIndex *idx, int32_t entry);
+int32_t take_cache_entry(CacheIndex *idx);
+void free_cache_entry(CacheIndex *idx, int32_t entry);
+void link_list_entry(CacheIndex *idx, int list, int32_t entry);
+void unlink_list_entry(CacheIndex *idx, int32_t entry);
+int32_t peek_list_tail(CacheIndex *idx, int list);
+int32_t pop_list_tail(CacheIndex *idx, int list);
+int32_t pick_resident_victim(int list, int *from);
+char * cache_frame(int32_t entry);
+int32_t alloc_cache_entry(void);
+void release_cache_entry(int32_t entry);
+void add_ghost_tag(int list, uint32_t tag);
+void drop_ghost_tail(int list);
+void commit_admission(int32_t victim);
+
+// Replacement Policies
+void lru_hit(int32_t entry);
+int32_t lru_admit(uint32_t tag, Flag full);
+void clock_hit(int32_t entry);
+int32_t clock_admit(uint32_t tag, Flag full);
+void twoq_hit(int32_t entry);
+int32_t twoq_admit(uint32_t tag, Flag full);
+void arc_hit(int32_t entry);
+int32_t arc_admit(uint32_t tag, Flag full);
+int32_t arc_replace(Flag inB2);
+void policy_insert(int32_t entry);
+
+CachePolicy		cachePolicies[CART_CACHE_MAXPOLICY] = {
+		{ "lru",	lru_hit,	lru_admit,		policy_insert },
+		{ "clock",	clock_hit,	clock_admit,	policy_insert },
+		{ "2q",		twoq_hit,	twoq_admit,		policy_insert },
+		{ "arc",	arc_hit,	arc_admit,		policy_insert }
+};
+CachePolicy		*cachePolicy = &cachePolicies[CART_CACHE_LRU];	// replacement policy in use
 
 //
 // Functions
@@ -75,7 +205,7 @@ uint32_t create_cache_tag(CartridgeIndex cart, CartFrameIndex frame);
 int set_cart_cache_size(uint32_t max_frames) {
 
 	// Illegal cache size requested (less than 0 or greater than cache size limit)
-	if(max_frames < 0 ||  max_frames > CACHE_MAX_OPEN_FILES){
+	if(max_frames < 0 ||  max_frames > CACHE_MAX_FRAMES){
 		logMessage(LOG_ERROR_LEVEL, "\nIllegal cache size requested: %u \n", max_frames);
 		return(-1);
 	}
@@ -94,6 +224,133 @@ int set_cart_cache_size(uint32_t max_frames) {
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_cart_cache_size
+// Description  : Report the size of the cache
+//
+// Inputs       : none
+// Outputs      : the number of frames the cache holds
+//
+////////////////////////////////////////////////////////////////////////////////
+uint32_t get_cart_cache_size(void) {
+	return (cacheSize);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_cache_shards
+// Description  : Set how many lock stripes the cache is split into (must be
+//                called before init); each shard runs the replacement policy
+//                over its share of the frames
+//
+// Inputs       : shards - the number of shards (1 for a single policy over the whole cache)
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int set_cart_cache_shards(uint32_t shards) {
+
+	if (cacheInit == YES || shards == 0 || shards > CACHE_MAX_SHARDS) {
+		logMessage(LOG_ERROR_LEVEL, "\nIllegal cache shard count requested: %u \n", shards);
+		return(-1);
+	}
+	cacheShardCount = shards;
+	return (0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_cache_policy
+// Description  : Select the cache replacement policy (must be called before init)
+//
+// Inputs       : name - the name of the policy (lru, clock, 2q or arc)
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int set_cart_cache_policy(const char *name) {
+
+	// Local Variables
+	int		i = 0;
+
+	// Check the cache is not already using a policy
+	if (cacheInit == YES) {
+		logMessage(LOG_ERROR_LEVEL, "\nCannot change the cache policy of an initialized cache\n");
+		return(-1);
+	}
+
+	// Find the policy by name
+	for (i = 0; i < CART_CACHE_MAXPOLICY; i++) {
+		if (strcasecmp(name, cachePolicies[i].name) == 0) {
+			cachePolicy = &cachePolicies[i];
+			return (0);
+		}
+	}
+
+	logMessage(LOG_ERROR_LEVEL, "\nUnknown cache replacement policy requested: %s \n", name);
+	return (-1);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_cache_mode
+// Description  : Select write-through or write-back caching of written frames
+//                (must be called before init)
+//
+// Inputs       : mode - CART_CACHE_WRITETHROUGH or CART_CACHE_WRITEBACK
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int set_cart_cache_mode(CartCacheModes mode) {
+
+	// Check the mode is legal and the cache holds no dirty frames yet
+	if (mode != CART_CACHE_WRITETHROUGH && mode != CART_CACHE_WRITEBACK) {
+		logMessage(LOG_ERROR_LEVEL, "\nIllegal cache mode requested: %d \n", mode);
+		return(-1);
+	}
+	if (cacheInit == YES) {
+		logMessage(LOG_ERROR_LEVEL, "\nCannot change the cache mode of an initialized cache\n");
+		return(-1);
+	}
+
+	cacheMode = mode;
+	return (0);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_cart_cache_mode
+// Description  : Report whether written frames are cached write-through or
+//                write-back
+//
+// Inputs       : none
+// Outputs      : the cache mode
+//
+////////////////////////////////////////////////////////////////////////////////
+CartCacheModes get_cart_cache_mode(void) {
+	return (cacheMode);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_cache_writer
+// Description  : Register the function used to write dirty frames back to
+//                CART memory
+//
+// Inputs       : writer - writes one frame to its cart/frame in CART memory
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int set_cart_cache_writer(CartCacheWriter writer) {
+	cacheWriter = writer;
+	return (0);
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : init_cart_cache
@@ -106,32 +363,53 @@ int set_cart_cache_size(uint32_t max_frames) {
 int init_cart_cache(void) {
 
 	// Local Variables;
-	int		i = 0;
+	int			i = 0;
+	uint32_t	shard = 0;
+	uint32_t	shards = (cacheSize < cacheShardCount) ? 1 : cacheShardCount;	// never more shards than frames
 
 	// Check to make sure we aren't initializing the cache multiple times (without cart_poweroff to clean up)
 	if(cacheInit == YES){
 		logMessage(LOG_ERROR_LEVEL, "\nAttempt to initialize the cache more than one time without cart_poweroff!\n");
-		return(-1);			
+		return(-1);
 	}
 
 	// If frame memory is not NULL, cache existed before
-	if(cacheMemory != NULL){
+	if(cacheShards != NULL){
 		logMessage(LOG_ERROR_LEVEL, "\ncacheMemory is not NULL and might have to change cache size dynamically\n");
-		return(-1);		
+		return(-1);
 	}
+	cacheShards = aligned_alloc(CACHE_LINE_SIZE, sizeof(CacheShard) * shards);
+	if (cacheShards == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "\nUnable to allocate cache shards in init_cart_cache\n");
+		return(-1);
+	}
+	memset(cacheShards, 0x0, sizeof(CacheShard) * shards);
+	cacheShardCount = shards;
+
+	for (shard = 0; shard < shards; shard++) {
+		cacheShard = &cacheShards[shard];
+		cacheShard->shardSize = cacheSize / shards + ((shard < cacheSize % shards) ? 1 : 0);
+		pthread_mutex_init(&cacheShard->lock, NULL);
+
+		// Setup the resident and ghost indexes (ARC remembers up to twice the shard size in tags)
+		cacheShard->cacheSlabs = calloc((cacheShard->shardSize + CACHE_SLAB_FRAMES - 1) / CACHE_SLAB_FRAMES, sizeof(CartFrame *));
+		cacheShard->cachePins = calloc(cacheShard->shardSize + 1, sizeof(uint16_t));
+		if ((cacheShard->shardSize > 0 && cacheShard->cacheSlabs == NULL) || cacheShard->cachePins == NULL ||
+				init_cache_index(&cacheShard->cacheIndex, cacheShard->shardSize) != 0 ||
+				init_cache_index(&cacheShard->ghostIndex, cacheShard->shardSize * 2) != 0) {
+			logMessage(LOG_ERROR_LEVEL, "\nUnable to allocate cache memory of size %u in init_cart_cache\n", cacheSize);
+			return(-1);
+		}
 
-	// Allocate enough space to hold frame memory
-	cacheMemory = calloc(cacheSize, sizeof(CacheTable));
-
-	// Zero out data members of cache memory structure anyway
-	for(i = 0; i < cacheSize; i++){
-		strncpy(cacheMemory[i].cachedFrame, "", sizeof(CartFrame));
-		cacheMemory[i].cacheHandle	=		0;
-		cacheMemory[i].cartIndex	=		0;
-		cacheMemory[i].frameIndex	=		0;
-		cacheMemory[i].isUsed		=		NO;		
-		cacheMemory[i].lru			=		-1;
+		// No entries handed out yet, so the policy lists start empty
+		for (i = 0; i < CACHE_MAX_LISTS; i++) {
+			cacheShard->cacheLists[i].head = CACHE_NO_ENTRY;
+			cacheShard->cacheLists[i].tail = CACHE_NO_ENTRY;
+			cacheShard->cacheLists[i].length = 0;
+		}
+		cacheShard->cacheAdmitList = CACHE_LIST_T1;
 	}
+	cacheShard = NULL;
 
 	// Set cache initialized flag to YES
 	cacheInit = YES;
@@ -153,27 +431,58 @@ int init_cart_cache(void) {
 int close_cart_cache(void) {
 
 	// Local Variables;
-	int		i = 0;
+	int			i = 0;
+	uint32_t	shard = 0;
+	uint64_t	hits = 0, misses = 0;
+	Flag		pinned = NO, dirty = NO;
+
+	if (cacheShards == NULL)
+		return (0);
+
+	for (shard = 0; shard < cacheShardCount; shard++) {
+		cacheShard = &cacheShards[shard];
+		hits += cacheShard->cacheHits;
+		misses += cacheShard->cacheMisses;
+		cacheTotals.hits += cacheShard->cacheHits;
+		cacheTotals.misses += cacheShard->cacheMisses;
+		cacheTotals.inserts += cacheShard->cacheInserts;
+		cacheTotals.evictions += cacheShard->cacheEvictions;
+		cacheTotals.writebacks += cacheShard->cacheWritebacks;
+
+		// Frames still pinned are about to be freed under their users, dirty frames still cached are lost
+		for (i = 0; i < cacheShard->cacheIndex.highWater; i++) {
+			if (cacheShard->cachePins[i] > 0)
+				pinned = YES;
+			if (cacheShard->cacheIndex.state[i] & CACHE_STATE_DIRTY)
+				dirty = YES;
+		}
 
-	// Zero out data members anyway
-	for(i = 0; i < cacheSize; i++){
-		strncpy(cacheMemory[i].cachedFrame, "", sizeof(CartFrame));
-		cacheMemory[i].cacheHandle = 0;
-		cacheMemory[i].cartIndex = 0;
-		cacheMemory[i].frameIndex = 0;
-		cacheMemory[i].isUsed = NO;
-		cacheMemory[i].lru = -1;
+		// Free the frame slabs that were allocated and the heap memory
+		for (i = 0; i < cacheShard->cacheSlabCount; i++)
+			free(cacheShard->cacheSlabs[i]);
+		free(cacheShard->cacheSlabs);
+		free(cacheShard->cachePins);
+		close_cache_index(&cacheShard->cacheIndex);
+		close_cache_index(&cacheShard->ghostIndex);
+		pthread_mutex_destroy(&cacheShard->lock);
 	}
-
-	// Free the heap memory
-	free(cacheMemory);
-	cacheMemory = NULL;
-
-	// Check to make sure we successfully free'd the heap data
-	if(cacheMemory != NULL){
-		logMessage(LOG_ERROR_LEVEL, "\ncacheMemory is not NULL when it should have been free'd in close_cart_cache !\n");
-		return(-1);			
+	cacheShard = NULL;
+	free(cacheShards);
+	cacheShards = NULL;
+
+	// Report how well the replacement policy did
+	if (hits + misses > 0) {
+		logMessage(LOG_OUTPUT_LEVEL, "Cache policy [%s] size %u : %lu hits, %lu misses (%.2f%% hit ratio)",
+				cachePolicy->name, cacheSize, (unsigned long)hits, (unsigned long)misses,
+				(100.0 * hits) / (hits + misses));
 	}
+	if (pinned == YES)
+		logMessage(LOG_ERROR_LEVEL, "\nClosing the cache with pinned frames still referenced (missing unpin_cart_cache)\n");
+	if (dirty == YES)
+		logMessage(LOG_ERROR_LEVEL, "\nClosing the cache without flushing dirty frames (call flush_cart_cache)\n");
+
+	// Allow the cache to be initialized again
+	cacheInit = NO;
 
 	// Return successfully
 	return (0);
@@ -193,64 +502,176 @@ int close_cart_cache(void) {
 ////////////////////////////////////////////////////////////////////////////////
 int put_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *buf) {
 
-	// Local Variables
-	int			i = 0;
-	int			*resp;
-	CacheTable	temp;
-	Flag		completed = NO;
+	// The frame matches CART memory, so any earlier dirty copy is now clean
+	return (store_cache_frame(cart, frm, buf, NO));
+}
 
-	// Always update lruCounter with every cache access
-	lruCounter++;
 
-	// Create the cache tag for requested cart and frame coupling in CART system
-	temp.cacheHandle = create_cache_tag(cart, frm);
-
-	// Scan cache for space, make space for incoming frame according to cache policy if necessary
-	while (completed == NO) {
-	search:
-		// Search to see if space exists in the cache to write to
-		for (i = 0; i < cacheSize; i++) {
-			// Found a frame in the cache that is not in use so put it here
-			if (cacheMemory[i].isUsed == NO) {
-				strncpy(cacheMemory[i].cachedFrame, (char *)buf, sizeof(CartFrame));
-				cacheMemory[i].cacheHandle	= temp.cacheHandle;
-				cacheMemory[i].cartIndex	= cart;
-				cacheMemory[i].frameIndex	= frm;
-				cacheMemory[i].isUsed		= YES;
-				cacheMemory[i].lru			= lruCounter;
-				goto finished;
-			}
-		}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_dirty_cart_cache
+// Description  : Put a written frame into the cache without sending it to
+//                CART memory; it is written back on eviction or flush.  With
+//                no cache the frame is written through immediately.
+//
+// Inputs       : cart - the cartridge number of the frame to cache
+//                frm - the frame number of the frame to cache
+//                buf - the buffer to insert into the cache
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int put_dirty_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *buf) {
 
-		if (cacheSize == 0)
-			return (0);
+	// Check a writer exists to eventually get the frame to CART memory
+	if (cacheWriter == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "\nNo cache writer registered for write-back in put_dirty_cart_cache\n");
+		return (-1);
+	}
+
+	// Nowhere to hold the frame, so fall back to writing it through
+	if (cacheSize == 0 || cacheInit != YES)
+		return (cacheWriter(cart, frm, buf));
 
-		// No space exists so eject the LRU entry
-		temp.lru = cacheMemory[0].lru;
-		temp.cartIndex = cacheMemory[0].cartIndex;
-		temp.frameIndex = cacheMemory[0].frameIndex;
-
-		// Search if an entry in the cache is less frequently used before ejecting
-		for (i = 0; i < cacheSize; i++) {
-			if (cacheMemory[i].lru < temp.lru) {
-				temp.lru = cacheMemory[i].lru;
-				temp.cartIndex = cacheMemory[i].cartIndex;
-				temp.frameIndex = cacheMemory[i].frameIndex;
+	return (store_cache_frame(cart, frm, buf, YES));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_cart_cache
+// Description  : Write every dirty frame back to CART memory, grouped by cart.
+//                Every shard lock is held for the whole flush (each frame a
+//                bus round trip), so other cache users wait until it is done.
+//
+// Inputs       : none
+// Outputs      : number of frames written if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int flush_cart_cache(void) {
+
+	// Local Variables
+	CacheDirtyFrame	*dirty = NULL;
+	uint32_t		i = 0, shard = 0, count = 0;
+	int				result = 0;
+
+	if (cacheInit != YES)
+		return (0);
+
+	// Hold every shard (in shard order, one lookup never takes two) while writing back
+	dirty = malloc(sizeof(CacheDirtyFrame) * (cacheSize + 1));
+	if (dirty == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "\nUnable to allocate flush list in flush_cart_cache\n");
+		return (-1);
+	}
+	for (shard = 0; shard < cacheShardCount; shard++)
+		pthread_mutex_lock(&cacheShards[shard].lock);
+
+	// Collect the dirty entries and order them by tag, i.e. by cart and then frame
+	for (shard = 0; shard < cacheShardCount; shard++) {
+		for (i = 0; i < cacheShards[shard].cacheIndex.highWater; i++) {
+			if (cacheShards[shard].cacheIndex.state[i] & CACHE_STATE_DIRTY) {
+				dirty[count].tag = cacheShards[shard].cacheIndex.entries[i].cacheHandle;
+				dirty[count].shard = shard;
+				dirty[count++].entry = (int32_t)i;
 			}
 		}
+	}
+	qsort(dirty, count, sizeof(CacheDirtyFrame), compare_cache_tags);
+
+	// Write them back one cart at a time
+	for (i = 0; i < count && result == 0; i++) {
+		cacheShard = &cacheShards[dirty[i].shard];
+		if (write_back_entry(dirty[i].entry) != 0)
+			result = -1;
+	}
+
+	cacheShard = NULL;
+	for (shard = 0; shard < cacheShardCount; shard++)
+		pthread_mutex_unlock(&cacheShards[shard].lock);
+	free(dirty);
+	return ((result == 0) ? (int)count : -1);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : store_cache_frame
+// Description  : Place a frame into the cache, evicting (and writing back) a
+//                victim chosen by the replacement policy if full
+//
+// Inputs       : cart - the cartridge number of the frame to cache
+//                frm - the frame number of the frame to cache
+//                buf - the buffer to insert into the cache
+//                dirty - YES if the frame is not yet in CART memory
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int store_cache_frame(CartridgeIndex cart, CartFrameIndex frm, void *buf, Flag dirty) {
+
+	// Local Variables
+	int32_t		entry = 0;
+	int32_t		victim = CACHE_NO_ENTRY;
+	uint32_t	tag = 0;
+
+	if (cacheSize == 0 || cacheInit != YES)
+		return (0);
+
+	// Create the cache tag for requested cart and frame coupling in CART system
+	tag = create_cache_tag(cart, frm);
+	lock_cache_shard(cart, frm);
+
+	// Frame is already cached so refresh the copy in place and count it as a reference
+	if ((entry = find_cache_entry(&cacheShard->cacheIndex, tag)) != CACHE_NO_ENTRY) {
+		memcpy(cache_frame(entry), buf, sizeof(CartFrame));
+		cacheShard->cacheIndex.state[entry] = (dirty == YES) ? (cacheShard->cacheIndex.state[entry] | CACHE_STATE_DIRTY) :
+				(cacheShard->cacheIndex.state[entry] & ~CACHE_STATE_DIRTY);
+		cachePolicy->hit(entry);
+		unlock_cache_shard();
+		return (0);
+	}
+
+	// Let the replacement policy pick a victim if no space exists, noting (not yet making) its history changes
+	cacheShard->cacheAdmitGhost = CACHE_NO_ENTRY;
+	cacheShard->cacheAdmitTarget = cacheShard->arcTarget;
+	cacheShard->cacheAdmitTrim = CACHE_LIST_NONE;
+	cacheShard->cacheVictimGhost = CACHE_LIST_NONE;
+	cacheShard->cacheVictimLimit = UINT32_MAX;
+	victim = cachePolicy->admit(tag, (cacheShard->cacheIndex.freeHead == CACHE_NO_ENTRY &&
+			cacheShard->cacheIndex.highWater == cacheShard->shardSize) ? YES : NO);
+	if (victim == CACHE_NO_ENTRY && cacheShard->cacheIndex.freeHead == CACHE_NO_ENTRY && cacheShard->cacheIndex.highWater == cacheShard->shardSize) {
+		logMessage(LOG_ERROR_LEVEL, "\nNo frame can be evicted in store_cache_frame : every cached frame is pinned\n");
+		unlock_cache_shard();
+		return (-1);
+	}
 
-		// Eject LRU entry in cache to make room for new frame
-		resp = (int *)delete_cart_cache(temp.cartIndex, temp.frameIndex);
-		if (resp == NULL)
-			return (-1);
+	// A dirty victim has to reach CART memory before its entry is reused; the writer
+	// is a bus round trip made under the shard lock.  If it fails the victim is still
+	// on its list and nothing of the admission has happened, so the cache is unchanged.
+	if (victim != CACHE_NO_ENTRY && write_back_entry(victim) != 0) {
+		unlock_cache_shard();
+		return (-1);
+	}
+	commit_admission(victim);
+	if (victim != CACHE_NO_ENTRY) {
+		release_cache_entry(victim);
+		cacheShard->cacheEvictions++;
+	}
 
-		// Put new frame entry into cache with newest lruCounter
-		goto search;
-	
-	finished:	
-		logMessage(LOG_INFO_LEVEL, "\nSuccessfully completed cache placement in put_cart_cache\n");
-		completed = YES;
+	// Take an unused entry and put the frame there
+	if ((entry = alloc_cache_entry()) == CACHE_NO_ENTRY) {
+		unlock_cache_shard();
+		return (-1);
 	}
+	memcpy(cache_frame(entry), buf, sizeof(CartFrame));
+	cacheShard->cacheIndex.entries[entry].cacheHandle = tag;
+	if (dirty == YES)
+		cacheShard->cacheIndex.state[entry] |= CACHE_STATE_DIRTY;
+	insert_cache_entry(&cacheShard->cacheIndex, entry);
+	cachePolicy->insert(entry);
+	cacheShard->cacheInserts++;
+	unlock_cache_shard();
+
+	CART_TRACE(LOG_INFO_LEVEL, "\nSuccessfully completed cache placement in store_cache_frame\n");
 
 	// Return successfully
 	return (0);
@@ -260,7 +681,9 @@ int put_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *buf) {
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : get_cart_cache
-// Description  : Get an frame from the cache (and return it)
+// Description  : Get an frame from the cache (and return it); callers running
+//                alongside others must pin the frame instead, as it may be
+//                evicted as soon as this returns
 //
 // Inputs       : cart - the cartridge number of the cartridge to find
 //                frm - the  number of the frame to find
@@ -270,26 +693,107 @@ int put_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *buf) {
 void * get_cart_cache(CartridgeIndex cart, CartFrameIndex frm) {
 
 	// Local Variables
-	int			i = 0;
-	uint32_t	temp = 0;
+	int32_t		entry = CACHE_NO_ENTRY;
+	char		*frame = NULL;
+
+	// Find the cache tag for requested cart and frame coupling through the hash index
+	if (cacheInit != YES)
+		return (NULL);
+	lock_cache_shard(cart, frm);
+	if ((entry = lookup_cache_entry(cart, frm, YES)) != CACHE_NO_ENTRY)
+		frame = cache_frame(entry);
+	unlock_cache_shard();
+	return (frame);
+}
 
-	// Always update lruCounter with every cache access
-	lruCounter++;
 
-	// Create the cache tag for requested cart and frame coupling in CART system
-	temp = create_cache_tag(cart, frm);
-
-	// Search to see if it exists in the cache
-	for (i = 0; i < cacheSize; i++) {
-		// Requested frame exists in cache
-		if (cacheMemory[i].cacheHandle == temp) {
-			cacheMemory[i].lru = lruCounter;		// update the frame's lruCounter to newest
-			return (cacheMemory[i].cachedFrame);	// return a pointer to the cached frame
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : peek_cart_cache
+// Description  : Look for a frame in the cache without counting a reference
+//                to it, so probing does not disturb the replacement order
+//
+// Inputs       : cart - the cartridge number of the cartridge to find
+//                frm - the  number of the frame to find
+// Outputs      : pointer to cached frame or NULL if not found
+//
+////////////////////////////////////////////////////////////////////////////////
+void * peek_cart_cache(CartridgeIndex cart, CartFrameIndex frm) {
+
+	// Local Variables
+	int32_t		entry = CACHE_NO_ENTRY;
+	char		*frame = NULL;
+
+	if (cacheInit != YES)
+		return (NULL);
+	lock_cache_shard(cart, frm);
+	if ((entry = lookup_cache_entry(cart, frm, NO)) != CACHE_NO_ENTRY)
+		frame = cache_frame(entry);
+	unlock_cache_shard();
+	return (frame);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pin_cart_cache
+// Description  : Get a frame from the cache and hold a reference to it, so
+//                the frame stays cached and in place until unpinned
+//
+// Inputs       : cart - the cartridge number of the cartridge to find
+//                frm - the  number of the frame to find
+// Outputs      : pointer to cached frame or NULL if not found
+//
+////////////////////////////////////////////////////////////////////////////////
+void * pin_cart_cache(CartridgeIndex cart, CartFrameIndex frm) {
+
+	// Local Variables
+	int32_t		entry = CACHE_NO_ENTRY;
+	char		*frame = NULL;
+
+	if (cacheInit != YES)
+		return (NULL);
+
+	// Take a reference on the entry found by the lookup
+	lock_cache_shard(cart, frm);
+	if ((entry = lookup_cache_entry(cart, frm, YES)) != CACHE_NO_ENTRY) {
+		cacheShard->cachePins[entry]++;
+		frame = cache_frame(entry);
+	}
+	unlock_cache_shard();
+	return (frame);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unpin_cart_cache
+// Description  : Drop a reference taken by pin_cart_cache
+//
+// Inputs       : cart - the cartridge number of the pinned frame
+//                frm - the frame number of the pinned frame
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int unpin_cart_cache(CartridgeIndex cart, CartFrameIndex frm) {
+
+	// Local Variables
+	int32_t		entry = CACHE_NO_ENTRY;
+
+	// Find the pinned frame
+	if (cacheInit == YES) {
+		lock_cache_shard(cart, frm);
+		entry = lookup_cache_entry(cart, frm, NO);
+		if (entry != CACHE_NO_ENTRY && cacheShard->cachePins[entry] > 0) {
+			cacheShard->cachePins[entry]--;
+			unlock_cache_shard();
+			return (0);
 		}
+		unlock_cache_shard();
 	}
 
-	// Does not exist in cache if this statement is reached
-	return (NULL);
+	logMessage(LOG_ERROR_LEVEL, "\nError: cart/frame passed to unpin_cart_cache is not pinned\n");
+	return (-1);
 }
 
 
@@ -306,39 +810,66 @@ void * get_cart_cache(CartridgeIndex cart, CartFrameIndex frm) {
 void * delete_cart_cache(CartridgeIndex cart, CartFrameIndex blk) {
 
 	// Local Variables
-	int			i = 0;
-	CacheTable	temp;
-
-	// Always update lruCounter with every cache access
-	lruCounter++;
-
-	// Create the cache tag for requested cart and frame coupling in CART system
-	temp.cacheHandle = create_cache_tag(cart, blk);
+	int32_t		i = 0;
+	char		*frame = NULL;
 
 	// Check to make sure requested cart and frame is valid and in the cache
-	for (i = 0; i < cacheSize; i++) {
-		// Requested frame exists in cache so wipe it
-		if (cacheMemory[i].cacheHandle == temp.cacheHandle) {
-
-			memcpy(last_cached_frame, cacheMemory[i].cachedFrame, CART_FRAME_SIZE);
-
-			strncpy(cacheMemory[i].cachedFrame, "", sizeof(CartFrame));
-			cacheMemory[i].cacheHandle	= 0;
-			cacheMemory[i].cartIndex	= 0;
-			cacheMemory[i].frameIndex	= 0;
-			cacheMemory[i].isUsed		= NO;
-			cacheMemory[i].lru			= -1;
-
-			// Return successfully the deleted frame if needed
-			return (last_cached_frame);
-		}
+	lock_cache_shard(cart, blk);
+	i = lookup_cache_entry(cart, blk, NO);
+	if (i != CACHE_NO_ENTRY && cacheShard->cachePins[i] > 0) {
+		unlock_cache_shard();
+		logMessage(LOG_ERROR_LEVEL, "\nError: cart/frame passed to delete_cart_cache is pinned\n");
+		return (NULL);
+	}
+	if (i != CACHE_NO_ENTRY) {
+		// Requested frame exists in cache so keep a copy and release its entry
+		memcpy(cacheShard->last_cached_frame, cache_frame(i), CART_FRAME_SIZE);
+		unlink_list_entry(&cacheShard->cacheIndex, i);
+		release_cache_entry(i);
+		frame = cacheShard->last_cached_frame;
+		unlock_cache_shard();
+
+		// Return successfully the deleted frame if needed
+		return (frame);
 	}
+	unlock_cache_shard();
 
 	// Cart and frame not found in the cache
 	logMessage(LOG_ERROR_LEVEL, "\nError: bad cart/frame passed to delete_cart_cache : not found in cache\n");
 	return (NULL);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_cart_cache_stats
+// Description  : Add up what the cache has counted since the program
+//                started, over the shards of the cache and the caches
+//                already closed
+//
+// Inputs       : stats - where the counters go
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int get_cart_cache_stats(CartCacheStats *stats) {
+
+	// Local Variables
+	uint32_t	shard = 0;
+
+	if (stats == NULL)
+		return (-1);
+	*stats = cacheTotals;
+	for (shard = 0; cacheShards != NULL && shard < cacheShardCount; shard++) {
+		pthread_mutex_lock(&cacheShards[shard].lock);
+		stats->hits += cacheShards[shard].cacheHits;
+		stats->misses += cacheShards[shard].cacheMisses;
+		stats->inserts += cacheShards[shard].cacheInserts;
+		stats->evictions += cacheShards[shard].cacheEvictions;
+		stats->writebacks += cacheShards[shard].cacheWritebacks;
+		pthread_mutex_unlock(&cacheShards[shard].lock);
+	}
+	return (0);
+}
+
 
 
 //
@@ -356,26 +887,1000 @@ void * delete_cart_cache(CartridgeIndex cart, CartFrameIndex blk) {
 ////////////////////////////////////////////////////////////////////////////////
 int cartCacheUnitTest(void) {
 
+	// Local Variables
+	int			i = 0, p = 0;
+	uint32_t	savedSize = cacheSize;
+	uint32_t	savedShards = cacheShardCount;
+	uint32_t	lengths[CACHE_MAX_LISTS], target = 0;
+	uint8_t		state[64];
+	CachePolicy	*savedPolicy = cachePolicy;
+	CartFrame	frame;
+	char		*cached = NULL;
+
+	// Run the common checks under every replacement policy, over a single shard so the orders are exact
+	cacheShardCount = 1;
+	for (p = 0; p < CART_CACHE_MAXPOLICY; p++) {
+
+		// Setup a small cache to exercise the hash index and eviction
+		cachePolicy = &cachePolicies[p];
+		if (set_cart_cache_size(64) != 0 || init_cart_cache() != 0) {
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: unable to initialize cache.");
+			return(-1);
+		}
 
-	// Return successfully
-	logMessage(LOG_OUTPUT_LEVEL, "Cache unit test completed successfully.");
-	return(0);
-}
+		// An empty cache must not report cart 0/frame 0 as cached
+		if (get_cart_cache(0, 0) != NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: empty cache returned a frame.");
+			return(-1);
+		}
 
-//
-// My functions
-//
+		// Fill the cache with frames spread over many carts, then read them back
+		for (i = 0; i < 64; i++) {
+			memset(frame, 'a' + (i % 26), CART_FRAME_SIZE);
+			frame[CART_FRAME_SIZE - 1] = 0x0;
+			if (put_cart_cache(i % CART_MAX_CARTRIDGES, i * 7, frame) != 0) {
+				logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: put of frame %d failed.", i);
+				return(-1);
+			}
+		}
+		for (i = 0; i < 64; i++) {
+			cached = get_cart_cache(i % CART_MAX_CARTRIDGES, i * 7);
+			if (cached == NULL || cached[0] != 'a' + (i % 26)) {
+				logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: [%s] frame %d missing or corrupt.",
+						cachePolicy->name, i);
+				return(-1);
+			}
+		}
 
-uint32_t create_cache_tag(CartridgeIndex cart, CartFrameIndex frame) {
-	uint32_t cacheTag;
-	uint32_t theCart = (uint32_t)cart;
-	uint32_t theFrame = (uint32_t)frame;
+		// Refreshing a cached frame must update it in place
+		memset(frame, 'Z', CART_FRAME_SIZE);
+		frame[CART_FRAME_SIZE - 1] = 0x0;
+		put_cart_cache(3, 21, frame);
+		cached = get_cart_cache(3, 21);
+		if (cached == NULL || cached[0] != 'Z') {
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: in place refresh lost.");
+			return(-1);
+		}
 
-	//  theCart    theFrame    
-	//  [31:16]     [15:0]
+		// Frames are binary, so bytes past a NUL must be kept too
+		for (i = 0; i < CART_FRAME_SIZE; i++)
+			frame[i] = (char)(i % 7 == 0 ? 0x0 : i);
+		put_cart_cache(3, 21, frame);
+		cached = get_cart_cache(3, 21);
+		if (cached == NULL || memcmp(cached, frame, CART_FRAME_SIZE) != 0) {
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: binary frame truncated.");
+			return(-1);
+		}
+		memset(frame, 'Z', CART_FRAME_SIZE);
+		frame[CART_FRAME_SIZE - 1] = 0x0;
+
+		// Touching 0/0 makes 1/7 least recently used, so under LRU a new frame must evict it
+		get_cart_cache(0, 0);
+		put_cart_cache(1, 1000, frame);
+		if (get_cart_cache(1, 1000) == NULL || cacheShards[0].cacheIndex.highWater != 64 ||
+				(p == CART_CACHE_LRU && (get_cart_cache(1, 7) != NULL || get_cart_cache(0, 0) == NULL))) {
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: [%s] bad eviction.", cachePolicy->name);
+			return(-1);
+		}
 
-	theCart = (theCart << 16);
-	cacheTag = (theCart | theFrame);
+		// Deleted frames must no longer be found, and their entry is reused without evicting
+		if (delete_cart_cache(1, 1000) == NULL || get_cart_cache(1, 1000) != NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: delete left frame cached.");
+			return(-1);
+		}
+		put_cart_cache(2, 2000, frame);
+		if (get_cart_cache(2, 14) == NULL || get_cart_cache(2, 2000) == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: freed entry not reused.");
+			return(-1);
+		}
 
-	return (cacheTag);
-}
\ No newline at end of file
+		// A pinned frame survives being the eviction victim and cannot be deleted until unpinned
+		cached = pin_cart_cache(2, 2000);
+		for (i = 0; i < 128; i++)
+			put_cart_cache(4, i, frame);
+		if (cached == NULL || get_cart_cache(2, 2000) != cached || delete_cart_cache(2, 2000) != NULL ||
+				unpin_cart_cache(2, 2000) != 0 || unpin_cart_cache(2, 2000) == 0) {
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: [%s] pinned frame evicted.", cachePolicy->name);
+			return(-1);
+		}
+
+		// Scan resistance: a re-referenced hot set must survive a long one-pass scan under 2Q and ARC
+		close_cart_cache();
+		init_cart_cache();
+		for (i = 0; i < 16; i++) {
+			put_cart_cache(1, i, frame);
+			get_cart_cache(1, i);
+		}
+		for (i = 0; i < 64; i++)
+			put_cart_cache(2, i, frame);
+		for (i = 0; i < 16; i++) {
+			if (get_cart_cache(1, i) == NULL)
+				put_cart_cache(1, i, frame);
+		}
+		for (i = 0; i < 256; i++)
+			put_cart_cache(3, i, frame);
+		for (i = 0; i < 16; i++) {
+			if ((p == CART_CACHE_2Q || p == CART_CACHE_ARC) && get_cart_cache(1, i) == NULL) {
+				logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: [%s] hot frame %d lost to scan.",
+						cachePolicy->name, i);
+				return(-1);
+			}
+		}
+		close_cart_cache();
+	}
+	cachePolicy = savedPolicy;
+
+	// Write-back: rewrites coalesce, only evicted dirty frames are written, and flush writes the rest in cart order
+	set_cart_cache_writer(unit_test_writer);
+	unitTestWrites = 0;
+	init_cart_cache();
+	for (i = 0; i < 64 * 4; i++)
+		put_dirty_cart_cache(63 - (i % 64), i % 64, frame);
+	if (unitTestWrites != 0) {
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: dirty frames written before eviction.");
+		return(-1);
+	}
+	put_dirty_cart_cache(0, 100, frame);
+	if (unitTestWrites != 1 || unitTestLastTag != create_cache_tag(63, 0)) {
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: evicted dirty frame not written back.");
+		return(-1);
+	}
+	unitTestWrites = 0;
+	if (flush_cart_cache() != 64 || unitTestWrites != 64 || unitTestLastTag != create_cache_tag(62, 1) ||
+			flush_cart_cache() != 0) {
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: flush wrote %u frames.", unitTestWrites);
+		return(-1);
+	}
+	close_cart_cache();
+
+	// A victim whose write-back fails keeps its entry, list and history, so does the admitted frame's ghost
+	for (p = 0; p < CART_CACHE_MAXPOLICY; p++) {
+		cachePolicy = &cachePolicies[p];
+		init_cart_cache();
+		for (i = 0; i < 64 * 2; i++)
+			put_dirty_cart_cache(5, i, frame);
+		for (i = 0; i < 16; i++)
+			put_dirty_cart_cache(5, i, frame);
+		for (i = 0; i < CACHE_MAX_LISTS; i++)
+			lengths[i] = cacheShards[0].cacheLists[i].length;
+		memcpy(state, cacheShards[0].cacheIndex.state, sizeof(state));
+		target = cacheShards[0].arcTarget;
+		unitTestFailures = 1;
+		if (put_dirty_cart_cache(5, 16, frame) == 0 || memcmp(state, cacheShards[0].cacheIndex.state, sizeof(state)) != 0 ||
+				cacheShards[0].arcTarget != target) {
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: [%s] failed write-back changed the cache.", cachePolicy->name);
+			return(-1);
+		}
+		for (i = 0; i < CACHE_MAX_LISTS; i++) {
+			if (cacheShards[0].cacheLists[i].length != lengths[i]) {
+				logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: [%s] failed write-back changed list %d.", cachePolicy->name, i);
+				return(-1);
+			}
+		}
+		for (i = 0; i < 64; i++) {
+			if (find_cache_entry(&cacheShards[0].ghostIndex, cacheShards[0].cacheIndex.entries[i].cacheHandle) != CACHE_NO_ENTRY) {
+				logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: [%s] resident frame left on a ghost list.", cachePolicy->name);
+				return(-1);
+			}
+		}
+		unitTestWrites = 0;
+		if (put_dirty_cart_cache(5, 16, frame) != 0 || unitTestWrites != 1 || get_cart_cache(5, 16) == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: [%s] eviction failed after a write-back failure.", cachePolicy->name);
+			return(-1);
+		}
+		close_cart_cache();
+	}
+	cachePolicy = savedPolicy;
+	set_cart_cache_writer(NULL);
+
+	// A cache covering all of CART memory only commits the slabs it actually fills
+	if (set_cart_cache_size(CACHE_MAX_FRAMES) != 0 || init_cart_cache() != 0) {
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: unable to initialize full size cache.");
+		return(-1);
+	}
+	for (i = 0; i <= CACHE_SLAB_FRAMES; i++)
+		put_cart_cache(i / CART_CARTRIDGE_SIZE, i % CART_CARTRIDGE_SIZE, frame);
+	if (cacheShards[0].cacheSlabCount != 2 || cacheShards[0].cacheIndex.highWater != CACHE_SLAB_FRAMES + 1 || get_cart_cache(0, CACHE_SLAB_FRAMES) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: frame slabs not committed on demand.");
+		return(-1);
+	}
+
+	close_cart_cache();
+
+	// A sharded cache keeps every frame in some shard, and flushes across the shards in cart order
+	set_cart_cache_writer(unit_test_writer);
+	unitTestWrites = 0;
+	if (set_cart_cache_shards(4) != 0 || set_cart_cache_size(64) != 0 || init_cart_cache() != 0) {
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: unable to initialize sharded cache.");
+		return(-1);
+	}
+	for (i = 0; i < 32; i++)
+		put_dirty_cart_cache(31 - i, i, frame);
+	for (i = 0; i < 32; i++) {
+		if (get_cart_cache(31 - i, i) == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: sharded cache lost frame %d.", i);
+			return(-1);
+		}
+	}
+	if (flush_cart_cache() != 32 || unitTestWrites != 32 || unitTestLastTag != create_cache_tag(31, 0)) {
+		logMessage(LOG_ERROR_LEVEL, "Cache unit test failed: sharded flush wrote %u frames.", unitTestWrites);
+		return(-1);
+	}
+	close_cart_cache();
+	set_cart_cache_writer(NULL);
+
+	// Cleanup and restore the configured cache size and shards
+	cacheSize = savedSize;
+	cacheShardCount = savedShards;
+
+	// Return successfully
+	logMessage(LOG_OUTPUT_LEVEL, "Cache unit test completed successfully.");
+	return(0);
+}
+
+//
+// My functions
+//
+
+int unit_test_writer(CartridgeIndex cart, CartFrameIndex frm, void *frame) {
+	if (unitTestFailures > 0) {
+		unitTestFailures--;
+		return (-1);
+	}
+	unitTestWrites++;
+	unitTestLastTag = create_cache_tag(cart, frm);
+	return (0);
+}
+
+uint32_t create_cache_tag(CartridgeIndex cart, CartFrameIndex frame) {
+	uint32_t cacheTag;
+	uint32_t theCart = (uint32_t)cart;
+	uint32_t theFrame = (uint32_t)frame;
+
+	//  theCart    theFrame
+	//  [31:16]     [15:0]
+
+	theCart = (theCart << 16);
+	cacheTag = (theCart | theFrame);
+
+	return (cacheTag);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lock_cache_shard
+// Description  : Lock the shard a frame belongs to and make it the calling
+//                thread's current shard
+//
+// Inputs       : cart - the cartridge number of the frame
+//                frm - the frame number of the frame
+// Outputs      : the locked shard
+//
+////////////////////////////////////////////////////////////////////////////////
+CacheShard * lock_cache_shard(CartridgeIndex cart, CartFrameIndex frm) {
+
+	// Local Variables
+	uint32_t	tag = create_cache_tag(cart, frm);
+
+	// Spread neighbouring frames over the shards with the high bits of the tag's hash
+	cacheShard = &cacheShards[((uint32_t)(tag * CACHE_HASH_MULTIPLIER) >> 16) % cacheShardCount];
+	pthread_mutex_lock(&cacheShard->lock);
+	return (cacheShard);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unlock_cache_shard
+// Description  : Unlock the calling thread's current shard
+//
+// Inputs       : none
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void unlock_cache_shard(void) {
+	pthread_mutex_unlock(&cacheShard->lock);
+	cacheShard = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lookup_cache_entry
+// Description  : Find a frame's entry in the locked shard, counting the
+//                lookup as a reference (hit or miss) if asked to
+//
+// Inputs       : cart - the cartridge number of the frame
+//                frm - the frame number of the frame
+//                reference - YES to count the lookup and tell the policy
+// Outputs      : entry number, or CACHE_NO_ENTRY if not cached
+//
+////////////////////////////////////////////////////////////////////////////////
+int32_t lookup_cache_entry(CartridgeIndex cart, CartFrameIndex frm, Flag reference) {
+
+	// Local Variables
+	int32_t		entry = find_cache_entry(&cacheShard->cacheIndex, create_cache_tag(cart, frm));
+
+	if (reference == YES && entry != CACHE_NO_ENTRY) {
+		cacheShard->cacheHits++;
+		cachePolicy->hit(entry);					// let the policy note the reference
+	}
+	else if (reference == YES) {
+		cacheShard->cacheMisses++;
+	}
+	return (entry);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hash_cache_tag
+// Description  : Map a cart/frame cache tag onto a bucket of a hash index
+//
+// Inputs       : idx - the index to hash into
+//                tag - the cache tag created by create_cache_tag
+// Outputs      : bucket number in the hash index
+//
+////////////////////////////////////////////////////////////////////////////////
+uint32_t hash_cache_tag(CacheIndex *idx, uint32_t tag) {
+
+	// Multiplicative hashing keeps the high bits, which mix both cart and frame
+	return ((uint32_t)(tag * CACHE_HASH_MULTIPLIER) >> (32 - idx->hashBits));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : init_cache_index
+// Description  : Allocate an empty index of tagged entries; entries are only
+//                touched as they are handed out
+//
+// Inputs       : idx - the index to setup
+//                capacity - the maximum number of entries
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int init_cache_index(CacheIndex *idx, uint32_t capacity) {
+
+	// Local Variables
+	uint32_t	i = 0;
+
+	// Allocate the metadata array and per entry state, rounded to whole cache lines
+	idx->capacity = capacity;
+	idx->entries = aligned_alloc(CACHE_LINE_SIZE, ((sizeof(CacheTable) * capacity) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1));
+	idx->state = malloc(capacity + 1);
+
+	// Size the hash index to the next power of two at or above the capacity
+	idx->hashBits = 1;
+	while ((1U << idx->hashBits) < capacity)
+		idx->hashBits++;
+	idx->buckets = malloc(sizeof(int32_t) * (1U << idx->hashBits));
+	if ((capacity > 0 && idx->entries == NULL) || idx->state == NULL || idx->buckets == NULL)
+		return (-1);
+	for (i = 0; i < (1U << idx->hashBits); i++)
+		idx->buckets[i] = CACHE_NO_ENTRY;
+
+	// No entries handed out yet
+	idx->highWater = 0;
+	idx->freeHead = CACHE_NO_ENTRY;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : close_cache_index
+// Description  : Free the memory of an index
+//
+// Inputs       : idx - the index to free
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void close_cache_index(CacheIndex *idx) {
+	free(idx->entries);
+	free(idx->state);
+	free(idx->buckets);
+	memset(idx, 0x0, sizeof(CacheIndex));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_cache_entry
+// Description  : Look up the entry holding a tag through the hash index
+//
+// Inputs       : idx - the index to search
+//                tag - the cache tag created by create_cache_tag
+// Outputs      : entry number, or CACHE_NO_ENTRY if not present
+//
+////////////////////////////////////////////////////////////////////////////////
+int32_t find_cache_entry(CacheIndex *idx, uint32_t tag) {
+
+	// Local Variables
+	int32_t		entry = idx->buckets[hash_cache_tag(idx, tag)];
+
+	// Walk the bucket's chain until the tag is found
+	while (entry != CACHE_NO_ENTRY && idx->entries[entry].cacheHandle != tag)
+		entry = idx->entries[entry].hashNext;
+
+	return (entry);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : insert_cache_entry
+// Description  : Link a filled entry into the hash index by its tag
+//
+// Inputs       : idx - the index to link into
+//                entry - the entry to link
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void insert_cache_entry(CacheIndex *idx, int32_t entry) {
+
+	// Local Variables
+	uint32_t	bucket = hash_cache_tag(idx, idx->entries[entry].cacheHandle);
+
+	// Push the entry onto the front of its bucket's chain
+	idx->entries[entry].hashNext = idx->buckets[bucket];
+	idx->buckets[bucket] = entry;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : remove_cache_entry
+// Description  : Unlink an entry from the hash index
+//
+// Inputs       : idx - the index to unlink from
+//                entry - the entry to unlink
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void remove_cache_entry(CacheIndex *idx, int32_t entry) {
+
+	// Local Variables
+	int32_t		*link = &idx->buckets[hash_cache_tag(idx, idx->entries[entry].cacheHandle)];
+
+	// Find the link pointing at this entry and splice the entry out of the chain
+	while (*link != entry && *link != CACHE_NO_ENTRY)
+		link = &idx->entries[*link].hashNext;
+	if (*link == entry)
+		*link = idx->entries[entry].hashNext;
+	idx->entries[entry].hashNext = CACHE_NO_ENTRY;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : take_cache_entry
+// Description  : Hand out an unused entry, reusing freed entries first
+//
+// Inputs       : idx - the index to take an entry from
+// Outputs      : entry number, or CACHE_NO_ENTRY if the index is full
+//
+////////////////////////////////////////////////////////////////////////////////
+int32_t take_cache_entry(CacheIndex *idx) {
+
+	// Local Variables
+	int32_t		entry = idx->freeHead;
+
+	// Reuse an entry that was freed, otherwise take the next untouched entry
+	if (entry != CACHE_NO_ENTRY) {
+		idx->freeHead = idx->entries[entry].lruNext;
+	} else {
+		if (idx->highWater == idx->capacity)
+			return (CACHE_NO_ENTRY);
+		entry = idx->highWater++;
+	}
+
+	// Setup the entry's links, the caller fills in the rest
+	idx->entries[entry].hashNext = CACHE_NO_ENTRY;
+	idx->entries[entry].lruPrev = CACHE_NO_ENTRY;
+	idx->entries[entry].lruNext = CACHE_NO_ENTRY;
+	idx->state[entry] = CACHE_LIST_NONE;
+	return (entry);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_cache_entry
+// Description  : Unlink an entry from the hash index and return it to the
+//                free list (the entry must already be off its policy list)
+//
+// Inputs       : idx - the index owning the entry
+//                entry - the entry to free
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void free_cache_entry(CacheIndex *idx, int32_t entry) {
+	remove_cache_entry(idx, entry);
+	idx->entries[entry].cacheHandle = 0;
+	idx->entries[entry].lruNext = idx->freeHead;
+	idx->freeHead = entry;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : link_list_entry
+// Description  : Link an entry at the most recently used end of a policy list
+//
+// Inputs       : idx - the index owning the entry
+//                list - the policy list to link onto
+//                entry - the entry to link
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void link_list_entry(CacheIndex *idx, int list, int32_t entry) {
+
+	// Push the entry in front of the current head
+	idx->entries[entry].lruPrev = CACHE_NO_ENTRY;
+	idx->entries[entry].lruNext = cacheShard->cacheLists[list].head;
+	if (cacheShard->cacheLists[list].head != CACHE_NO_ENTRY)
+		idx->entries[cacheShard->cacheLists[list].head].lruPrev = entry;
+	cacheShard->cacheLists[list].head = entry;
+	if (cacheShard->cacheLists[list].tail == CACHE_NO_ENTRY)
+		cacheShard->cacheLists[list].tail = entry;
+	cacheShard->cacheLists[list].length++;
+	idx->state[entry] = (idx->state[entry] & ~CACHE_STATE_LIST) | list;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unlink_list_entry
+// Description  : Unlink an entry from whichever policy list it is on
+//
+// Inputs       : idx - the index owning the entry
+//                entry - the entry to unlink
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void unlink_list_entry(CacheIndex *idx, int32_t entry) {
+
+	// Local Variables
+	int			list = idx->state[entry] & CACHE_STATE_LIST;
+	CacheTable	*e = &idx->entries[entry];
+
+	if (list == CACHE_LIST_NONE)
+		return;
+
+	// Point the neighbours (or the list ends) around the entry
+	if (e->lruPrev != CACHE_NO_ENTRY)
+		idx->entries[e->lruPrev].lruNext = e->lruNext;
+	else
+		cacheShard->cacheLists[list].head = e->lruNext;
+	if (e->lruNext != CACHE_NO_ENTRY)
+		idx->entries[e->lruNext].lruPrev = e->lruPrev;
+	else
+		cacheShard->cacheLists[list].tail = e->lruPrev;
+	e->lruPrev = CACHE_NO_ENTRY;
+	e->lruNext = CACHE_NO_ENTRY;
+	cacheShard->cacheLists[list].length--;
+	idx->state[entry] = (idx->state[entry] & ~CACHE_STATE_LIST) | CACHE_LIST_NONE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : peek_list_tail
+// Description  : Find the least recently used entry of a policy list,
+//                leaving it linked
+//
+// Inputs       : idx - the index owning the list's entries
+//                list - the policy list
+// Outputs      : the entry, or CACHE_NO_ENTRY if the list is empty (or, for
+//                resident lists, holds only pinned entries)
+//
+////////////////////////////////////////////////////////////////////////////////
+int32_t peek_list_tail(CacheIndex *idx, int list) {
+
+	// Local Variables
+	int32_t		entry = cacheShard->cacheLists[list].tail;
+
+	// Pinned frames cannot be evicted, so take the least recently used unpinned one instead
+	while (idx == &cacheShard->cacheIndex && entry != CACHE_NO_ENTRY && cacheShard->cachePins[entry] > 0)
+		entry = idx->entries[entry].lruPrev;
+	return (entry);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pop_list_tail
+// Description  : Unlink the least recently used entry of a policy list
+//
+// Inputs       : idx - the index owning the list's entries
+//                list - the policy list
+// Outputs      : the unlinked entry, or CACHE_NO_ENTRY if the list is empty
+//                (or, for resident lists, holds only pinned entries)
+//
+////////////////////////////////////////////////////////////////////////////////
+int32_t pop_list_tail(CacheIndex *idx, int list) {
+
+	// Local Variables
+	int32_t		entry = peek_list_tail(idx, list);
+
+	if (entry != CACHE_NO_ENTRY)
+		unlink_list_entry(idx, entry);
+	return (entry);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cache_frame
+// Description  : Find the frame storage belonging to a cache entry
+//
+// Inputs       : entry - the resident entry
+// Outputs      : pointer to the entry's frame in its slab
+//
+////////////////////////////////////////////////////////////////////////////////
+char * cache_frame(int32_t entry) {
+	return (cacheShard->cacheSlabs[entry / CACHE_SLAB_FRAMES][entry % CACHE_SLAB_FRAMES]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_back_entry
+// Description  : Send a dirty cached frame to CART memory and mark it clean.
+//                Called with the shard locked, so the writer's bus round trip
+//                holds up every other user of the shard.
+//
+// Inputs       : entry - the resident entry
+// Outputs      : 0 if successful (or the entry was clean), -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int write_back_entry(int32_t entry) {
+
+	// Local Variables
+	uint32_t	tag = cacheShard->cacheIndex.entries[entry].cacheHandle;
+
+	if (!(cacheShard->cacheIndex.state[entry] & CACHE_STATE_DIRTY))
+		return (0);
+
+	// Tags hold the cart in the upper half and the frame in the lower half
+	if (cacheWriter == NULL || cacheWriter(tag >> 16, tag & 0xffff, cache_frame(entry)) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nUnable to write back cached frame %u of cart %u\n", tag & 0xffff, tag >> 16);
+		return (-1);
+	}
+	cacheShard->cacheIndex.state[entry] &= ~CACHE_STATE_DIRTY;
+	cacheShard->cacheWritebacks++;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compare_cache_tags
+// Description  : qsort comparison ordering dirty frames by their tags
+//
+// Inputs       : a, b - pointers to the dirty frames to compare
+// Outputs      : negative, zero or positive as a's tag is below, equal or above b's
+//
+////////////////////////////////////////////////////////////////////////////////
+int compare_cache_tags(const void *a, const void *b) {
+
+	// Local Variables
+	uint32_t	ta = ((const CacheDirtyFrame *)a)->tag;
+	uint32_t	tb = ((const CacheDirtyFrame *)b)->tag;
+
+	return ((ta > tb) - (ta < tb));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : alloc_cache_entry
+// Description  : Hand out an unused resident entry, committing a new frame
+//                slab only when the cache grows into it
+//
+// Inputs       : none
+// Outputs      : entry number, or CACHE_NO_ENTRY if none available
+//
+////////////////////////////////////////////////////////////////////////////////
+int32_t alloc_cache_entry(void) {
+
+	// Local Variables
+	int32_t		entry = CACHE_NO_ENTRY;
+
+	// First entry of a slab that has never been used, so commit the slab's frame storage now
+	if (cacheShard->cacheIndex.freeHead == CACHE_NO_ENTRY && cacheShard->cacheIndex.highWater < cacheShard->shardSize &&
+			cacheShard->cacheIndex.highWater % CACHE_SLAB_FRAMES == 0) {
+		cacheShard->cacheSlabs[cacheShard->cacheSlabCount] = aligned_alloc(CACHE_LINE_SIZE, sizeof(CartFrame) * CACHE_SLAB_FRAMES);
+		if (cacheShard->cacheSlabs[cacheShard->cacheSlabCount] == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "\nUnable to allocate cache frame slab %u\n", cacheShard->cacheSlabCount);
+			return (CACHE_NO_ENTRY);
+		}
+		cacheShard->cacheSlabCount++;
+	}
+
+	entry = take_cache_entry(&cacheShard->cacheIndex);
+	return (entry);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_cache_entry
+// Description  : Drop a cached frame whose entry is already off its policy
+//                list, returning the entry to the free list
+//
+// Inputs       : entry - the resident entry to release
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void release_cache_entry(int32_t entry) {
+	free_cache_entry(&cacheShard->cacheIndex, entry);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : add_ghost_tag
+// Description  : Remember the tag of an evicted frame on a ghost list
+//
+// Inputs       : list - the ghost list (CACHE_LIST_B1 or CACHE_LIST_B2)
+//                tag - the tag of the evicted frame
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void add_ghost_tag(int list, uint32_t tag) {
+
+	// Local Variables
+	int32_t		ghost = CACHE_NO_ENTRY;
+
+	// Make room by forgetting the oldest history if the ghost index is full
+	if (cacheShard->ghostIndex.freeHead == CACHE_NO_ENTRY && cacheShard->ghostIndex.highWater == cacheShard->ghostIndex.capacity)
+		drop_ghost_tail(cacheShard->cacheLists[CACHE_LIST_B2].length > 0 ? CACHE_LIST_B2 : CACHE_LIST_B1);
+	if ((ghost = take_cache_entry(&cacheShard->ghostIndex)) == CACHE_NO_ENTRY)
+		return;
+
+	cacheShard->ghostIndex.entries[ghost].cacheHandle = tag;
+	insert_cache_entry(&cacheShard->ghostIndex, ghost);
+	link_list_entry(&cacheShard->ghostIndex, list, ghost);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : drop_ghost_tail
+// Description  : Forget the oldest tag on a ghost list
+//
+// Inputs       : list - the ghost list (CACHE_LIST_B1 or CACHE_LIST_B2)
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void drop_ghost_tail(int list) {
+
+	// Local Variables
+	int32_t		ghost = pop_list_tail(&cacheShard->ghostIndex, list);
+
+	if (ghost != CACHE_NO_ENTRY)
+		free_cache_entry(&cacheShard->ghostIndex, ghost);
+}
+
+//
+// Replacement policies
+//
+//   Each policy keeps its resident frames on the T1/T2 lists and, for 2Q and
+//   ARC, the tags of recently evicted frames on the B1/B2 ghost lists.  On a
+//   miss admit() decides which list the incoming frame joins (cacheShard->cacheAdmitList)
+//   and, when the cache is full, returns the victim entry.  The victim stays
+//   linked and the history the admission changes is only noted in the shard
+//   (cacheAdmit*, cacheVictim*), so nothing moves until commit_admission()
+//   runs once the victim is safely written back.
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pick_resident_victim
+// Description  : Choose an eviction victim from a resident list, falling
+//                back to the other resident list if it holds only pins
+//
+// Inputs       : list - the preferred list (CACHE_LIST_T1 or CACHE_LIST_T2)
+//                from - set to the list the victim is on
+// Outputs      : the victim entry, or CACHE_NO_ENTRY if every frame is pinned
+//
+////////////////////////////////////////////////////////////////////////////////
+int32_t pick_resident_victim(int list, int *from) {
+
+	// Local Variables
+	int32_t		victim = peek_list_tail(&cacheShard->cacheIndex, list);
+
+	*from = list;
+	if (victim == CACHE_NO_ENTRY) {
+		*from = (list == CACHE_LIST_T1) ? CACHE_LIST_T2 : CACHE_LIST_T1;
+		victim = peek_list_tail(&cacheShard->cacheIndex, *from);
+	}
+	return (victim);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : commit_admission
+// Description  : Apply the history changes admit() noted and unlink its
+//                victim, once the victim no longer needs its entry
+//
+// Inputs       : victim - the victim entry, or CACHE_NO_ENTRY if none
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void commit_admission(int32_t victim) {
+
+	// Local Variables
+	int32_t		ghost = cacheShard->cacheAdmitGhost;
+	int			list = cacheShard->cacheVictimGhost;
+
+	// The admitted frame's ghost is used up, and the history is trimmed to fit
+	if (ghost != CACHE_NO_ENTRY) {
+		unlink_list_entry(&cacheShard->ghostIndex, ghost);
+		free_cache_entry(&cacheShard->ghostIndex, ghost);
+	}
+	cacheShard->arcTarget = cacheShard->cacheAdmitTarget;
+	if (cacheShard->cacheAdmitTrim != CACHE_LIST_NONE)
+		drop_ghost_tail(cacheShard->cacheAdmitTrim);
+
+	// Take the victim off its list, remembering its tag if the policy keeps its history
+	if (victim == CACHE_NO_ENTRY)
+		return;
+	unlink_list_entry(&cacheShard->cacheIndex, victim);
+	if (list != CACHE_LIST_NONE) {
+		add_ghost_tag(list, cacheShard->cacheIndex.entries[victim].cacheHandle);
+		while (cacheShard->cacheLists[list].length > cacheShard->cacheVictimLimit)
+			drop_ghost_tail(list);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : policy_insert
+// Description  : Link a newly admitted frame onto the list chosen by admit()
+//
+// Inputs       : entry - the new resident entry
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void policy_insert(int32_t entry) {
+	link_list_entry(&cacheShard->cacheIndex, cacheShard->cacheAdmitList, entry);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lru_hit / lru_admit
+// Description  : LRU - move hits to the front of T1, evict T1's tail
+//
+////////////////////////////////////////////////////////////////////////////////
+void lru_hit(int32_t entry) {
+	unlink_list_entry(&cacheShard->cacheIndex, entry);
+	link_list_entry(&cacheShard->cacheIndex, CACHE_LIST_T1, entry);
+}
+
+int32_t lru_admit(uint32_t tag, Flag full) {
+	cacheShard->cacheAdmitList = CACHE_LIST_T1;
+	return ((full == YES) ? peek_list_tail(&cacheShard->cacheIndex, CACHE_LIST_T1) : CACHE_NO_ENTRY);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : clock_hit / clock_admit
+// Description  : CLOCK - hits only set a reference bit; the hand sweeps from
+//                T1's tail giving referenced frames a second chance
+//
+////////////////////////////////////////////////////////////////////////////////
+void clock_hit(int32_t entry) {
+	cacheShard->cacheIndex.state[entry] |= CACHE_STATE_REF;
+}
+
+int32_t clock_admit(uint32_t tag, Flag full) {
+
+	// Local Variables
+	int32_t		entry = CACHE_NO_ENTRY;
+
+	cacheShard->cacheAdmitList = CACHE_LIST_T1;
+	if (full == NO)
+		return (CACHE_NO_ENTRY);
+
+	// Advance the hand, clearing reference bits, until an unreferenced frame is found
+	while ((entry = peek_list_tail(&cacheShard->cacheIndex, CACHE_LIST_T1)) != CACHE_NO_ENTRY &&
+			(cacheShard->cacheIndex.state[entry] & CACHE_STATE_REF)) {
+		cacheShard->cacheIndex.state[entry] &= ~CACHE_STATE_REF;
+		unlink_list_entry(&cacheShard->cacheIndex, entry);
+		link_list_entry(&cacheShard->cacheIndex, CACHE_LIST_T1, entry);
+	}
+	return (entry);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : twoq_hit / twoq_admit
+// Description  : 2Q - new frames enter the A1in FIFO (T1); frames evicted
+//                from it are remembered on A1out (B1), and only a miss that
+//                hits A1out promotes the frame into the Am LRU (T2)
+//
+////////////////////////////////////////////////////////////////////////////////
+void twoq_hit(int32_t entry) {
+
+	// Hits in A1in are left alone so one-time scans cannot promote themselves
+	if ((cacheShard->cacheIndex.state[entry] & CACHE_STATE_LIST) == CACHE_LIST_T2) {
+		unlink_list_entry(&cacheShard->cacheIndex, entry);
+		link_list_entry(&cacheShard->cacheIndex, CACHE_LIST_T2, entry);
+	}
+}
+
+int32_t twoq_admit(uint32_t tag, Flag full) {
+
+	// Local Variables
+	int32_t		ghost = find_cache_entry(&cacheShard->ghostIndex, tag);
+	int32_t		victim = CACHE_NO_ENTRY;
+	uint32_t	kin = (cacheShard->shardSize / 4) ? cacheShard->shardSize / 4 : 1;		// A1in target size
+	uint32_t	kout = (cacheShard->shardSize / 2) ? cacheShard->shardSize / 2 : 1;		// A1out history size
+	int			from = CACHE_LIST_T1;
+
+	// Frames recently seen on A1out go straight to Am
+	cacheShard->cacheAdmitGhost = ghost;
+	cacheShard->cacheAdmitList = (ghost != CACHE_NO_ENTRY) ? CACHE_LIST_T2 : CACHE_LIST_T1;
+	if (full == NO)
+		return (CACHE_NO_ENTRY);
+
+	// Reclaim from A1in while it is over its share (remembering the tag), otherwise from Am
+	victim = pick_resident_victim((cacheShard->cacheLists[CACHE_LIST_T1].length > kin || cacheShard->cacheLists[CACHE_LIST_T2].length == 0) ?
+			CACHE_LIST_T1 : CACHE_LIST_T2, &from);
+	if (victim != CACHE_NO_ENTRY && from == CACHE_LIST_T1) {
+		cacheShard->cacheVictimGhost = CACHE_LIST_B1;
+		cacheShard->cacheVictimLimit = kout;
+	}
+	return (victim);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : arc_hit / arc_admit / arc_replace
+// Description  : ARC - T1 holds frames seen once recently, T2 frames seen at
+//                least twice; ghost hits on B1/B2 adapt the target size of
+//                T1 (Megiddo and Modha, FAST 2003)
+//
+////////////////////////////////////////////////////////////////////////////////
+void arc_hit(int32_t entry) {
+	unlink_list_entry(&cacheShard->cacheIndex, entry);
+	link_list_entry(&cacheShard->cacheIndex, CACHE_LIST_T2, entry);
+}
+
+int32_t arc_replace(Flag inB2) {
+
+	// Local Variables
+	int32_t		victim = CACHE_NO_ENTRY;
+	uint32_t	t1 = cacheShard->cacheLists[CACHE_LIST_T1].length;
+	int			from = CACHE_LIST_T1;
+
+	// Evict from T1 while it is above target (remembering it on B1), otherwise from T2 onto B2
+	victim = pick_resident_victim((t1 > 0 && (t1 > cacheShard->cacheAdmitTarget || (inB2 == YES && t1 == cacheShard->cacheAdmitTarget) ||
+			cacheShard->cacheLists[CACHE_LIST_T2].length == 0)) ? CACHE_LIST_T1 : CACHE_LIST_T2, &from);
+	if (victim != CACHE_NO_ENTRY)
+		cacheShard->cacheVictimGhost = (from == CACHE_LIST_T1) ? CACHE_LIST_B1 : CACHE_LIST_B2;
+	return (victim);
+}
+
+int32_t arc_admit(uint32_t tag, Flag full) {
+
+	// Local Variables
+	int32_t		ghost = find_cache_entry(&cacheShard->ghostIndex, tag);
+	int			list = (ghost != CACHE_NO_ENTRY) ? (cacheShard->ghostIndex.state[ghost] & CACHE_STATE_LIST) : CACHE_LIST_NONE;
+	uint32_t	b1 = cacheShard->cacheLists[CACHE_LIST_B1].length, b2 = cacheShard->cacheLists[CACHE_LIST_B2].length;
+	uint32_t	t1 = cacheShard->cacheLists[CACHE_LIST_T1].length, t2 = cacheShard->cacheLists[CACHE_LIST_T2].length;
+	uint32_t	delta = 0;
+
+	// Ghost hit on B1: recency is winning, grow T1's target
+	if (list == CACHE_LIST_B1) {
+		delta = (b2 > b1) ? b2 / b1 : 1;
+		cacheShard->cacheAdmitTarget = (cacheShard->arcTarget + delta > cacheShard->shardSize) ? cacheShard->shardSize : cacheShard->arcTarget + delta;
+		cacheShard->cacheAdmitGhost = ghost;
+		cacheShard->cacheAdmitList = CACHE_LIST_T2;
+		return ((full == YES) ? arc_replace(NO) : CACHE_NO_ENTRY);
+	}
+
+	// Ghost hit on B2: frequency is winning, shrink T1's target
+	if (list == CACHE_LIST_B2) {
+		delta = (b1 > b2) ? b1 / b2 : 1;
+		cacheShard->cacheAdmitTarget = (cacheShard->arcTarget > delta) ? cacheShard->arcTarget - delta : 0;
+		cacheShard->cacheAdmitGhost = ghost;
+		cacheShard->cacheAdmitList = CACHE_LIST_T2;
+		return ((full == YES) ? arc_replace(YES) : CACHE_NO_ENTRY);
+	}
+
+	// Complete miss: trim the history so T1+B1 <= c and T1+T2+B1+B2 <= 2c
+	cacheShard->cacheAdmitList = CACHE_LIST_T1;
+	if (t1 + b1 >= cacheShard->shardSize) {
+		if (t1 < cacheShard->shardSize) {
+			cacheShard->cacheAdmitTrim = CACHE_LIST_B1;
+		} else if (full == YES) {
+			return (pick_resident_victim(CACHE_LIST_T1, &list));
+		}
+	} else if (t1 + t2 + b1 + b2 >= 2 * cacheShard->shardSize) {
+		cacheShard->cacheAdmitTrim = CACHE_LIST_B2;
+	}
+	return ((full == YES) ? arc_replace(NO) : CACHE_NO_ENTRY);
+}
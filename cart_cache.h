@@ -17,12 +17,57 @@
 // Defines
 #define DEFAULT_CART_FRAME_CACHE_SIZE 1024  // Default size for cache
 
+// Cache replacement policies
+typedef enum {
+	CART_CACHE_LRU     = 0,  // Least recently used
+	CART_CACHE_CLOCK   = 1,  // CLOCK (second chance) approximation of LRU
+	CART_CACHE_2Q      = 2,  // 2Q, scan resistant FIFO + LRU queues
+	CART_CACHE_ARC     = 3,  // Adaptive replacement cache
+	CART_CACHE_MAXPOLICY = 4 // Number of policies
+} CartCachePolicies;
+
+// When written frames reach CART memory
+typedef enum {
+	CART_CACHE_WRITETHROUGH = 0, // Written frames go to CART memory immediately and are cached
+	CART_CACHE_WRITEBACK    = 1, // Written frames are cached dirty and written on eviction or flush
+} CartCacheModes;
+
+// What the cache has counted since the program started
+typedef struct {
+	uint64_t hits;       // lookups that found the frame cached
+	uint64_t misses;     // lookups that did not
+	uint64_t inserts;    // frames placed in the cache
+	uint64_t evictions;  // frames evicted to make room for another
+	uint64_t writebacks; // dirty frames written back to CART memory (on eviction or flush)
+} CartCacheStats;
+
+// Function the cache calls to write a dirty frame back to CART memory
+typedef int (*CartCacheWriter)(CartridgeIndex cart, CartFrameIndex frm, void *frame);
+
 ///
 // Cache Interfaces
 
 int set_cart_cache_size(uint32_t max_frames);
 	// Set the size of the cache (must be called before init)
 
+uint32_t get_cart_cache_size(void);
+	// Return the size of the cache in frames
+
+int set_cart_cache_shards(uint32_t shards);
+	// Set the number of independently locked shards the cache is split into (must be called before init)
+
+int set_cart_cache_policy(const char *name);
+	// Select the replacement policy by name: lru, clock, 2q or arc (must be called before init)
+
+int set_cart_cache_mode(CartCacheModes mode);
+	// Select write-through or write-back caching (must be called before init)
+
+CartCacheModes get_cart_cache_mode(void);
+	// Return the caching mode for written frames
+
+int set_cart_cache_writer(CartCacheWriter writer);
+	// Register the function used to write dirty frames back to CART memory
+
 int init_cart_cache(void);
 	// Initialize the cache 
 
@@ -32,8 +77,26 @@ int close_cart_cache(void);
 int put_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *frame);
 	// Put an object into the object cache, evicting other items as necessary
 
+int put_dirty_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *frame);
+	// Put a written frame into the cache to be written back later (write-back mode)
+
+int flush_cart_cache(void);
+	// Write all dirty frames back to CART memory, returns number written
+
 void * get_cart_cache(CartridgeIndex dsk, CartFrameIndex blk);
-	// Get an object from the cache (and return it)
+	// Get an object from the cache (and return it); concurrent callers pin instead
+
+void * peek_cart_cache(CartridgeIndex dsk, CartFrameIndex blk);
+	// Look for an object in the cache without counting it as a reference
+
+void * pin_cart_cache(CartridgeIndex dsk, CartFrameIndex blk);
+	// Get an object from the cache and keep it cached and in place until unpinned
+
+int unpin_cart_cache(CartridgeIndex dsk, CartFrameIndex blk);
+	// Release a reference taken by pin_cart_cache
+
+int get_cart_cache_stats(CartCacheStats *stats);
+	// Add up what the cache has counted, over the shards and the caches already closed
 
 //
 // Unit test
@@ -11,20 +11,29 @@
 // Include Files
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 // Project Include Files
 #include "cart_driver.h"
 #include "cart_network.h"
 #include "cart_controller.h"
+#include "cart_trace.h"
 #include "cmpsc311_log.h"
 #include "cmpsc311_util.h"
 
 //  Global data
-int client_socket = -1;
 int                cart_network_shutdown = 0;   // Flag indicating shutdown
 unsigned char     *cart_network_address = NULL; // Address of CART server
 unsigned short     cart_network_port = 0;       // Port of CART serve
@@ -38,10 +47,80 @@ typedef enum Flag {
 	NO = 1
 } Flag;
 
+// A request queued on the bus engine
+typedef struct CartBusPending {
+	CartXferRegister	reg;		// request registers
+	CartXferRegister	header;		// request registers in network byte order
+	void				*buf;		// frame to write from or read into
+	void				*payload;	// bytes sent after the registers (buf, or its encoding)
+	size_t				length;		// size of payload
+	char				*encoded;	// encoding of buf the connection owns until sent, else NULL
+	CartBusCallback		done;		// called with the response, may be NULL
+	void				*tag;		// passed back to done
+	uint64_t			queued;		// client_cart_bus_clock when the request was queued
+} CartBusPending;
+
+// A connection to one CART server and the requests queued on it (the counters
+// run freely, a slot is counter % CART_BUS_QUEUE)
+typedef struct CartBusConnection {
+	char				address[INET_ADDRSTRLEN];	// address of the server
+	unsigned short		port;						// port of the server
+	int					socket;						// connection to the server, -1 if closed
+	CartXferRegister	capabilities;				// protocol extensions the server took at INITMS
+	CartBusPending		queue[CART_BUS_QUEUE];
+	uint32_t			head;						// oldest request still waiting for its response
+	uint32_t			sent;						// next request to send
+	uint32_t			tail;						// next free slot
+	size_t				sendOffset;					// bytes of the request at sent already sent
+	size_t				recvStart;					// first byte of recvBuffer not yet consumed
+	size_t				recvEnd;					// end of the bytes received into recvBuffer
+	char				recvBuffer[CART_RECV_BUFFER];	// responses received but not yet completed
+} CartBusConnection;
+
+// A request sent as several (to every server, or a run of frames one frame at
+// a time), completed once all of its parts have been
+typedef struct CartBusGroup {
+	int					remaining;	// parts yet to complete
+	CartXferRegister	resp;		// response for the submitter, failed if any part failed
+	CartBusCallback		done;		// the submitter's callback
+	void				*tag;		// passed back to done
+} CartBusGroup;
+
 // Global Variables
-Flag	initialized = NO;
+Flag				initialized = NO;
+CartBusConnection	busServers[CART_MAX_SERVERS];	// servers the cartridges are striped over
+int					busServerCount = 0;				// number of servers (0 until configured)
+CartridgeIndex		busCart = 0;					// cart of the last LDCART, frame requests go to its server
+uint32_t			busPending = 0;					// requests queued over all connections
+int					busEpoll = -1;					// epoll instance watching every connection
+pthread_mutex_t		busLock = PTHREAD_MUTEX_INITIALIZER;	// guards the bus engine, held while callbacks run
+pthread_cond_t		busProgress = PTHREAD_COND_INITIALIZER;	// broadcast when the engine has made progress
+Flag				busPolling = NO;				// a thread is waiting on the sockets for every waiter
+CartBusStats		busStats;						// what the engine has counted, guarded by busLock
+CartBusLoopback		busLoopback = NULL;				// serves the carts in process when set, instead of a server
+size_t				busTransferLimit = 0;			// most bytes one send or read moves, 0 for no limit (tests)
 
 // Functions
+int connect_cart_servers(void);
+void close_cart_server(CartBusConnection *conn);
+CartBusConnection * route_cart_request(CartXferRegister reg);
+int queue_cart_request(CartBusConnection *conn, CartXferRegister reg, void *buf, CartBusCallback done, void *tag);
+int send_queued_requests(CartBusConnection *conn);
+int watch_cart_server(CartBusConnection *conn);
+int recv_queued_responses(CartBusConnection *conn);
+int service_cart_servers(void);
+int fail_queued_requests(void);
+size_t request_payload(CartXferRegister reg);
+size_t response_payload(CartXferRegister reg, CartXferRegister resp);
+int queue_cart_group(CartBusConnection **conns, int count, CartXferRegister *regs, char *buf, size_t stride,
+		CartXferRegister resp, CartBusCallback done, void *tag);
+void complete_group(void *tag, CartXferRegister resp);
+void store_batch_response(void *tag, CartXferRegister resp);
+int submit_cart_request(CartXferRegister reg, void *buf, CartBusCallback done, void *tag);
+int start_cart_requests(CartBusRequest *reqs, int count, int *remaining);
+int poll_cart_servers(int timeout);
+int wait_cart_requests(int *remaining);
+void count_cart_response(CartBusPending *pending, CartXferRegister resp, size_t received);
 
 uint64_t extract_opcode(CartXferRegister resp, CartRegisters reg_field) {
 
@@ -73,380 +152,1357 @@ uint64_t extract_opcode(CartXferRegister resp, CartRegisters reg_field) {
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : client_cart_bus_request
-// Description  : This the client operation that sends a request to the CART
-//                server process.   It will:
+// Function     : client_cart_bus_servers
+// Description  : Set the CART servers the cartridges are striped over, cart c
+//                being served by server c % count.  Server k uses the k-th
+//                address and port of the lists, or the last one given when a
+//                list is shorter (so "-i 10.0.0.1 -p 21785,21786" is two
+//                servers on one host).  Must be called before INITMS.
 //
-//                1) if INIT make a connection to the server
-//                2) send any request to the server, returning results
-//                3) if CLOSE, will close the connection
+// Inputs       : addresses - comma separated IP addresses (NULL for the default)
+//                ports - comma separated port numbers (NULL for the default)
+// Outputs      : 0 if successful, -1 if failure
 //
-// Inputs       : reg - the request reqisters for the command
-//                buf - the block to be read/written from (READ/WRITE)
-// Outputs      : the response structure encoded as needed
 ////////////////////////////////////////////////////////////////////////////////
-CartXferRegister client_cart_bus_request(CartXferRegister reg, void *buf) {
+int client_cart_bus_servers(const char *addresses, const char *ports) {
 
 	// Local Variables
-	int					socket_fd = client_socket;
-	uint8_t				request;
+	int				count = 0;
+	unsigned int	port = CART_DEFAULT_PORT;
+	const char		*address = CART_DEFAULT_IP;
+	size_t			length = strlen(CART_DEFAULT_IP);
+	struct in_addr	check;
+
+	if (initialized == YES) {
+		logMessage(LOG_ERROR_LEVEL, "\nCART servers can't change once the bus is initialized\n");
+		return (-1);
+	}
+	busLoopback = NULL;
+
+	// Walk both lists together, until both have run out
+	for (count = 0; count == 0 || (addresses != NULL && *addresses != '\0') || (ports != NULL && *ports != '\0'); count++) {
+		if (count == CART_MAX_SERVERS) {
+			logMessage(LOG_ERROR_LEVEL, "\nMore than %d CART servers requested\n", CART_MAX_SERVERS);
+			return (-1);
+		}
+		if (addresses != NULL && *addresses != '\0') {
+			address = addresses;
+			length = strcspn(addresses, ",");
+			addresses += length + (addresses[length] == ',');
+		}
+		if (ports != NULL && *ports != '\0') {
+			if (sscanf(ports, "%u", &port) != 1 || port == 0 || port > 0xffff) {
+				logMessage(LOG_ERROR_LEVEL, "\nBad port number [%s]\n", ports);
+				return (-1);
+			}
+			ports += strcspn(ports, ",");
+			ports += (*ports == ',');
+		}
+
+		if (length >= INET_ADDRSTRLEN) {
+			logMessage(LOG_ERROR_LEVEL, "\nBad IP address [%s]\n", address);
+			return (-1);
+		}
+		memcpy(busServers[count].address, address, length);
+		busServers[count].address[length] = '\0';
+		if (inet_aton(busServers[count].address, &check) == 0) {
+			logMessage(LOG_ERROR_LEVEL, "\nBad IP address [%s]\n", busServers[count].address);
+			return (-1);
+		}
+		busServers[count].port = port;
+		busServers[count].socket = -1;
+	}
 
-	CartXferRegister	value = 0;
-	CartXferRegister	response = 0;
+	busServerCount = count;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_cart_bus_loopback
+// Description  : Serve the cartridges in process instead of over the
+//                network: at INITMS the bus connects a socket pair and hands
+//                the other end to attach, which serves it (with
+//                cart_server_loopback) until the bus closes it at POWOFF.
+//                Requests take the same path as they do to a server, so
+//                runs are measured the same way, just without the network.
+//                Must be called before INITMS.
+//
+// Inputs       : attach - starts serving the carts on the socket it is given
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int client_cart_bus_loopback(CartBusLoopback attach) {
+
+	if (initialized == YES || attach == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "\nCART loopback can't be set once the bus is initialized\n");
+		return (-1);
+	}
 
+	strcpy(busServers[0].address, "loopback");
+	busServers[0].port = 0;
+	busServers[0].socket = -1;
+	busServerCount = 1;
+	busLoopback = attach;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_cart_bus_transfer_limit
+// Description  : Cut every send and read of the bus to at most "bytes", so
+//                tests can check that requests and responses cut short
+//                resume where they stopped
+//
+// Inputs       : bytes - most bytes one send or read moves, 0 for no limit
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int client_cart_bus_transfer_limit(size_t bytes) {
+
+	if (initialized == YES) {
+		logMessage(LOG_ERROR_LEVEL, "\nCART transfer limit can't be set once the bus is initialized\n");
+		return (-1);
+	}
+	busTransferLimit = bytes;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : connect_cart_servers
+// Description  : Open a connection to every CART server (the address and port
+//                set by cart_network_address/port, or the defaults, when no
+//                servers were configured)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int connect_cart_servers(void) {
+
+	// Local Variables
+	int		i = 0;
+	int		nodelay = 1;
+	int		buffer = CART_SOCKET_BUFFER;
+	int		pair[2];
+	char	port[8];
 	struct	sockaddr_in caddr;
-	char *ip = CART_DEFAULT_IP;
-	cart_network_port = CART_DEFAULT_PORT;
+	struct	epoll_event event;
+	CartBusConnection	*conn = NULL;
 
+	if (busServerCount == 0) {
+		snprintf(port, sizeof(port), "%hu", (cart_network_port != 0) ? cart_network_port : CART_DEFAULT_PORT);
+		if (client_cart_bus_servers((const char *)cart_network_address, port) != 0)
+			return (-1);
+	}
 
-	// Obtain the network request
-	request = extract_opcode(reg, CART_REG_KY1);
+	logMessage(LOG_INFO_LEVEL, "\nInitialize Server Connection\n");
 
-	// Check if socket is open
-	if (socket_fd != -1) {
-		logMessage(LOG_ERROR_LEVEL, "\nSocket already open. Aborting...\n");
+	// The bus engine never blocks on a socket, it waits for them with epoll
+	if ((busEpoll = epoll_create1(0)) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "\nUnable to set up the bus engine\n");
 		return (-1);
 	}
 
-	// Handle the request
-	switch (request) {
-		case(CART_OP_INITMS) :
-	
-			while (initialized == NO) {
+	for (i = 0; i < busServerCount; i++) {
+		conn = &busServers[i];
+		conn->head = conn->sent = conn->tail = 0;
+		conn->capabilities = 0;
+		conn->sendOffset = conn->recvStart = conn->recvEnd = 0;
+
+		caddr.sin_family = AF_INET;
+		caddr.sin_port = htons(conn->port);
+		inet_aton(conn->address, &caddr.sin_addr);
+
+		// The loopback controller serves the other end of a socket pair
+		if (busLoopback != NULL) {
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+				logMessage(LOG_ERROR_LEVEL, "\nError on loopback socket creation\n");
+				fail_queued_requests();
+				return (-1);
+			}
+			conn->socket = pair[0];
+			if (busLoopback(pair[1]) != 0) {
+				logMessage(LOG_ERROR_LEVEL, "\nUnable to start the loopback controller\n");
+				fail_queued_requests();
+				return (-1);
+			}
+		}
+		else {
+			conn->socket = socket(PF_INET, SOCK_STREAM, 0);
+			if (conn->socket == -1) {
+				logMessage(LOG_ERROR_LEVEL, "\nError on socket creation\n");
+				fail_queued_requests();
+				return (-1);
+			}
+			if (connect(conn->socket, (const struct sockaddr *)&caddr, sizeof(caddr)) == -1) {
+				logMessage(LOG_ERROR_LEVEL, "\nError on socket connect to %s:%hu\n", conn->address, conn->port);
+				fail_queued_requests();
+				return (-1);
+			}
+
+			// Requests are small and pipelined, so send them without waiting on Nagle
+			if (setsockopt(conn->socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1)
+				logMessage(LOG_WARNING_LEVEL, "\nUnable to tune the server connection, continuing\n");
+		}
+
+		// Give the socket room for a whole queue of frames in each direction
+		if (setsockopt(conn->socket, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer)) == -1 ||
+				setsockopt(conn->socket, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer)) == -1) {
+			logMessage(LOG_WARNING_LEVEL, "\nUnable to tune the server connection, continuing\n");
+		}
+
+		event.events = EPOLLIN;
+		event.data.ptr = conn;
+		if (fcntl(conn->socket, F_SETFL, fcntl(conn->socket, F_GETFL, 0) | O_NONBLOCK) == -1 ||
+				epoll_ctl(busEpoll, EPOLL_CTL_ADD, conn->socket, &event) == -1) {
+			logMessage(LOG_ERROR_LEVEL, "\nUnable to set up the bus engine on the server connection\n");
+			fail_queued_requests();
+			return (-1);
+		}
+	}
 
-				logMessage(LOG_INFO_LEVEL, "\nInitialize Server Connection\n");
+	busPending = 0;
+	initialized = YES;
+	logMessage(LOG_INFO_LEVEL, "\nInitialization Complete (%d servers)\n", busServerCount);
+	return (0);
+}
 
-				caddr.sin_family = AF_INET;
-				caddr.sin_port = htons(cart_network_port);
-				if (inet_aton(ip, &caddr.sin_addr) == 0) {
-					logMessage(LOG_ERROR_LEVEL, "\nUnable to obtain address\n");
-					return(-1);
-				}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : close_cart_server
+// Description  : Close the connection to one CART server, and shut the bus
+//                engine down once no connection is left
+//
+// Inputs       : conn - the server connection
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void close_cart_server(CartBusConnection *conn) {
 
-				logMessage(LOG_INFO_LEVEL, "\nCreating socket...\n");
+	// Local Variables
+	int		i = 0;
 
-				socket_fd = socket(PF_INET, SOCK_STREAM, 0);
-				if (socket_fd == -1) {
-					logMessage(LOG_ERROR_LEVEL, "\nError on socket creation\n");
-					return(-1);
-				}
+	if (conn->socket != -1)
+		close(conn->socket);
+	conn->socket = -1;
+	conn->sendOffset = 0;
+	conn->recvStart = conn->recvEnd = 0;
 
-				logMessage(LOG_INFO_LEVEL, "\nConnecting to server...\n");
+	for (i = 0; i < busServerCount; i++) {
+		if (busServers[i].socket != -1)
+			return;
+	}
+	if (busEpoll != -1)
+		close(busEpoll);
+	busEpoll = -1;
+	initialized = NO;
+}
 
-				if (connect(socket_fd, (const struct sockaddr *)&caddr, sizeof(caddr)) == -1) {
-					logMessage(LOG_ERROR_LEVEL, "\nError on socket connect\n");
-					return (-1);
-				}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : route_cart_request
+// Description  : Find the server connection a request goes to.  An LDCART
+//                goes to the server of its cart, and the frame requests after
+//                it follow to the same server (they act on its loaded cart).
+//
+// Inputs       : reg - the request registers
+// Outputs      : the server connection
+//
+////////////////////////////////////////////////////////////////////////////////
+CartBusConnection * route_cart_request(CartXferRegister reg) {
 
-				initialized = YES;
-				logMessage(LOG_INFO_LEVEL, "\nInitialization Complete\n");
+	if (extract_opcode(reg, CART_REG_KY1) == CART_OP_LDCART)
+		busCart = extract_opcode(reg, CART_REG_CT1);
+	return (&busServers[busCart % busServerCount]);
+}
 
-			}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : queue_cart_request
+// Description  : Add a request to a server connection's queue, waiting for
+//                room as needed
+//
+// Inputs       : conn - the server connection
+//                reg, buf, done, tag - the request (see client_cart_bus_submit)
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int queue_cart_request(CartBusConnection *conn, CartXferRegister reg, void *buf, CartBusCallback done, void *tag) {
 
-			// CLIENT WRITE
+	// Local Variables
+	CartBusPending	*pending = NULL;
 
-			// Send network reg using network byte order conversion
-			value = htonll64(reg);	
-			if (write(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError writing network data\n");
-				return(-1);
-			}
-			// Send network data's length as well
-			value = htonll64(0);
-			if (write(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError sending buf length\n");
-				return(-1);
-			}
+	// Make room in the queue
+	while (conn->tail - conn->head == CART_BUS_QUEUE) {
+		if (poll_cart_servers(-1) < 0)
+			return (-1);
+	}
+	if (conn->socket == -1) {
+		logMessage(LOG_ERROR_LEVEL, "\nCART bus request to a closed server connection\n");
+		return (-1);
+	}
 
-			// CLIENT READ
+	pending = &conn->queue[conn->tail % CART_BUS_QUEUE];
+	pending->reg = reg;
+	pending->header = htonll64(reg);
+	pending->buf = buf;
+	pending->payload = buf;
+	pending->length = request_payload(reg);
+	pending->encoded = NULL;
+
+	// Send the frames run length encoded if the server takes them that way
+	if (pending->length > 0 && (conn->capabilities & CART_NET_CAP_COMPRESS)) {
+		if ((pending->encoded = malloc(CART_NET_ENCODED_MAX(pending->length / CART_FRAME_SIZE))) == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "\nCART bus unable to allocate an encoding buffer\n");
+			return (-1);
+		}
+		pending->length = cart_net_encode_frames(buf, pending->length / CART_FRAME_SIZE, pending->encoded);
+		pending->payload = pending->encoded;
+	}
+	pending->done = done;
+	pending->tag = tag;
+	pending->queued = client_cart_bus_clock();
+	conn->tail++;
+	busPending++;
+
+	// Another thread is asleep on the sockets, so get the request out now rather than when it wakes
+	// (and have it wake for whatever the socket would not take)
+	if (busPolling == YES && (send_queued_requests(conn) != 0 || watch_cart_server(conn) != 0))
+		return (fail_queued_requests());
+	return (0);
+}
 
-			// Read network reg using network byte order conversion
-			if (read(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-				return(-1);
-			}
-			response = ntohll64(value);
-			// Read network's data length being received
-			if (read(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-				return(-1);
-			}
-			value = ntohll64(value);
-			// Only initialization so should return zero
-			if (value != 0) {
-				logMessage(LOG_ERROR_LEVEL, "\nError reading from network\n");
-				return (-1);
-			}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : watch_cart_server
+// Description  : Set the socket events waited for on a connection: responses,
+//                and room to send while requests are still unsent
+//
+// Inputs       : conn - the server connection
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int watch_cart_server(CartBusConnection *conn) {
 
-			// Return successfully
-			return (response);	
-			break;	// Shouldn't need to reach here
+	// Local Variables
+	struct epoll_event	event;
 
-		case(CART_OP_BZERO) :
+	event.events = EPOLLIN | ((conn->sent != conn->tail) ? EPOLLOUT : 0);
+	event.data.ptr = conn;
+	if (epoll_ctl(busEpoll, EPOLL_CTL_MOD, conn->socket, &event) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "\nError waiting on the server connection\n");
+		return (-1);
+	}
+	return (0);
+}
 
-			// CLIENT WRITE
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : send_queued_requests
+// Description  : Send as many queued requests as the socket will take without
+//                blocking, several at a time with writev: each request is its
+//                8 byte register in network byte order, followed by the
+//                frame(s) of a WRFRME/WRFRMS (encoded if negotiated)
+//
+// Inputs       : conn - the server connection
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int send_queued_requests(CartBusConnection *conn) {
 
-			// Send network reg using network byte order conversion
-			value = htonll64(reg);
-			if (write(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError writing network data\n");
-				return(-1);
+	// Local Variables
+	int				vecs = 0;
+	int				first = 0;
+	int				i = 0;
+	uint32_t		next = 0;
+	ssize_t			sent = 0;
+	size_t			skip = conn->sendOffset;
+	size_t			limit = 0;
+	struct iovec	iov[CART_MAX_BATCH * 2];
+	CartBusPending	*pending = NULL;
+
+	while (conn->sent != conn->tail) {
+
+		// Lay the unsent requests out back to back, frames straight from the caller's buffers
+		for (vecs = 0, next = conn->sent; next != conn->tail && vecs + 2 <= CART_MAX_BATCH * 2; next++) {
+			pending = &conn->queue[next % CART_BUS_QUEUE];
+			iov[vecs].iov_base = &pending->header;
+			iov[vecs++].iov_len = sizeof(CartXferRegister);
+			if (pending->length > 0) {
+				iov[vecs].iov_base = pending->payload;
+				iov[vecs++].iov_len = pending->length;
 			}
-			// Send network data's length as well
-			value = htonll64(0);
-			if (write(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError sending buf length\n");
-				return(-1);
+		}
+
+		// Step over what already went of the first request: its registers, and maybe some of its frames
+		for (first = 0; skip >= iov[first].iov_len; first++)
+			skip -= iov[first].iov_len;
+		iov[first].iov_base = (char *)iov[first].iov_base + skip;
+		iov[first].iov_len -= skip;
+
+		// Stop the send at the transfer limit
+		for (i = first, limit = 0; busTransferLimit > 0 && i < vecs; i++) {
+			if (limit + iov[i].iov_len >= busTransferLimit) {
+				iov[i].iov_len = busTransferLimit - limit;
+				vecs = i + 1;
 			}
+			limit += iov[i].iov_len;
+		}
+
+		if ((sent = writev(conn->socket, &iov[first], vecs - first)) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return (0);
+			logMessage(LOG_ERROR_LEVEL, "\nError writing network data\n");
+			return (-1);
+		}
+
+		// Retire the requests sent completely, remembering how much of the next one went
+		sent += conn->sendOffset;
+		while (conn->sent != conn->tail) {
+			pending = &conn->queue[conn->sent % CART_BUS_QUEUE];
+			skip = sizeof(CartXferRegister) + pending->length;
+			if ((size_t)sent < skip)
+				break;
+			sent -= skip;
+			free(pending->encoded);
+			pending->encoded = NULL;
+			conn->sent++;
+		}
+		conn->sendOffset = skip = sent;
+	}
+	return (0);
+}
 
-			// CLIENT READ
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : recv_queued_responses
+// Description  : Receive the responses that have arrived without blocking, in
+//                the order the requests were sent, and complete their
+//                requests; a successful RDFRME/RDFRMS is followed by its frame(s),
+//                encoded if negotiated.  Each read takes as many responses as the
+//                socket holds.
+//
+// Inputs       : conn - the server connection
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int recv_queued_responses(CartBusConnection *conn) {
 
-			// Read network reg using network byte order conversion
-			if (read(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-				return(-1);
+	// Local Variables
+	int					quickack = 1;
+	ssize_t				got = 0;
+	size_t				wanted = 0;
+	size_t				payload = 0;
+	size_t				room = 0;
+	int					measured = 0;
+	CartXferRegister	resp = 0;
+	CartBusPending		*pending = NULL;
+	CartBusPending		finished;
+
+	while (conn->head != conn->sent) {
+		pending = &conn->queue[conn->head % CART_BUS_QUEUE];
+
+		// Complete the oldest request if its response is all here: the registers, then the
+		// frame(s) of a successful read
+		wanted = sizeof(CartXferRegister);
+		if (conn->recvEnd - conn->recvStart >= wanted) {
+			memcpy(&resp, &conn->recvBuffer[conn->recvStart], sizeof(resp));
+			resp = ntohll64(resp);
+			payload = response_payload(pending->reg, resp);
+
+			// An encoded payload's size is known once its frame lengths are all here
+			if (payload > 0 && (conn->capabilities & CART_NET_CAP_COMPRESS)) {
+				measured = cart_net_encoded_size(&conn->recvBuffer[conn->recvStart + wanted],
+						conn->recvEnd - conn->recvStart - wanted, payload / CART_FRAME_SIZE, &payload);
+				if (measured < 0) {
+					logMessage(LOG_ERROR_LEVEL, "\nMalformed encoded frames from server %s:%hu\n", conn->address, conn->port);
+					return (-1);
+				}
+				if (measured > 0)
+					payload = conn->recvEnd - conn->recvStart;
 			}
-			response = ntohll64(value);
-			// Read network's data length being received
-			if (read(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-				return(-1);
+			wanted += payload;
+		}
+		if (conn->recvEnd - conn->recvStart >= wanted) {
+			if (wanted > sizeof(CartXferRegister) && (conn->capabilities & CART_NET_CAP_COMPRESS)) {
+				if (cart_net_decode_frames(&conn->recvBuffer[conn->recvStart + sizeof(CartXferRegister)],
+						response_payload(pending->reg, resp) / CART_FRAME_SIZE, pending->buf) != 0) {
+					logMessage(LOG_ERROR_LEVEL, "\nMalformed encoded frames from server %s:%hu\n", conn->address, conn->port);
+					return (-1);
+				}
 			}
-			value = ntohll64(value);
-			// Only zeroing the cartridges so should return zero
-			if (value != 0) {
-				logMessage(LOG_ERROR_LEVEL, "\nError reading from network\n");
-				return (-1);
+			else if (wanted > sizeof(CartXferRegister))
+				memcpy(pending->buf, &conn->recvBuffer[conn->recvStart + sizeof(CartXferRegister)],
+						wanted - sizeof(CartXferRegister));
+			conn->recvStart += wanted;
+
+			// The server answers INITMS with the protocol extensions it takes
+			if (extract_opcode(pending->reg, CART_REG_KY1) == CART_OP_INITMS)
+				conn->capabilities = resp & pending->reg & CART_NET_RUN_MASK;
+
+			// Free the slot before calling back, so the callback may queue more requests
+			count_cart_response(pending, resp, wanted);
+			finished = *pending;
+			conn->head++;
+			busPending--;
+			if (finished.done != NULL)
+				finished.done(finished.tag, resp);
+
+			// Power off the server connection
+			if (extract_opcode(finished.reg, CART_REG_KY1) == CART_OP_POWOFF) {
+				close_cart_server(conn);
+				logMessage(LOG_INFO_LEVEL, "Successfully powered off server %s:%hu", conn->address, conn->port);
+				return (0);
 			}
+			continue;
+		}
+
+		// Make room after what is left of the response and read everything available
+		if (conn->recvStart > 0) {
+			memmove(conn->recvBuffer, &conn->recvBuffer[conn->recvStart], conn->recvEnd - conn->recvStart);
+			conn->recvEnd -= conn->recvStart;
+			conn->recvStart = 0;
+		}
+		room = CART_RECV_BUFFER - conn->recvEnd;
+		if (busTransferLimit > 0 && room > busTransferLimit)
+			room = busTransferLimit;
+		got = read(conn->socket, &conn->recvBuffer[conn->recvEnd], room);
+		if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return (0);
+		if (got <= 0) {
+			logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
+			return (-1);
+		}
+		conn->recvEnd += got;
+
+		// Acknowledge straight away: the server sends a response in pieces and holds back
+		// the rest until the first is acknowledged, which delayed ACKs would stall for ~40ms
+		// (a loopback socket pair has no ACKs to hold back)
+		if (busLoopback == NULL)
+			setsockopt(conn->socket, IPPROTO_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+	}
+	return (0);
+}
 
-			// Return successfully
-			return (response);
-			break;	// Shouldn't need to reach here
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : service_cart_servers
+// Description  : Send and receive what every open connection allows right now
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int service_cart_servers(void) {
 
-		case(CART_OP_LDCART) :
+	// Local Variables
+	int		i = 0;
 
-			// CLIENT WRITE
+	for (i = 0; i < busServerCount; i++) {
+		if (busServers[i].socket != -1 &&
+				(send_queued_requests(&busServers[i]) != 0 || recv_queued_responses(&busServers[i]) != 0))
+			return (-1);
+	}
+	return (0);
+}
 
-			// Send network reg using network byte order conversion
-			value = htonll64(reg);
-			if (write(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError writing network data\n");
-				return(-1);
-			}
-			// Send network data's length as well
-			value = htonll64(0);
-			if (write(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError sending buf length\n");
-				return(-1);
-			}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fail_queued_requests
+// Description  : Drop every server connection after an error, completing
+//                every queued request with a failed response
+//
+// Inputs       : none
+// Outputs      : -1 always
+//
+////////////////////////////////////////////////////////////////////////////////
+int fail_queued_requests(void) {
 
-			// CLIENT READ
+	// Local Variables
+	int				i = 0;
+	CartBusPending	finished;
+
+	for (i = 0; i < busServerCount; i++) {
+		close_cart_server(&busServers[i]);
+		while (busServers[i].head != busServers[i].tail) {
+			finished = busServers[i].queue[busServers[i].head++ % CART_BUS_QUEUE];
+			busPending--;
+			free(finished.encoded);
+			if (finished.done != NULL)
+				finished.done(finished.tag, (CartXferRegister)-1);
+		}
+		busServers[i].sent = busServers[i].tail;
+	}
+	return (-1);
+}
 
-			// Read network reg using network byte order conversion
-			if (read(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-				return(-1);
-			}
-			response = ntohll64(value);
-			// Read network's data length being received
-			if (read(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-				return(-1);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : request_payload
+// Description  : Number of frame bytes sent after a request's registers
+//
+// Inputs       : reg - the request registers
+// Outputs      : payload size in bytes
+//
+////////////////////////////////////////////////////////////////////////////////
+size_t request_payload(CartXferRegister reg) {
+
+	switch (extract_opcode(reg, CART_REG_KY1)) {
+	case(CART_OP_WRFRME) :
+		return (CART_FRAME_SIZE);
+	case(CART_OP_WRFRMS) :
+		return ((reg & CART_NET_RUN_MASK) * CART_FRAME_SIZE);
+	default:
+		return (0);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : response_payload
+// Description  : Number of frame bytes received after a response's registers
+//
+// Inputs       : reg - the request registers
+//                resp - the response registers
+// Outputs      : payload size in bytes
+//
+////////////////////////////////////////////////////////////////////////////////
+size_t response_payload(CartXferRegister reg, CartXferRegister resp) {
+
+	if (extract_opcode(resp, CART_REG_RT1) != 0)
+		return (0);
+	switch (extract_opcode(reg, CART_REG_KY1)) {
+	case(CART_OP_RDFRME) :
+		return (CART_FRAME_SIZE);
+	case(CART_OP_RDFRMS) :
+		return ((reg & CART_NET_RUN_MASK) * CART_FRAME_SIZE);
+	default:
+		return (0);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_net_encode_frames
+// Description  : Run length encode frames for the link (see cart_network.h);
+//                a frame that doesn't shrink is sent as it is
+//
+// Inputs       : frames - the frames, back to back
+//                count - number of frames
+//                out - where the encoding goes, CART_NET_ENCODED_MAX(count) bytes
+// Outputs      : size of the encoding in bytes
+//
+////////////////////////////////////////////////////////////////////////////////
+size_t cart_net_encode_frames(const char *frames, uint32_t count, char *out) {
+
+	// Local Variables
+	uint32_t	i = 0;
+	size_t		used = 0;				// bytes of out written
+	size_t		length = 0;				// bytes of the current frame's encoding
+	size_t		start = 0, run = 0;		// the run of equal bytes being encoded
+	const char	*frame = NULL;
+	char		*header = NULL;
+
+	for (i = 0; i < count; i++) {
+		frame = &frames[i * CART_FRAME_SIZE];
+		header = &out[used];
+		used += CART_NET_FRAME_HEADER;
+
+		// Encode runs while the encoding stays shorter than the frame
+		for (start = 0, length = 0; start < CART_FRAME_SIZE && length + CART_NET_RUN_SIZE < CART_FRAME_SIZE; start += run) {
+			for (run = 1; start + run < CART_FRAME_SIZE && frame[start + run] == frame[start]; run++)
+				;
+			out[used + length] = (char)(run >> 8);
+			out[used + length + 1] = (char)(run & 0xff);
+			out[used + length + 2] = frame[start];
+			length += CART_NET_RUN_SIZE;
+		}
+		if (start < CART_FRAME_SIZE) {
+			memcpy(&out[used], frame, CART_FRAME_SIZE);
+			length = CART_FRAME_SIZE;
+		}
+		header[0] = (char)(length >> 8);
+		header[1] = (char)(length & 0xff);
+		used += length;
+	}
+	return (used);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_net_encoded_size
+// Description  : Find the size of encoded frames from their lengths
+//
+// Inputs       : in - the encoded frames
+//                avail - bytes available at in
+//                count - number of frames
+//                size - set to the size of the encoding when found
+// Outputs      : 0 if found, 1 if more bytes are needed, -1 if malformed
+//
+////////////////////////////////////////////////////////////////////////////////
+int cart_net_encoded_size(const char *in, size_t avail, uint32_t count, size_t *size) {
+
+	// Local Variables
+	uint32_t	i = 0;
+	size_t		used = 0;
+	size_t		length = 0;
+
+	for (i = 0; i < count; i++) {
+		if (avail - used < CART_NET_FRAME_HEADER)
+			return (1);
+		length = ((size_t)(uint8_t)in[used] << 8) | (uint8_t)in[used + 1];
+		if (length > CART_FRAME_SIZE || (length < CART_FRAME_SIZE && length % CART_NET_RUN_SIZE != 0))
+			return (-1);
+		used += CART_NET_FRAME_HEADER + length;
+		if (used > avail)
+			return (1);
+	}
+	*size = used;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_net_decode_frames
+// Description  : Decode frames encoded by cart_net_encode_frames
+//
+// Inputs       : in - the encoded frames, measured by cart_net_encoded_size
+//                count - number of frames
+//                frames - where the frames go, back to back
+// Outputs      : 0 if successful, -1 if the runs don't make up the frames
+//
+////////////////////////////////////////////////////////////////////////////////
+int cart_net_decode_frames(const char *in, uint32_t count, char *frames) {
+
+	// Local Variables
+	uint32_t	i = 0;
+	size_t		j = 0;
+	size_t		length = 0;
+	size_t		filled = 0, run = 0;
+	char		*frame = NULL;
+
+	for (i = 0; i < count; i++) {
+		frame = &frames[i * CART_FRAME_SIZE];
+		length = ((size_t)(uint8_t)in[0] << 8) | (uint8_t)in[1];
+		in += CART_NET_FRAME_HEADER;
+		if (length == CART_FRAME_SIZE) {
+			memcpy(frame, in, CART_FRAME_SIZE);
+		}
+		else {
+			for (j = 0, filled = 0; j + CART_NET_RUN_SIZE <= length; j += CART_NET_RUN_SIZE) {
+				run = ((size_t)(uint8_t)in[j] << 8) | (uint8_t)in[j + 1];
+				if (run > CART_FRAME_SIZE - filled)
+					return (-1);
+				memset(&frame[filled], in[j + 2], run);
+				filled += run;
 			}
-			value = ntohll64(value);
-			// Only loading the cartridges so should return zero
-			if (value != 0) {
-				logMessage(LOG_ERROR_LEVEL, "\nError reading from network\n");
+			if (filled != CART_FRAME_SIZE)
 				return (-1);
-			}
+		}
+		in += length;
+	}
+	return (0);
+}
 
-			// Return successfully
-			return (response);
-			break;	// Shouldn't need to reach here
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : queue_cart_group
+// Description  : Queue the parts of a request sent as several, the request
+//                completing once all of its parts have
+//
+// Inputs       : conns - connection of each part
+//                count - number of parts
+//                regs - request registers of each part
+//                buf - frame buffer of the first part (or NULL)
+//                stride - offset from one part's buffer to the next
+//                resp - response for the submitter when every part succeeds
+//                done, tag - the submitter's completion
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int queue_cart_group(CartBusConnection **conns, int count, CartXferRegister *regs, char *buf, size_t stride,
+		CartXferRegister resp, CartBusCallback done, void *tag) {
 
-		case(CART_OP_RDFRME) :
+	// Local Variables
+	int				i = 0;
+	CartBusGroup	*group = malloc(sizeof(CartBusGroup));
 
-			// CLIENT WRITE
+	if (group == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "\nUnable to allocate a CART bus request group\n");
+		return (-1);
+	}
+	group->remaining = count;
+	group->resp = resp;
+	group->done = done;
+	group->tag = tag;
+
+	for (i = 0; i < count; i++) {
+		if (queue_cart_request(conns[i], regs[i], (buf != NULL) ? &buf[i * stride] : NULL, complete_group, group) != 0) {
+			// The parts never queued won't complete, so fail them here (freeing the group with the last)
+			for (; i < count; i++)
+				complete_group(group, (CartXferRegister)-1);
+			return (-1);
+		}
+	}
+	return (0);
+}
 
-			// Send network reg using network byte order conversion
-			value = htonll64(reg);
-			if (write(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError writing network data\n");
-				return(-1);
-			}
-			// Send network data's length as well
-			value = htonll64(0);
-			if (write(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError sending buf length\n");
-				return(-1);
-			}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : complete_group
+// Description  : Completion callback of one part of a request sent as several
+//
+// Inputs       : tag - the group
+//                resp - the part's response registers
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void complete_group(void *tag, CartXferRegister resp) {
 
-			// CLIENT READ
+	// Local Variables
+	CartBusGroup	*group = (CartBusGroup *)tag;
+
+	if (extract_opcode(resp, CART_REG_RT1) != 0)
+		group->resp |= ((CartXferRegister)1 << 47);
+	if (--group->remaining == 0) {
+		if (group->done != NULL)
+			group->done(group->tag, group->resp);
+		free(group);
+	}
+}
 
-			// Read network reg using network byte order conversion
-			if (read(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-				return(-1);
-			}
-			response = ntohll64(value);
-			// Read network's data length being received
-			if (read(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-				return(-1);
-			}
-			value = ntohll64(value);
-			// Read a frame sized buffer from the network
-			if (value > 0) {
-				if (read(socket_fd, buf, CART_FRAME_SIZE) != CART_FRAME_SIZE) {
-					logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-					return(-1);
-				}
-			}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_cart_bus_submit
+// Description  : Queue a request on the bus engine without waiting for it.
+//                Requests for one cart are sent and answered in the order
+//                queued, requests for carts on different servers proceed in
+//                parallel; when the response arrives done(tag, response) is
+//                called by whichever thread is progressing the bus, with the
+//                engine locked (so done must not call back into the bus).  The
+//                frame buffer must stay valid until then.  An INITMS connects
+//                to (and a POWOFF disconnects from) every server.
+//
+// Inputs       : reg - the request registers for the command
+//                buf - the frame to be read/written (READ/WRITE)
+//                done - function called with the response (or NULL)
+//                tag - value passed back to done
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int client_cart_bus_submit(CartXferRegister reg, void *buf, CartBusCallback done, void *tag) {
 
-			// Return successfully
-			return (response);
-			break;	// Shouldn't need to reach here
+	// Local Variables
+	int		result = 0;
 
-		case(CART_OP_WRFRME) :
+	pthread_mutex_lock(&busLock);
+	result = submit_cart_request(reg, buf, done, tag);
+	pthread_mutex_unlock(&busLock);
+	return (result);
+}
 
-			// CLIENT WRITE
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : submit_cart_request
+// Description  : Queue a request on the bus engine (see client_cart_bus_submit),
+//                with the engine locked
+//
+// Inputs       : reg, buf, done, tag - the request
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int submit_cart_request(CartXferRegister reg, void *buf, CartBusCallback done, void *tag) {
 
-			// Send network reg using network byte order conversion
-			value = htonll64(reg);
-			if (write(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError writing network data\n");
-				return(-1);
-			}
-			// Send network data's length as well
-			value = htonll64(CART_FRAME_SIZE);
-			if (write(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError sending buf length\n");
-				return(-1);
-			}
-			// Send buffered data over network
-			if (read(socket_fd, buf, CART_FRAME_SIZE) != CART_FRAME_SIZE) {
-				logMessage(LOG_ERROR_LEVEL, "\nError sending network data\n");
-				return(-1);
-			}
+	// Local Variables
+	int					i = 0;
+	int					frames = 0;
+	uint8_t				request = extract_opcode(reg, CART_REG_KY1);
+	CartXferRegister	single = 0;				// opcode moving one frame of a run
+	CartBusConnection	*conn = NULL;
+	CartBusConnection	*conns[CART_MAX_RUN_FRAMES > CART_MAX_SERVERS ? CART_MAX_RUN_FRAMES : CART_MAX_SERVERS];
+	CartXferRegister	regs[CART_MAX_RUN_FRAMES > CART_MAX_SERVERS ? CART_MAX_RUN_FRAMES : CART_MAX_SERVERS];
+
+	// Connect on power on
+	if (initialized != YES) {
+		if (request != CART_OP_INITMS) {
+			logMessage(LOG_ERROR_LEVEL, "\nCART bus request before the server connection was initialized\n");
+			return (-1);
+		}
+		if (connect_cart_servers() != 0)
+			return (-1);
+	}
 
-			// CLIENT READ
+	// Power on and off go to every server, after what is in flight (asking each for the extensions at power on)
+	if (request == CART_OP_INITMS || request == CART_OP_POWOFF) {
+		if (wait_cart_requests(NULL) != 0)
+			return (-1);
+		if (request == CART_OP_INITMS)
+			reg |= CART_NET_CAPABILITIES;
+		for (i = 0; i < busServerCount; i++) {
+			conns[i] = &busServers[i];
+			regs[i] = reg;
+		}
+		return (queue_cart_group(conns, busServerCount, regs, NULL, 0, reg, done, tag));
+	}
 
-			// Read network reg using network byte order conversion
-			if (read(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-				return(-1);
-			}
-			response = ntohll64(value);
-			// Read network's data length being received
-			if (read(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-				return(-1);
-			}
-			value = ntohll64(value);
-			// Read a frame sized buffer from the network
-			if (value > 0) {
-				if (read(socket_fd, buf, CART_FRAME_SIZE) != CART_FRAME_SIZE) {
-					logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-					return(-1);
-				}
-			}
+	// Cart requests go to the cart's server, runs of frames one at a time if it doesn't take them whole
+	conn = route_cart_request(reg);
+	frames = reg & CART_NET_RUN_MASK;
+	if ((request == CART_OP_RDFRMS || request == CART_OP_WRFRMS) && !(conn->capabilities & CART_NET_CAP_MULTIFRAME)) {
+		if (frames == 0 || frames > CART_MAX_RUN_FRAMES) {
+			logMessage(LOG_ERROR_LEVEL, "\nBad run of %d frames requested on the CART bus\n", frames);
+			return (-1);
+		}
+		single = (request == CART_OP_RDFRMS) ? CART_OP_RDFRME : CART_OP_WRFRME;
+		for (i = 0; i < frames; i++) {
+			conns[i] = conn;
+			regs[i] = (single << 56) | ((extract_opcode(reg, CART_REG_FM1) + i) << 15);
+		}
+		return (queue_cart_group(conns, frames, regs, buf, CART_FRAME_SIZE, reg, done, tag));
+	}
+	return (queue_cart_request(conn, reg, buf, done, tag));
+}
 
-			// Return successfully
-			return (response);
-			break;	// Shouldn't need to reach here
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_cart_bus_poll
+// Description  : Make progress on the queued requests: send what the sockets
+//                will take, complete the requests whose responses are in, and
+//                if none could be completed wait for the sockets up to timeout
+//
+// Inputs       : timeout - milliseconds to wait (0 never waits, -1 waits for
+//                          at least one socket event)
+// Outputs      : number of requests still queued, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int client_cart_bus_poll(int timeout) {
 
-		case(CART_OP_POWOFF) :
+	// Local Variables
+	int		pending = 0;
 
-			// CLIENT WRITE
+	pthread_mutex_lock(&busLock);
+	pending = poll_cart_servers(timeout);
+	pthread_mutex_unlock(&busLock);
+	return (pending);
+}
 
-			// Send network reg using network byte order conversion
-			value = htonll64(reg);
-			if (write(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError writing network data\n");
-				return(-1);
-			}
-			// Send network data's length as well
-			value = htonll64(0);
-			if (write(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError sending buf length\n");
-				return(-1);
-			}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : poll_cart_servers
+// Description  : Make progress on the queued requests with the engine locked
+//                (see client_cart_bus_poll).  One thread at a time waits on
+//                the sockets, with the engine unlocked so others can queue
+//                requests meanwhile; the rest wait for it to report progress.
+//
+// Inputs       : timeout - milliseconds to wait (0 never waits)
+// Outputs      : number of requests still queued, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int poll_cart_servers(int timeout) {
 
-			// CLIENT READ
+	// Local Variables
+	int					i = 0;
+	int					result = 0;
+	uint32_t			pending = busPending;
+	struct epoll_event	events[CART_MAX_SERVERS];
+
+	if (busPending == 0)
+		return (0);
+
+	// The thread waiting on the sockets receives for everyone (taking its responses would leave it
+	// asleep), so wait for it to report progress
+	if (busPolling == YES) {
+		if (timeout != 0)
+			pthread_cond_wait(&busProgress, &busLock);
+		return ((int)busPending);
+	}
 
-			// Read network reg using network byte order conversion
-			if (read(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-				return(-1);
-			}
-			response = ntohll64(value);
-			// Read network's data length being received
-			if (read(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-				return(-1);
-			}
-			value = ntohll64(value);
-			// Read a frame sized buffer from the network
-			if (value > 0) {
-				if (read(socket_fd, buf, CART_FRAME_SIZE) != CART_FRAME_SIZE) {
-					logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-					return(-1);
-				}
+	if (service_cart_servers() != 0)
+		result = fail_queued_requests();
+
+	// Nothing completed, so wait to be able to send or receive more
+	else if (busPending == pending && busPending != 0 && timeout != 0) {
+		for (i = 0; i < busServerCount && result == 0; i++) {
+			if (busServers[i].socket != -1 && watch_cart_server(&busServers[i]) != 0)
+				result = fail_queued_requests();
+		}
+		if (result == 0) {
+			busPolling = YES;
+			pthread_mutex_unlock(&busLock);
+			i = epoll_wait(busEpoll, events, CART_MAX_SERVERS, timeout);
+			pthread_mutex_lock(&busLock);
+			busPolling = NO;
+			if (i == -1 && errno != EINTR) {
+				logMessage(LOG_ERROR_LEVEL, "\nError waiting on the server connection\n");
+				result = fail_queued_requests();
 			}
+			else if (service_cart_servers() != 0)
+				result = fail_queued_requests();
+		}
+	}
 
-			// Power off the server connection
-			close(socket_fd);
-			socket_fd = -1;
-			logMessage(LOG_INFO_LEVEL, "Successfully powered off server");
+	pthread_cond_broadcast(&busProgress);
+	return ((result != 0) ? -1 : (int)busPending);
+}
 
-			// Return successfully
-			return (response);
-			break;	// Shouldn't need to reach here
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_cart_bus_drain
+// Description  : Wait until every queued request has been completed
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int client_cart_bus_drain(void) {
 
-		default:
-			
-			logMessage(LOG_ERROR_LEVEL, "\n No need to reach this area ? \n");
+	// Local Variables
+	int		result = 0;
 
-			// CLIENT WRITE
+	pthread_mutex_lock(&busLock);
+	result = wait_cart_requests(NULL);
+	pthread_mutex_unlock(&busLock);
+	return (result);
+}
 
-			// Send network reg using network byte order conversion
-			value = htonll64(reg);
-			if (write(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError writing network data\n");
-				return(-1);
-			}
-			// Send network data's length as well
-			value = htonll64(0);
-			if (write(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError sending buf length\n");
-				return(-1);
-			}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_cart_bus_wait
+// Description  : Wait for the requests started by client_cart_bus_start,
+//                while requests of other threads come and go
+//
+// Inputs       : remaining - the count given to client_cart_bus_start
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int client_cart_bus_wait(int *remaining) {
 
-			// CLIENT READ
+	// Local Variables
+	int		result = 0;
 
-			// Read network reg using network byte order conversion
-			if (read(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-				return(-1);
-			}
-			response = ntohll64(value);
-			// Read network's data length being received
-			if (read(socket_fd, &value, sizeof(value)) != sizeof(value)) {
-				logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-				return(-1);
-			}
-			value = ntohll64(value);
-			// Read a frame sized buffer from the network
-			if (value > 0) {
-				if (read(socket_fd, buf, CART_FRAME_SIZE) != CART_FRAME_SIZE) {
-					logMessage(LOG_ERROR_LEVEL, "\nError reading network data\n");
-					return(-1);
-				}
-			}
+	pthread_mutex_lock(&busLock);
+	result = wait_cart_requests(remaining);
+	pthread_mutex_unlock(&busLock);
+	return (result);
+}
 
-			// Return successfully
-			return (response);
-			break;	// Shouldn't need to reach here
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : wait_cart_requests
+// Description  : Progress the bus, with the engine locked, until a count of
+//                requests has completed
+//
+// Inputs       : remaining - requests still to complete, NULL for every queued request
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int wait_cart_requests(int *remaining) {
 
+	// Local Variables
+	int		pending = 0;
+
+	while ((remaining != NULL) ? (*remaining > 0) : (busPending > 0)) {
+		if ((pending = poll_cart_servers(-1)) < 0)
+			return (-1);
+		if (pending == 0 && remaining != NULL && *remaining > 0) {
+			logMessage(LOG_ERROR_LEVEL, "\nCART bus waiting for requests that were never queued\n");
+			return (-1);
+		}
 	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : store_batch_response
+// Description  : Completion callback of client_cart_bus_start, saving the
+//                response in its CartBusRequest and counting it done
+//
+// Inputs       : tag - the CartBusRequest
+//                resp - the response registers
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void store_batch_response(void *tag, CartXferRegister resp) {
+
+	// Local Variables
+	CartBusRequest	*request = (CartBusRequest *)tag;
+
+	request->resp = resp;
+	(*request->remaining)--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_cart_bus_batch
+// Description  : Send a batch of requests to the CART servers and collect the
+//                responses, so the round trip is paid once per batch rather
+//                than once per request.  The requests are queued on the bus
+//                engine behind any already queued, and the call returns when
+//                all of them have completed.
+//
+// Inputs       : reqs - the requests, each with its frame buffer for READ/WRITE
+//                count - the number of requests
+// Outputs      : 0 if every request got a response (check each resp), -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int client_cart_bus_batch(CartBusRequest *reqs, int count) {
+
+	// Local Variables
+	int		result = 0;
+	int		remaining = 0;
+
+	pthread_mutex_lock(&busLock);
+	result = start_cart_requests(reqs, count, &remaining);
+	if (wait_cart_requests(&remaining) != 0)
+		result = -1;
+	pthread_mutex_unlock(&busLock);
+
+	// Return successfully
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_cart_bus_start
+// Description  : Queue a batch of requests back to back (no other thread's
+//                requests come between them) without waiting; each response
+//                is saved in its CartBusRequest and counted off *remaining,
+//                for client_cart_bus_wait.  The requests must stay in place
+//                until then.
+//
+// Inputs       : reqs - the requests, each with its frame buffer for READ/WRITE
+//                count - the number of requests
+//                remaining - counter the requests are added to
+// Outputs      : 0 if successful, -1 if failure (the requests counted must
+//                still be waited for)
+//
+////////////////////////////////////////////////////////////////////////////////
+int client_cart_bus_start(CartBusRequest *reqs, int count, int *remaining) {
+
+	// Local Variables
+	int		result = 0;
+
+	pthread_mutex_lock(&busLock);
+	result = start_cart_requests(reqs, count, remaining);
+	pthread_mutex_unlock(&busLock);
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : start_cart_requests
+// Description  : Queue a batch of requests with the engine locked (see
+//                client_cart_bus_start)
+//
+// Inputs       : reqs, count, remaining - the batch
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int start_cart_requests(CartBusRequest *reqs, int count, int *remaining) {
+
+	// Local Variables
+	int		i = 0;
+
+	for (i = 0; i < count; i++) {
+		reqs[i].resp = (CartXferRegister)-1;
+		reqs[i].remaining = remaining;
+		(*remaining)++;
+		if (submit_cart_request(reqs[i].reg, reqs[i].buf, store_batch_response, &reqs[i]) != 0) {
+			(*remaining)--;
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_cart_bus_request
+// Description  : This the client operation that sends a request to the CART
+//                server process.   It will:
+//
+//                1) if INIT make a connection to the server
+//                2) send any request to the server, returning results
+//                3) if CLOSE, will close the connection
+//
+// Inputs       : reg - the request reqisters for the command
+//                buf - the block to be read/written from (READ/WRITE)
+// Outputs      : the response structure encoded as needed
+////////////////////////////////////////////////////////////////////////////////
+CartXferRegister client_cart_bus_request(CartXferRegister reg, void *buf) {
+
+	// Local Variables
+	CartBusRequest	request;
+
+	// A single request is a batch of one
+	request.reg = reg;
+	request.buf = buf;
+	request.resp = 0;
+	if (client_cart_bus_batch(&request, 1) != 0)
+		return (-1);
+
+	// Return successfully
+	return (request.resp);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : count_cart_response
+// Description  : Count a completed request in the bus statistics (with the
+//                engine locked)
+//
+// Inputs       : pending - the request
+//                resp - its response registers
+//                received - bytes of the response on the wire
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void count_cart_response(CartBusPending *pending, CartXferRegister resp, size_t received) {
+
+	// Local Variables
+	uint64_t		latency = client_cart_bus_clock() - pending->queued;
+	CartBusOpStats	*op = &busStats.ops[extract_opcode(pending->reg, CART_REG_KY1) % CART_OP_MAXVAL];
+
+	op->requests++;
+	if (extract_opcode(resp, CART_REG_RT1) != 0)
+		op->failures++;
+	op->bytesSent += sizeof(CartXferRegister) + pending->length;
+	op->bytesReceived += received;
+	op->latencyTotal += latency;
+	if (latency > op->latencyMax)
+		op->latencyMax = latency;
+	op->latency[cart_bus_latency_bucket(latency)]++;
+	CART_TRACE(LOG_INFO_LEVEL, "Bus request opcode %u frame %u : rt %u, %lu bytes out, %lu bytes in, %lu ns",
+			(unsigned)extract_opcode(pending->reg, CART_REG_KY1), (unsigned)extract_opcode(pending->reg, CART_REG_FM1),
+			(unsigned)extract_opcode(resp, CART_REG_RT1), (unsigned long)(sizeof(CartXferRegister) + pending->length),
+			(unsigned long)received, (unsigned long)latency);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_cart_bus_stats
+// Description  : Copy out what the bus engine has counted since the program
+//                started
+//
+// Inputs       : stats - where the statistics go
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int client_cart_bus_stats(CartBusStats *stats) {
+
+	if (stats == NULL)
+		return (-1);
+	pthread_mutex_lock(&busLock);
+	memcpy(stats, &busStats, sizeof(CartBusStats));
+	pthread_mutex_unlock(&busLock);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_cart_bus_requests
+// Description  : Count the requests the bus engine has completed, cheaply
+//                enough to be read around every operation of a benchmark
+//
+// Inputs       : none
+// Outputs      : the number of requests
+//
+////////////////////////////////////////////////////////////////////////////////
+uint64_t client_cart_bus_requests(void) {
+
+	// Local Variables
+	int			i = 0;
+	uint64_t	requests = 0;
+
+	pthread_mutex_lock(&busLock);
+	for (i = 0; i < CART_OP_MAXVAL; i++)
+		requests += busStats.ops[i].requests;
+	pthread_mutex_unlock(&busLock);
+	return (requests);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_cart_bus_clock
+// Description  : Read the monotonic clock the statistics are kept with
+//
+// Inputs       : none
+// Outputs      : the time in ns
+//
+////////////////////////////////////////////////////////////////////////////////
+uint64_t client_cart_bus_clock(void) {
+
+	// Local Variables
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_bus_latency_bucket
+// Description  : Find the histogram bucket of a latency.  Latencies under
+//                2^CART_BUS_LATENCY_SUB_BITS ns get a bucket each; above that
+//                every power of two is split in 2^CART_BUS_LATENCY_SUB_BITS
+//                buckets, so a bucket is never more than ~6% wide (HDR style)
+//
+// Inputs       : latency - the latency in ns
+// Outputs      : the bucket
+//
+////////////////////////////////////////////////////////////////////////////////
+uint32_t cart_bus_latency_bucket(uint64_t latency) {
+
+	// Local Variables
+	uint32_t	shift = 0;
+
+	if (latency >> CART_BUS_LATENCY_BITS)
+		return (CART_BUS_LATENCY_BUCKETS - 1);
+	if (latency < (1 << CART_BUS_LATENCY_SUB_BITS))
+		return ((uint32_t)latency);
+	shift = 63 - __builtin_clzll(latency) - CART_BUS_LATENCY_SUB_BITS;
+	return (((shift + 1) << CART_BUS_LATENCY_SUB_BITS) + ((latency >> shift) & ((1 << CART_BUS_LATENCY_SUB_BITS) - 1)));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_bus_latency_percentile
+// Description  : Find the latency under which a percentile of an opcode's
+//                requests completed
+//
+// Inputs       : op - the opcode's statistics
+//                percentile - the percentile (0 - 100)
+// Outputs      : the upper bound in ns of the bucket reaching the percentile,
+//                0 if no request completed
+//
+////////////////////////////////////////////////////////////////////////////////
+uint64_t cart_bus_latency_percentile(const CartBusOpStats *op, double percentile) {
+
+	// Local Variables
+	uint32_t	i = 0;
+	uint32_t	shift = 0;
+	uint64_t	seen = 0;
+	uint64_t	wanted = 0;
+	uint64_t	bound = 0;
+
+	if (op->requests == 0)
+		return (0);
+	wanted = (uint64_t)(op->requests * percentile / 100.0 + 0.5);
+	if (wanted == 0)
+		wanted = 1;
+	for (i = 0; i < CART_BUS_LATENCY_BUCKETS - 1; i++) {
+		if ((seen += op->latency[i]) >= wanted)
+			break;
+	}
+
+	// A bucket of the first row holds one latency, the others 2^shift from their lower bound
+	if (i < (1 << CART_BUS_LATENCY_SUB_BITS))
+		return (i);
+	shift = (i >> CART_BUS_LATENCY_SUB_BITS) - 1;
+	bound = ((uint64_t)((1 << CART_BUS_LATENCY_SUB_BITS) + (i & ((1 << CART_BUS_LATENCY_SUB_BITS) - 1))) << shift) +
+			((uint64_t)1 << shift) - 1;
+	return ((bound < op->latencyMax) ? bound : op->latencyMax);
 }
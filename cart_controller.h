@@ -39,7 +39,7 @@ typedef CartFrame CartCartridge[CART_CARTRIDGE_SIZE]; // A Cartridge
     16 - RT1 (Return code register 1)
  17-32 - CT1 (Cartridge register 1)
  33-48 - FM1 (Frame register 1)
- 48-63 - UNUSED
+ 48-63 - UNUSED (frame count of RDFRMS/WRFRMS, capabilities of INITMS)
 
 */
 
@@ -64,7 +64,9 @@ typedef enum {
 	CART_OP_RDFRME = 3,  // Read the cartidge frame
 	CART_OP_WRFRME = 4,  // Write to the cartridge frame
 	CART_OP_POWOFF = 5,  // Power off the memory system
-	CART_OP_MAXVAL = 6   // Maximum opcode value
+	CART_OP_RDFRMS = 6,  // Read a run of frames of the cartridge (network extension)
+	CART_OP_WRFRMS = 7,  // Write a run of frames of the cartridge (network extension)
+	CART_OP_MAXVAL = 8   // Maximum opcode value
 
 } CartOpCodes;
 
@@ -13,13 +13,17 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stddef.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 // Project Includes
 #include "cart_network.h"
 #include "cart_cache.h"
 #include "cart_driver.h"
 #include "cart_controller.h"
+#include "cart_trace.h"
 #include "cmpsc311_log.h"
 #include "cmpsc311_util.h"
 
@@ -27,13 +31,53 @@
 // Implementation
 //
 
+// Defines
+#define CART_READAHEAD_MIN  2		// frames read ahead once a file is read sequentially
+#define CART_READAHEAD_MAX  32		// largest readahead window in frames
+#define CART_READAHEAD_SLOTS 64		// read ahead frames that can be in flight on the bus
+#define CART_NO_FILE -1				// marks an empty directory bucket or the end of a chain or free list
+#define CART_DIRECTORY_BUCKETS 2048	// buckets of the filename directory (a power of two, twice the files)
+
+// Metadata store
+//   The first frames of the metadata cart hold a superblock, two checkpoint
+//   regions and a journal.  A checkpoint is the stream of records that would
+//   recreate every stored file (CREATE, then its EXTENTs, then its LENGTH);
+//   the superblock names the region holding the last one.  Changes since are
+//   appended to the journal as the same records, in frames carrying the
+//   checkpoint's generation, so a mount replays the checkpoint then the
+//   journal frames up to the first left from an earlier generation.  The
+//   free frame bitmap is not stored, it is rebuilt from the extents.
+#define CART_META_CART              0		// cart holding the metadata store
+#define CART_META_SUPERBLOCK        0		// frame of the superblock
+#define CART_META_CHECKPOINT_FRAMES 128		// frames of each checkpoint region
+#define CART_META_CHECKPOINT(r)     (1 + (r) * CART_META_CHECKPOINT_FRAMES)	// first frame of checkpoint region r
+#define CART_META_JOURNAL           CART_META_CHECKPOINT(2)	// first frame of the journal
+#define CART_META_JOURNAL_FRAMES    64		// frames of the journal
+#define CART_META_FRAMES            (CART_META_JOURNAL + CART_META_JOURNAL_FRAMES)	// frames reserved for the store
+#define CART_META_MAGIC             0x3130425354524143ULL	// "CARTSB01"
+#define CART_META_VERSION           1
+
 // Enumerations
 typedef enum Flag {
         YES    =   0,
         NO     =   1
 } Flag;
 
+// Metadata records
+typedef enum CartMetaRecords {
+        CART_META_CREATE    =   1,                              // a file is stored under a name
+        CART_META_EXTENT    =   2,                              // a run of frames is added to the end of a file
+        CART_META_LENGTH    =   3,                              // a file's length in bytes changed
+        CART_META_DELETE    =   4                               // a file and its frames are dropped
+} CartMetaRecords;
+
 // Structures
+typedef struct FileExtent{
+        CartridgeIndex      cart;                               // cartridge the run of frames is in
+        CartFrameIndex      frame;                              // first frame of the run
+        uint32_t            length;                             // number of consecutive frames in the run
+        uint32_t            start;                              // file frame number of the run's first frame
+} FileExtent;
 typedef struct FileSystem{
         char                filename[CART_MAX_PATH_LENGTH];     // current file's filename being handled
         int16_t             filehandle;                         // file handle for current file
@@ -43,8 +87,52 @@ typedef struct FileSystem{
         CartFrameIndex      frameIndex;                         // frame current file exists in
         Flag                openfile;                           // holds the state of file open or not
         Flag                incart;                             // holds state of file being in CART or not 
+        Flag                stored;                             // file is kept in the metadata store (created and not yet closed)
+        FileExtent          *extents;                           // frames holding the file, in file order
+        uint32_t            extentCount;                        // number of extents in use
+        uint32_t            extentCapacity;                     // number of extents allocated
+        uint32_t            readEnd;                            // file position the last cart_read stopped at
+        uint32_t            readAhead;                          // frames to read ahead of a sequential reader (0 = none)
+        int16_t             nextFile;                           // next file in the same directory bucket, or next free handle
 
 } FileSystem;
+typedef struct ReadAheadSlot{
+        CartridgeIndex      cart;                               // cartridge of the frame being read ahead
+        CartFrameIndex      frame;                              // frame being read ahead
+        Flag                inflight;                           // slot holds a read ahead frame not yet cached
+        Flag                done;                               // the frame's response has arrived (set by the bus)
+        Flag                reaping;                            // the frame is being cached by reap_read_ahead
+        uint32_t            length;                             // frames of the run read from this slot on (0 inside a run)
+        CartXferRegister    resp;                               // response to the frame's RDFRME/RDFRMS
+} ReadAheadSlot;
+typedef struct IovCursor{
+        const struct iovec  *iov;                               // buffer being copied to or from
+        int                 left;                               // buffers left, that one included
+        size_t              offset;                             // bytes of that buffer already copied
+} IovCursor;
+typedef struct CartSuperblock{
+        uint64_t            magic;                              // CART_META_MAGIC
+        uint32_t            version;                            // CART_META_VERSION
+        uint32_t            region;                             // checkpoint region holding the last checkpoint
+        uint64_t            generation;                         // checkpoints written since the store was formatted
+        uint32_t            checkpointBytes;                    // length of the checkpoint's record stream
+        uint32_t            checkpointSum;                      // checksum of the checkpoint's record stream
+        uint32_t            checksum;                           // checksum of the fields above
+} CartSuperblock;
+typedef struct CartJournalHeader{
+        uint64_t            generation;                         // generation of the checkpoint the frame follows
+        uint32_t            sequence;                           // position of the frame in the journal
+        uint32_t            bytes;                              // bytes of records following the header
+        uint32_t            checksum;                           // checksum of the frame's header (this field zero) and records
+} CartJournalHeader;
+typedef struct CartMetaRecord{
+        uint8_t             type;                               // one of CartMetaRecords
+        uint8_t             size;                               // CREATE: bytes of filename following the record
+        uint16_t            slot;                               // file handle of the file
+        uint16_t            cart;                               // EXTENT: cartridge of the run
+        uint16_t            frame;                              // EXTENT: first frame of the run
+        uint32_t            length;                             // EXTENT: frames in the run, LENGTH: bytes in the file
+} CartMetaRecord;
 typedef struct FileTable{
         int16_t             filehandle;                         // file handle for current file
         Flag                isused;                             // holds the state of the current frame location used in CART memory or not       
@@ -53,20 +141,98 @@ typedef struct FileTable{
 // Global Structures
 FileSystem      *fileSystem = NULL;										// holds each file's state in the CART memory
 FileTable       fileTable[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE];    // file allocation table sized 64 x 1024
-
+uint64_t        frameBitmap[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE / 64];	// free frames of each cart, one bit per frame (1 = free)
+uint16_t        cartFreeFrames[CART_MAX_CARTRIDGES];						// number of free frames in each cart
+Flag            cartZeroed[CART_MAX_CARTRIDGES];							// the cart has been zeroed since poweron
+ReadAheadSlot   readAheadSlots[CART_READAHEAD_SLOTS];					// frames read ahead in the background
+CartFrame       readAheadData[CART_READAHEAD_SLOTS];					// the frame of each slot, so a run of slots takes a run of frames
+
+
+// Locks
+//   Callers may use different files at once.  A file operation holds the file
+//   set shared and its file's lock; opening or closing a file holds the set
+//   exclusively (with the filename directory and free handles).
+//   The allocator lock covers the free frame bitmap and file table, the cart
+//   lock covers the loaded cart and read ahead slots and is held while the
+//   requests acting on a cart are queued (never while waiting for them, and
+//   never while calling into the cache, which may write back through it).
+pthread_rwlock_t	fileSystemLock = PTHREAD_RWLOCK_INITIALIZER;	// the fileSystem array and numFiles
+pthread_mutex_t		fileLocks[CART_MAX_TOTAL_FILES];				// each file's state and extent map
+pthread_mutex_t		allocLock = PTHREAD_MUTEX_INITIALIZER;			// free frames and the file table
+pthread_mutex_t		cartLock = PTHREAD_MUTEX_INITIALIZER;			// loaded cart and read ahead slots
+pthread_mutex_t		journalLock = PTHREAD_MUTEX_INITIALIZER;		// the journal, and changes to stored files' extents and lengths
 
 // Global Variables
-int		numFiles = 0;
+int		numFiles = 0;			// file handles handed out so far (in use or on the free list)
+int		fileCapacity = 0;		// file handles the fileSystem array has room for
+int16_t	fileDirectory[CART_DIRECTORY_BUCKETS];	// stored files by hash of their filename
+int16_t	freeFileHead = CART_NO_FILE;	// file handles free for reuse
+uint32_t	freeFrames = 0;		// number of free frames in all of CART memory
+CartridgeIndex	loadedCart = CART_NO_CARTRIDGE;	// cartridge last loaded in the controller (by the requests queued)
+Flag	readAheadFailed = NO;	// a read ahead request failed, so frames read after it can't be trusted (set by the bus)
 Flag	cacheInit;
 //int		DEBUG = 0;
+CartPoweronModes	poweronMode = CART_POWERON_FORMAT;	// whether cart_poweron formats or mounts the store
+uint64_t	metaGeneration = 0;		// generation of the last checkpoint
+uint32_t	metaRegion = 0;			// checkpoint region holding it
+char		journalFrame[CART_FRAME_SIZE];	// journal frame being filled, header first
+uint32_t	journalSequence = 0;	// position of that frame in the journal
+uint32_t	journalBytes = 0;		// bytes of the frame in use (header included)
+uint32_t	journalLast = 0;		// offset of the frame's last record (0 = none yet)
+Flag		journalDirty = NO;		// the frame has records not written to the cart
+CartDriverStats	driverStats;		// what the driver has counted (I/O counters atomic, allocator ones under allocLock)
 
 
 // My Project Functions
-int		load_this_cart(CartridgeIndex cart);
-int		check_table_space(int16_t fd, int32_t count);
-void *	get_file_pieces(int16_t fd);
-int		get_num_pieces(int16_t fd);
+int16_t	open_cart_file(char *path);
+int16_t	close_cart_file(int16_t fd);
+int32_t	read_cart_file(int16_t fd, uint32_t position, const struct iovec *iov, int iovcnt, int32_t count);
+int32_t	write_cart_file(int16_t fd, uint32_t position, const struct iovec *iov, int iovcnt, int32_t count);
+int32_t	count_iov_bytes(const struct iovec *iov, int iovcnt);
+void	scatter_iov_bytes(IovCursor *cursor, const char *src, int length);
+void	gather_iov_bytes(IovCursor *cursor, char *dst, int length);
+void	count_file_io(Flag writing, int32_t bytes, uint64_t started);
+int		lock_cart_file(int16_t fd);
+void	unlock_cart_file(int16_t fd);
+CartXferRegister	request_cart_frames(CartridgeIndex cart, CartXferRegister reg, void *buf);
+int		zero_this_cart(CartridgeIndex cart);
+void	reset_file_table(void);
+int		write_this_frame(CartridgeIndex cart, CartFrameIndex frame, void *buf);
+int		write_frame_run(CartridgeIndex cart, CartFrameIndex frame, uint32_t count, void *buf);
+int		check_table_space(int16_t fd, uint32_t position, int32_t count);
+int		append_file_extent(int16_t fd, CartridgeIndex cart, CartFrameIndex frame);
+int		find_file_frame(int16_t fd, uint32_t piece, CartridgeIndex *cart, CartFrameIndex *frame);
+uint32_t	get_file_frames(int16_t fd);
+void	release_file_extents(int16_t fd);
+uint32_t	alloc_frame_run(uint32_t wanted, CartridgeIndex *cart, CartFrameIndex *frame);
+void	free_frame_run(CartridgeIndex cart, CartFrameIndex frame, uint32_t length);
+int		read_file_frames(int16_t fd, uint32_t piece, void *buf);
+int		start_read_ahead(int16_t fd, uint32_t piece);
+int		reap_read_ahead(Flag wait);
+int		find_read_ahead(CartridgeIndex cart, CartFrameIndex frame);
+void	complete_read_ahead(void *tag, CartXferRegister resp);
 int     allocateNewFile(void);			// allocates one new file into the file system heap memory
+uint32_t	hash_file_name(const char *path);
+int16_t	find_file_name(const char *path);
+void	insert_file_name(int16_t fd);
+void	remove_file_name(int16_t fd);
+int16_t	take_free_file(void);
+void	rebuild_file_directory(void);
+uint32_t	meta_checksum(const void *data, size_t size);
+void	reserve_meta_frames(void);
+int		format_meta_store(void);
+int		mount_meta_store(void);
+int		read_meta_frames(CartFrameIndex first, uint32_t frames, char *buf);
+int		replay_meta_records(const char *records, uint32_t bytes);
+int		apply_meta_record(CartMetaRecord *record, const char *name);
+int		pack_meta_record(char *buf, uint32_t *used, uint32_t size, CartMetaRecord *record, const char *name);
+int		checkpoint_meta_store(void);
+int		log_meta_record(CartMetaRecord *record, const char *name);
+int		commit_meta_journal(void);
+int		journal_file_create(int16_t fd);
+int		journal_file_extent(int16_t fd, CartridgeIndex cart, CartFrameIndex frame);
+int		journal_file_length(int16_t fd, uint32_t length);
+int		journal_file_delete(int16_t fd);
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -137,10 +303,31 @@ uint64_t extract_cart_opcode(CartXferRegister resp, CartRegisters reg_field) {
         return (reg_seg);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_poweron_mode
+// Description  : Choose whether cart_poweron starts an empty store or mounts
+//                the one left in CART memory by an earlier run
+//
+// Inputs       : mode - CART_POWERON_FORMAT or CART_POWERON_MOUNT
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int32_t set_cart_poweron_mode(CartPoweronModes mode) {
+
+	if (mode != CART_POWERON_FORMAT && mode != CART_POWERON_MOUNT) {
+		logMessage(LOG_ERROR_LEVEL, "\nIllegal poweron mode requested: %d \n", mode);
+		return (-1);
+	}
+	poweronMode = mode;
+	return (0);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : cart_poweron
-// Description  : Startup up the CART interface, initialize filesystem
+// Description  : Startup up the CART interface, initialize filesystem (empty,
+//                or from the metadata store when mounting)
 //
 // Inputs       : none
 // Outputs      : 0 if successful, -1 if failure
@@ -150,12 +337,14 @@ int32_t cart_poweron(void) {
 
         // Local Variables
         int                 cacheResp = 0;
-		int                 i = 0, j = 0;
+		int                 i = 0;
+        int                 mountResp = 1;
         CartXferRegister    resp = 0;
 
 // POWERON CACHE
 
-        // Initialize the Cache system
+        // Initialize the Cache system (dirty frames in write-back mode are written with write_this_frame)
+        set_cart_cache_writer(write_this_frame);
         cacheResp = init_cart_cache();
 		
 		// Checks
@@ -181,21 +370,41 @@ int32_t cart_poweron(void) {
             fileSystem[i].filelength    =    0;          // Initialize default file size to zero     
             fileSystem[i].openfile      =   NO;          // Initalize all files to not open status
             fileSystem[i].incart        =   NO;          // Initialze all files to not incast status
+            fileSystem[i].stored        =   NO;          // Initialize all files to not stored
 	        fileSystem[i].cartIndex     =    0;          // Initialize default cartridge the file exists in to 0
 	        fileSystem[i].frameIndex    =    0;          // Initialize default frame the file exists in to 0
+	        fileSystem[i].extents       = NULL;          // Initialize the file to hold no frames
+	        fileSystem[i].extentCount   =    0;
+	        fileSystem[i].extentCapacity =   0;
         }
+        fileCapacity = numFiles;
+
+        // No file is named yet, so every handle is free
+        rebuild_file_directory();
 
         // Setup file table's data structure to keep track of open files inside CART memory 
+        reset_file_table();
         for(i = 0; i < CART_MAX_CARTRIDGES; i++){  
-            for(j = 0; j < CART_CARTRIDGE_SIZE; j++){
-                fileTable[i][j].filehandle  =   -1;      // Unused/invalid file handles will be negative numbers
-                fileTable[i][j].isused      =   NO;      // Initialize all table slots in CART memory to not used
-            }
+            cartFreeFrames[i] = CART_CARTRIDGE_SIZE;     // Every frame of every cart starts out free
+            cartZeroed[i] = NO;                          // Carts are zeroed when first allocated from
         } 
+        memset(frameBitmap, 0xff, sizeof(frameBitmap));
+        freeFrames = CART_MAX_CARTRIDGES * CART_CARTRIDGE_SIZE;
+
+        // Nothing is being read ahead yet
+        for(i = 0; i < CART_READAHEAD_SLOTS; i++){
+            readAheadSlots[i].inflight = NO;
+            readAheadSlots[i].reaping = NO;
+        }
+        for(i = 0; i < CART_MAX_TOTAL_FILES; i++){
+            pthread_mutex_init(&fileLocks[i], NULL);
+        }
+        readAheadFailed = NO;
 
 // POWERON CART SYSTEM
 
         // Initialize the memory system
+        loadedCart = CART_NO_CARTRIDGE;
         resp =  client_cart_bus_request(create_cart_opcode(CART_OP_INITMS, 0, 0, 0, 0, 0), NULL);
 
         // Check return register
@@ -204,28 +413,20 @@ int32_t cart_poweron(void) {
             return (-1);
         }
 
-        // BZERO out the cartridges
-        for(i = 0; i < CART_MAX_CARTRIDGES; i++){      
-            // Load each cartridge in the CART system
-            resp = client_cart_bus_request(create_cart_opcode(CART_OP_LDCART, 0, 0, (i), 0, 0), NULL);
-            // Check return register
-            if(extract_cart_opcode(resp, CART_REG_RT1) != 0){
-                logMessage(LOG_ERROR_LEVEL, "\nError loading cartridge: %u \n", i);
-                return (-1);
-            }
-            // Zero out each cartridge
-            resp = client_cart_bus_request(create_cart_opcode(CART_OP_BZERO, 0, 0, 0, 0, 0), NULL);
-            // Check return register
-            if(extract_cart_opcode(resp, CART_REG_RT1) != 0) {
-                logMessage(LOG_ERROR_LEVEL,"\nError zeroing catridge: %u \n", i);
-                return (-1);
-            }
+        // Mount the store left by an earlier run, or start an empty one
+        if(poweronMode == CART_POWERON_MOUNT){
+            mountResp = mount_meta_store();
+        }
+        if(mountResp < 0 || (mountResp == 1 && format_meta_store() != 0)){
+            logMessage(LOG_ERROR_LEVEL,"\nError %s the metadata store in cart_poweron\n", (mountResp < 0) ? "mounting" : "formatting");
+            return (-1);
         }
 
 // POWERON COMPLETED
 
         // Return successfully
-        logMessage(LOG_INFO_LEVEL,"\nCompleted cart_poweron: initialized memory system, cache system, and zeroed out cartridges.\n");
+        logMessage(LOG_INFO_LEVEL,"\nCompleted cart_poweron: initialized memory system and cache system, %s the metadata store.\n",
+            (mountResp == 0) ? "mounted" : "formatted");
         return(0);
 
 }
@@ -243,10 +444,20 @@ int32_t cart_poweroff(void) {
 
 	// Local Variables
 	int                 cacheResp = 0;
-	int                 i = 0, j = 0;
+	int                 i = 0;
 	CartXferRegister    resp = 0;
 
-	// Shut down the cache system
+	// Write back any dirty frames while CART memory is still powered, then shut down the cache system
+	if (reap_read_ahead(YES) != 0 || flush_cart_cache() < 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nError flushing the Cache system in cart_poweroff\n");
+		return (-1);
+	}
+
+	// Checkpoint the files still open, so a later poweron can mount them
+	if (checkpoint_meta_store() != 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nError checkpointing the metadata store in cart_poweroff\n");
+		return (-1);
+	}
 	cacheResp = close_cart_cache();
 
 	// Check cache system shut down as intended
@@ -263,20 +474,21 @@ int32_t cart_poweroff(void) {
 		fileSystem[i].filelength = 0;          // Initialize default file size to zero     
 		fileSystem[i].openfile = NO;          // Initalize all files to not open status
 		fileSystem[i].incart = NO;          // Initialze all files to not incast status
+		fileSystem[i].stored = NO;          // Initialize all files to not stored
 		fileSystem[i].cartIndex = 0;          // Initialize default cartridge the file exists in to 0
 		fileSystem[i].frameIndex = 0;          // Initialize default frame the file exists in to 0
+		free(fileSystem[i].extents);          // Free the file's extent map
+		fileSystem[i].extents = NULL;
+		fileSystem[i].extentCount = 0;
+		fileSystem[i].extentCapacity = 0;
 	}
 
 	// Zero out file table's data structure for good practice
-	for (i = 0; i < CART_MAX_CARTRIDGES; i++) {
-		for (j = 0; j < CART_CARTRIDGE_SIZE; j++) {
-			fileTable[i][j].filehandle = -1;      // Unused/invalid file handles will be negative numbers
-			fileTable[i][j].isused = NO;      // Initialize all table slots in CART memory to not used
-		}
-	}
+	reset_file_table();
 
 	// Execute the CART shutdown opcode
 	resp = client_cart_bus_request(create_cart_opcode(CART_OP_POWOFF, 0, 0, 0, 0, 0), NULL);
+	loadedCart = CART_NO_CARTRIDGE;
 
 	// Check return register
 	if (extract_cart_opcode(resp, CART_REG_RT1) != 0) {
@@ -302,8 +514,27 @@ int32_t cart_poweroff(void) {
 int16_t cart_open(char *path) {
 
 	// Local Variables
-	int         allocResp = 0;
-	int         i = 0;
+	int16_t		filehandle = -1;
+
+	pthread_rwlock_wrlock(&fileSystemLock);
+	filehandle = open_cart_file(path);
+	pthread_rwlock_unlock(&fileSystemLock);
+	return (filehandle);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : open_cart_file
+// Description  : Open the file with the file set locked (see cart_open)
+//
+// Inputs       : path - filename of the file to open
+// Outputs      : file handle if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int16_t open_cart_file(char *path) {
+
+	// Local Variables
+	int16_t     i = 0;
 	int16_t     filehandle = -1;	// set filehandle to invalid case, in case of error
 	int			path_length = 0;
 
@@ -315,42 +546,41 @@ int16_t cart_open(char *path) {
 	
 	path_length = strlen(path) + 1;
 
-	check_file_system:
-	// Iterate through the number of files open in the file system; first cart_open will only have one file
-	for (i = 0; i < numFiles; i++) {
-		// Error: path is found to be same of an existing filename in the fileSystem struct
-		if (strncmp(path, fileSystem[i].filename, path_length) == 0) {
-			logMessage(LOG_ERROR_LEVEL, "\n filename: \t %c \t is already in the filesystem \n filehandle: \t %u \n", fileSystem[i].filename, fileSystem[i].filehandle);
+	// A file of that name is refused if open, reopened with its contents if mounted from the store
+	if ((i = find_file_name(path)) != CART_NO_FILE) {
+		if (fileSystem[i].openfile == YES) {
+			logMessage(LOG_ERROR_LEVEL, "\n filename: \t %s \t is already in the filesystem \n filehandle: \t %u \n", fileSystem[i].filename, fileSystem[i].filehandle);
 			return (-1);
 		}
-
-		// Empty slot reached in fileSystem
-		if (fileSystem[i].openfile == NO) {
-			strncpy(fileSystem[i].filename, path, path_length);    // copy path/filename into corresponding struct member
-			fileSystem[i].filehandle = i;          // set new file handle to index for uniqueness
-			fileSystem[i].fileposition = 0;          // set new file position to 0
-			fileSystem[i].filelength = 0;          // set new file size to 0        
-			fileSystem[i].openfile = YES;          // set file open flag to yes
-			fileSystem[i].cartIndex = 0;          // set default first cartridge to 0
-			fileSystem[i].frameIndex = 0;          // set default first frame to 0           
-			filehandle = i;          // set the filehandle to be returned to the index
-
-			return (filehandle);    // Return the new file's filehandle
-		}
+		fileSystem[i].filehandle = i;
+		fileSystem[i].fileposition = 0;
+		fileSystem[i].openfile = YES;
+		fileSystem[i].readEnd = 0;
+		fileSystem[i].readAhead = 0;
+		return (i);
 	}
-	// Allocate a new file if code reaches this statement
-	allocResp = allocateNewFile();
-		
-	// Check allocation response to ensure new file added to file system's data structure
-	if (allocResp != 0) {
+
+	// Take a free handle, growing the file system when there is none
+	if ((i = take_free_file()) == CART_NO_FILE) {
 		logMessage(LOG_ERROR_LEVEL, "\nUnable to allocate new file in file system heap memory in cart_open\n");
 		return (-1);
 	}
-
-	goto check_file_system;
-
-	// Return unique file handle for subsequent operations
-	return (filehandle);
+	strncpy(fileSystem[i].filename, path, path_length);    // copy path/filename into corresponding struct member
+	fileSystem[i].filehandle = i;          // set new file handle to index for uniqueness
+	fileSystem[i].fileposition = 0;          // set new file position to 0
+	fileSystem[i].filelength = 0;          // set new file size to 0        
+	fileSystem[i].openfile = YES;          // set file open flag to yes
+	fileSystem[i].cartIndex = 0;          // set default first cartridge to 0
+	fileSystem[i].frameIndex = 0;          // set default first frame to 0           
+	fileSystem[i].readEnd = 0;          // no reads yet, so no readahead
+	fileSystem[i].readAhead = 0;
+	fileSystem[i].stored = YES;          // the file is kept in the store until closed
+	insert_file_name(i);
+	filehandle = i;          // set the filehandle to be returned to the index
+
+	if (journal_file_create(filehandle) != 0)
+		return (-1);
+	return (filehandle);    // Return the new file's filehandle
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -364,8 +594,40 @@ int16_t cart_open(char *path) {
 ////////////////////////////////////////////////////////////////////////////////
 int16_t cart_close(int16_t fd) {
 
+	// Local Variables
+	int16_t		result = -1;
+
+	// Closing changes the directory and free handles, so no other file operation runs meanwhile
+	pthread_rwlock_wrlock(&fileSystemLock);
+	if (fd < 0 || fd >= numFiles) {
+		logMessage(LOG_ERROR_LEVEL, "\nBad file handle %d passed to the CART driver\n", fd);
+	} else {
+		result = close_cart_file(fd);
+	}
+	pthread_rwlock_unlock(&fileSystemLock);
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : close_cart_file
+// Description  : Close the file with the file set locked (see cart_close)
+//
+// Inputs       : fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int16_t close_cart_file(int16_t fd) {
+
         // Close the file and zero out struct's data members
         if(fileSystem[fd].filehandle >= (int16_t) (0) && fileSystem[fd].openfile == YES){
+            if(journal_file_delete(fd) != 0){                   // the file's contents are dropped with it, so free its frames
+                return (-1);
+            }
+            remove_file_name(fd);                               // drop it from the directory, and free its handle
+            fileSystem[fd].nextFile         = freeFileHead;
+            freeFileHead                    =    fd;
+            fileSystem[fd].incart           =    NO;              // reset file to not in CART memory
             *(fileSystem[fd].filename)      =  '\0';              // reset the filename pointer back to null terminator
             fileSystem[fd].filehandle       =    -1;              // reset filehandle to negative value to indicate unused/invalid
             fileSystem[fd].fileposition     =     0;              // reset file position to zero bytes
@@ -373,6 +635,8 @@ int16_t cart_close(int16_t fd) {
             fileSystem[fd].openfile         =    NO;              // reset file open flag to closed
             fileSystem[fd].cartIndex        =     0;              // reset cartridge location to 0
             fileSystem[fd].frameIndex       =     0;              // reset frame location to 0
+            fileSystem[fd].readEnd          =     0;              // reset the sequential read state
+            fileSystem[fd].readAhead        =     0;
         }
         // Failed to close file, error condition met
         else{
@@ -398,26 +662,56 @@ int16_t cart_close(int16_t fd) {
 ////////////////////////////////////////////////////////////////////////////////
 int32_t cart_read(int16_t fd, void *buf, int32_t count) {
 
+	// Local Variables
+	int32_t		result = -1;
+	uint64_t	started = 0;
+	struct iovec	vec;
+
+	vec.iov_base = buf;
+	vec.iov_len = (count < 0) ? 0 : count;
+	started = client_cart_bus_clock();
+	if (lock_cart_file(fd) != 0)
+		return (-1);
+	result = read_cart_file(fd, fileSystem[fd].fileposition, &vec, 1, count);
+	if (result > 0)
+		fileSystem[fd].fileposition += result;
+	unlock_cart_file(fd);
+	count_file_io(NO, result, started);
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_cart_file
+// Description  : Read from the file with it locked into a list of buffers
+//                (see cart_read and cart_preadv); the file position is left
+//                for the caller to move
+//
+// Inputs       : fd - filename of the file to read from
+//                position - file position to read from
+//                iov - the buffers to read into, filled in order
+//                iovcnt - number of buffers
+//                count - number of bytes to read (at most the buffers hold)
+// Outputs      : bytes read if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int32_t read_cart_file(int16_t fd, uint32_t position, const struct iovec *iov, int iovcnt, int32_t count) {
+
         // Local Variables
 		int					i = 0;	
-        int                 return_count = 0;		// returns a legal number of bytes read from file
-        int                 length      = 0;		// holds the length of extracted frames
-		int					file_occurrences = 0;	// holds the number frames the file exists in CART
-		int					file_frames = 0;		// counter to help loop through frames remaining
-        int                 iteration   = 0;		// counter to keep track of the loop iteration
+        int                 length      = 0;		// bytes copied out of the current frame
+        int                 offset      = 0;		// offset of the read position within the current frame
+        int                 copied      = 0;		// bytes copied into the buffers so far
+        uint32_t            piece       = 0;		// index of the file frame holding position
+        uint32_t            window      = 0;		// readahead window for this read in frames
 
-		char				*cache_buffer = NULL;
+		char				*cache_buffer = NULL;	// pinned cached copy of the current frame
         char                cart_buffer[CART_FRAME_SIZE];	// holds one frame extracted from the CART memory
-        char                local_file_buffer[fileSystem[fd].filelength];	// holds local copy of file referenced by fd
-
-        CartXferRegister    resp = 0;	// response instance when interacting with CART system
-        CartridgeIndex      the_cart    = fileSystem[fd].cartIndex;	/// might be able to use tempFile
-        CartFrameIndex      the_frame   = fileSystem[fd].frameIndex;/// might be able to use tempFile
 
-        Flag                ret_count;	// tracks legal return number of bytes
+        CartridgeIndex      the_cart    = 0;
+        CartFrameIndex      the_frame   = 0;
 
-		FileSystem			*tempFile = NULL;	// temporary/local copy of a data structure instance
-		Flag				goodFile = NO;
+		IovCursor			cursor;					// next byte of the buffers to fill
 
         // Check illegal bounds for 'count' bytes
         if(count < 0){
@@ -429,120 +723,75 @@ int32_t cart_read(int16_t fd, void *buf, int32_t count) {
             logMessage(LOG_ERROR_LEVEL, "\nFile is not opened or valid in fileSystem : occurence in CART_READ\n");
             return (-1);
         }
-		// Search file system to ensure we have a legal file
-		for (i = 0; i < numFiles; i++) {
-			if (fileSystem[fd].filehandle == fd)
-				goodFile = YES;
-		}
-		if (goodFile != YES)
-			return (-1);
-
-		// Find number of frames the file exists in CART memory
-		file_occurrences = get_num_pieces(fd);
-
-		// Find all frames the file exists in CART memory
-		tempFile = get_file_pieces(fd);	
-		if (tempFile == NULL)
-			return(-1);
-
-		// Set the initial cart and load it
-		the_cart = tempFile[0].cartIndex;
-		load_this_cart(the_cart);
-
-		// Set the initial frame the file exists in
-		the_frame = tempFile[0].frameIndex;
 
-		// Set the file frame occurrences counter
-		iteration = 0;
-		file_frames = file_occurrences;
-
-	read_file_frame:
-		// Read the file from a memory system (CACHE or CART) frame by frame into a local file buffer
-		while (file_frames > 0) {
-
-			// Always try get_cart_cache first to see if frame exists in cache
-			cache_buffer = (char *)get_cart_cache(the_cart, the_frame);
-
-			// File frame exists in cache ==> Read from CACHE memory
-			if (cache_buffer != NULL) {
-				logMessage(LOG_INFO_LEVEL, "\nFrame found in cache -- Using cache copy instead of CART memory\n");
+        // Requesting more than the file holds from the referenced position only returns up to EOF
+        if(position >= fileSystem[fd].filelength)
+            return ((count == 0 && position == fileSystem[fd].filelength) ? 0 : -1);
+        if(count > (fileSystem[fd].filelength - position))
+            count = fileSystem[fd].filelength - position;
+		if (count == 0)
+			return (0);
+
+		// A read picking up where the last one stopped is sequential, so widen the readahead
+		// window (kept well inside the cache so read ahead frames survive until they're used)
+		if (position == fileSystem[fd].readEnd) {
+			window = (fileSystem[fd].readAhead == 0) ? CART_READAHEAD_MIN : fileSystem[fd].readAhead * 2;
+			if (window > CART_READAHEAD_MAX)
+				window = CART_READAHEAD_MAX;
+			if (window > get_cart_cache_size() / 4)
+				window = get_cart_cache_size() / 4;
+			fileSystem[fd].readAhead = window;
+		}
+		else
+			fileSystem[fd].readAhead = 0;
 
-				// Update the file frame's length
-				length = strlen(cache_buffer);
+		// Cache whatever has been read ahead since the last call
+		if (reap_read_ahead(NO) != 0)
+			return (-1);
 
-				// Copy the pulled cache file frame into the local file buffer
-				memcpy(&local_file_buffer[iteration * CART_FRAME_SIZE], cache_buffer, length);
+		// Copy the requested range frame by frame straight into the buffers, using the cache (CACHE or CART)
+		cursor.iov = iov;
+		cursor.left = iovcnt;
+		cursor.offset = 0;
+		while (copied < count) {
+
+			// Find the frame holding the position and how much of it is wanted
+			piece		= position / CART_FRAME_SIZE;
+			offset		= position % CART_FRAME_SIZE;
+			length		= CART_FRAME_SIZE - offset;
+			if (length > count - copied)
+				length = count - copied;
+			if (find_file_frame(fd, piece, &the_cart, &the_frame) != 0)
+				return (-1);
 
-				// Update the counters
-				file_frames--;
-				iteration++;
+			// File frame is being read ahead ==> wait for it to reach the cache
+			pthread_mutex_lock(&cartLock);
+			i = find_read_ahead(the_cart, the_frame);
+			pthread_mutex_unlock(&cartLock);
+			if (i != -1 && reap_read_ahead(YES) != 0)
+				return (-1);
 
-				// Return to before while loop to continue reading file if necessary
-				goto read_file_frame;
+			// File frame exists in cache ==> copy from the pinned CACHE frame
+			if ((cache_buffer = (char *)pin_cart_cache(the_cart, the_frame)) != NULL) {
+				scatter_iov_bytes(&cursor, &cache_buffer[offset], length);
+				unpin_cart_cache(the_cart, the_frame);
 			}
-			// File Frame is not in cache ==> Read from CART memory
+			// File Frame is not in cache ==> Read from CART memory and keep it cached
 			else {
-				logMessage(LOG_INFO_LEVEL, "\nFrame not in cache -- continuing to read from CART memory\n");
-
-				// Load the cartridge the next file frame piece exists in
-				if (the_cart != tempFile[iteration].cartIndex) {
-					the_cart = tempFile[iteration].cartIndex;	// update cartridge to latest read position
-					load_this_cart(the_cart);
-				}
-
-				// Read the next frame piece the file exists into local cart buffer
-				the_frame = tempFile[iteration].frameIndex;		// update frame to latest read position
-
-				resp = client_cart_bus_request(create_cart_opcode(CART_OP_RDFRME, 0, 0, 0, the_frame, 0), cart_buffer);
-				// Check return register
-				if (extract_cart_opcode(resp, CART_REG_RT1) != 0) {
-					logMessage(LOG_ERROR_LEVEL, "\nCartridge reading failed in CART_READ\n");
+				// Read it (and the frames a sequential reader wants next) into the cache in one batch
+				if (read_file_frames(fd, piece, cart_buffer) != 0)
 					return (-1);
-				}
-
-				// Update the new file frames's length
-				length = strlen((char *)cart_buffer);
-
-				// Copy the pulled file frame from the CART into local file buffer
-				memcpy(&local_file_buffer[iteration * CART_FRAME_SIZE], cart_buffer, length);
-
-				// Update the counters
-				file_frames--;
-				iteration++;
-
-				// Return to before while loop to continue reading file if necessary
-				goto read_file_frame;
+				scatter_iov_bytes(&cursor, &cart_buffer[offset], length);
 			}
 
+			// Update the counters
+			copied		+= length;
+			position	+= length;
 		}
 
-		// Done reading from memory systems; free heap data
-		free(tempFile);
-		tempFile = NULL;
-
-        // Setup return_count in case count bytes requests more than available
-        return_count = fileSystem[fd].filelength - fileSystem[fd].fileposition;
-
-        // Requesting 'count' bytes will be obtainable from file, file size will remain the same
-        if(count <= (fileSystem[fd].filelength - fileSystem[fd].fileposition)){   
-            memcpy(buf, &local_file_buffer[fileSystem[fd].fileposition], count);           // Copy the file read from the CART into the buf pointer for 'count' bytes   
-            fileSystem[fd].fileposition += count;                                          // Update the fileposition to end of 'count' bytes just read
-            ret_count = YES;
-        }
-        // Requesting 'count' bytes is more than file allows from referenced position, only return to EOF
-        else{
-			if (fileSystem[fd].filelength - fileSystem[fd].fileposition == 0)
-				return (-1);
-            memcpy(buf, &local_file_buffer[fileSystem[fd].fileposition], return_count);    // Copy the file read from the CART into the buf pointer up to the EOF 
-            fileSystem[fd].fileposition = fileSystem[fd].filelength;                       // Update the fileposition to EOF
-            ret_count = NO;
-        }        
-
-        // Returns
-        if(ret_count == YES)
-            return (count);             // return count bytes for normal occurrence
-        else
-            return (return_count);      // Return number of bytes from fileposition to EOF
+        // Remember where the read stopped, so the next one can be told sequential
+        fileSystem[fd].readEnd = position;
+        return (copied);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -559,27 +808,64 @@ int32_t cart_read(int16_t fd, void *buf, int32_t count) {
 ////////////////////////////////////////////////////////////////////////////////
 int32_t cart_write(int16_t fd, void *buf, int32_t count) {
 
+	// Local Variables
+	int32_t		result = -1;
+	uint64_t	started = 0;
+	struct iovec	vec;
+
+	vec.iov_base = buf;
+	vec.iov_len = (count < 0) ? 0 : count;
+	started = client_cart_bus_clock();
+	if (lock_cart_file(fd) != 0)
+		return (-1);
+	result = write_cart_file(fd, fileSystem[fd].fileposition, &vec, 1, count);
+	if (result > 0)
+		fileSystem[fd].fileposition += result;
+	unlock_cart_file(fd);
+	count_file_io(YES, result, started);
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_cart_file
+// Description  : Write to the file with it locked from a list of buffers
+//                (see cart_write and cart_pwritev); the file position is
+//                left for the caller to move
+//
+// Inputs       : fd - filename of the file to write to
+//                position - file position to write at (at most the length)
+//                iov - the buffers to write from, taken in order
+//                iovcnt - number of buffers
+//                count - number of bytes to write (what the buffers hold)
+// Outputs      : bytes written if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int32_t write_cart_file(int16_t fd, uint32_t position, const struct iovec *iov, int iovcnt, int32_t count) {
+
         // Local Variables
-        int                 i = 0, j = 0;		// loop counters 
-        int                 counter     = 0;	// tracks the number of bytes left to be written
-        int                 iteration   = 0;	// updates the file properties based on write order
-        int                 the_count = count;
-		int					buf_size = 0;		// determines size of buffer for estimated local file buffer
+        int                 length      = 0;	// bytes written into the current frame
+        int                 offset      = 0;	// offset of the write position within the current frame
+        int                 copied      = 0;	// bytes of the buffers written so far
+        uint32_t            piece       = 0;	// index of the file frame holding position
 
-        char                cart_buffer[CART_FRAME_SIZE] = 
-                            { [0 ... CART_FRAME_SIZE - 1] = '\0'};                      // holds a frame that will be written into CART memory
-		char				*local_file_buffer = NULL;									// holds the entire file pulled from CART memory
+        char                cart_buffer[CART_FRAME_SIZE];								// holds a frame that will be written into CART memory
+		char				*cache_buffer = NULL;										// cached copy of a frame of the file
 
         CartXferRegister    resp = 0;													// CART response for checking
-        CartridgeIndex      the_cart = fileSystem[fd].cartIndex;                        // uppdated in new file write to first location available
-        CartFrameIndex      the_frame = fileSystem[fd].frameIndex;                      // uppdated in new file write to first location available
+        CartridgeIndex      the_cart = 0;
+        CartFrameIndex      the_frame = 0;
+		CartridgeIndex		run_cart = 0;												// cart of the contiguous run of frames being filled
+		CartFrameIndex		run_frame = 0;												// next frame of that run
+		uint32_t			run_left = 0;												// frames of the run not yet used
+		char				write_buffer[CART_MAX_RUN_FRAMES * CART_FRAME_SIZE];		// consecutive frames waiting to be written through
+		CartridgeIndex		write_cart = 0;												// cart of the frames waiting to be written
+		CartFrameIndex		write_frame = 0;											// first frame waiting to be written
+		uint32_t			write_count = 0;											// frames waiting to be written
         
 		int					cacheResp = 0;
-		int					checkSpace = 0;
-
-		FileSystem			*tempFile = NULL;
-		
-		Flag				goodFile = NO;
+		Flag				newFrame = NO;												// frame was just allocated to grow the file
+		IovCursor			cursor;														// next byte of the buffers to write
 
 
         // Check illegal bounds for 'count' bytes (less than 0)
@@ -592,465 +878,1905 @@ int32_t cart_write(int16_t fd, void *buf, int32_t count) {
             logMessage(LOG_ERROR_LEVEL, "\nFile is not opened or valid in fileSystem : occurence in CART_WRITE\n");
             return (-1);
         }
-		// Search file system to ensure we have a legal file
-		for (i = 0; i < numFiles; i++) {
-			if (fileSystem[fd].filehandle == fd)
-				goodFile = YES;
-		}
-		if (goodFile != YES)
-			return (-1);
-
-		// Create a local file buffer large enough to hold the file and new data to be written
-		buf_size = strlen((char *)buf);
-
-		if (fileSystem[fd].filelength > 0)
-			local_file_buffer = calloc(buf_size + fileSystem[fd].filelength, sizeof(char));
-		else
-			local_file_buffer = calloc(count, sizeof(char));
-
-        // File not previously written to CART memory ==> FIRST WRITE
-        if(fileSystem[fd].incart == NO){
-
-            // Clear the buffer for good practice
-            for(i = 0; i < CART_FRAME_SIZE; i++)
-                cart_buffer[i] = '\0'; 
-
-            // Update the counters to default values
-            counter = count;
-            iteration = 0;
-
-		search_file_table:
-            // Get the next frame that is available and jump to cart_info_found
-            for(i = 0; i < CART_MAX_CARTRIDGES; i++){
-                for(j = 0; j < CART_CARTRIDGE_SIZE; j++){
-                    // Set the first frame's location that is available in CART memory
-                    if(fileTable[i][j].isused == NO){
-                        the_cart = i;
-                        the_frame = j;
-                        goto cart_info_found;
-                    }
-                }
-            }
-        
-		cart_info_found: 
-			// Write remaining (counter) bytes to CART memory
-			while(counter > 0){
-                
-                // (1) - Update the local cart_buffer that is going to write exactly 1 frame for every loop iteration
-                if(counter <= CART_FRAME_SIZE){
-                    memcpy(&cart_buffer, &((char *) buf)[iteration * CART_FRAME_SIZE], counter);            // count bytes or counter bytes left
-                    counter -= counter;
-                }
-                else{
-                    memcpy(&cart_buffer, &((char *) buf)[iteration * CART_FRAME_SIZE], CART_FRAME_SIZE);    // frame sized worth of bytes
-                    counter -= CART_FRAME_SIZE;
-                }
-
-                // (2) - Load the cartridge that was previously found
-				load_this_cart(the_cart);    
-
-		// WRITE THROUGH TO CART MEMORY FIRST
-
-                // (3) - Write to the first frame available that was previously found
-                resp =  client_cart_bus_request(create_cart_opcode(CART_OP_WRFRME, 0, 0, 0, the_frame, 0), cart_buffer);
-                if(extract_cart_opcode(resp, CART_REG_RT1) != 0){
-                    logMessage(LOG_ERROR_LEVEL,"Cartridge loading failed in CART_WRITE");
-                    return (-1);
-                }                
-				
-		// WRITE TO CACHE FOR FASTER TEMPORAL READ ACCESSES
-
-					// Add frame to the cache
-					cacheResp = put_cart_cache(the_cart, the_frame, cart_buffer);
-					if (cacheResp != 0)
-						return (-1);
-
-                // (4) - On the FIRST WRITE to file, set the first cart/frame locations
-                if(iteration == 0){
-                    fileSystem[fd].cartIndex					= the_cart;
-                    fileSystem[fd].frameIndex					= the_frame;
-					fileSystem[fd].incart						= YES;
-					fileTable[the_cart][the_frame].filehandle	= fd;
-					fileTable[the_cart][the_frame].isused		= YES;
-                }
-                // (5) - On successive writes, set the next cart/frame
-                else{
-                    if(the_cart == 0 || the_frame == 0)
-                        return (-1);
-                    if(the_cart == CART_MAX_CARTRIDGES || the_frame == CART_CARTRIDGE_SIZE)
-                        return (-1);
-
-					fileTable[the_cart][the_frame].filehandle	 = fd;
-					fileTable[the_cart][the_frame].isused		 = YES;
-                }
-                
-                // (6) - Update the file properties
-                fileSystem[fd].fileposition	= count;    // since this is first write, file position will be equal to count
-                fileSystem[fd].filelength	= count;    // since this is first write, file length will be equal to count
-
-                // (7) - Update loop iteration
-                iteration++;
-
-                // (8) - Get the next cart/frame (while loop will exit before data is used if not needed)
-				goto search_file_table;
-
-            }
-
+        // Files have no holes, so a write can start at most at the end of the file
+        if(position > fileSystem[fd].filelength){
+            logMessage(LOG_ERROR_LEVEL, "\nWrite position %u is past the end of the file in CART_WRITE\n", position);
+            return (-1);
         }
-        // File already exists in CART memory ==> SUCCESSIVE WRITES
-        else{
-
-			// Clear the buffer for good practice
-			for (i = 0; i < CART_FRAME_SIZE; i++)
-				cart_buffer[i] = '\0';
-
-            // Update the counters to default values
-            counter = fileSystem[fd].filelength;
-            iteration = 0;
-
-			// Determine if there is space in the CART memory to fulfill the write request
-			checkSpace = check_table_space(fd, count);
-
-			// Check the table space result
-			if (checkSpace != 0) {
-				logMessage(LOG_ERROR_LEVEL, "\nNot enough space in CART memory to fulfill write request!!!\n");
-				return (-1);
-			}
-
-			// Find all frames the file exists in CART memory
-			tempFile = get_file_pieces(fd);	
-			if (tempFile == NULL)
-				return(-1);
 
-			// Set the initial cart and load it
-			the_cart	= tempFile[0].cartIndex;
-			load_this_cart(the_cart);
-
-			// Set the initial frame the file exists in
-			the_frame	= tempFile[0].frameIndex;
+		// Let frames being read ahead land first, so none can overwrite what is written here
+		if (reap_read_ahead(YES) != 0)
+			return (-1);
 
-			// Read/extract file from CART memory to do appending
-			while(counter > 0){
+		// Determine if there is space in the CART memory to fulfill the write request
+		if (check_table_space(fd, position, count) != 0) {
+			logMessage(LOG_ERROR_LEVEL, "\nNot enough space in CART memory to fulfill write request!!!\n");
+			return (-1);
+		}
 
-				// (1) - Ensure we are loading from the correct cart retrieved from the file table
-				if (tempFile[iteration].cartIndex != the_cart) {
-					the_cart = tempFile[iteration].cartIndex;
-					load_this_cart(the_cart);
+		// Write the bytes frame by frame, touching only the frames overlapping the write
+		cursor.iov = iov;
+		cursor.left = iovcnt;
+		cursor.offset = 0;
+		while (copied < count) {
+
+			// (1) - Find the frame holding the position and how much of it is written
+			piece	= position / CART_FRAME_SIZE;
+			offset	= position % CART_FRAME_SIZE;
+			length	= CART_FRAME_SIZE - offset;
+			if (length > count - copied)
+				length = count - copied;
+
+			// (2) - Past the last frame of the file, so grow it by a frame from a contiguous run
+			if (piece >= get_file_frames(fd)) {
+				if (run_left == 0 &&
+						(run_left = alloc_frame_run((count - copied + offset + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE,
+						&run_cart, &run_frame)) == 0) {
+					logMessage(LOG_ERROR_LEVEL, "\nNot enough space in CART memory to fulfill write request!!!\n");
+					return (-1);
 				}
+				the_cart = run_cart;
+				the_frame = run_frame++;
+				run_left--;
+
+				pthread_mutex_lock(&allocLock);
+				fileTable[the_cart][the_frame].filehandle	= fd;
+				fileTable[the_cart][the_frame].isused		= YES;
+				pthread_mutex_unlock(&allocLock);
+				if (journal_file_extent(fd, the_cart, the_frame) != 0)
+					return (-1);
 
-				// If there is a next frame, set it, otherwise while loop will end if not
-				the_frame = tempFile[iteration].frameIndex;
-
-                // (2) - Read a frame size amount of the file into the cart_buffer
-                resp =  client_cart_bus_request(create_cart_opcode(CART_OP_RDFRME, 0, 0, 0, the_frame, 0), cart_buffer);
-                if(extract_cart_opcode(resp, CART_REG_RT1) != 0){
-                    logMessage(LOG_ERROR_LEVEL,"Cartridge loading failed in CART_WRITE");
-                    return (-1);
-                }    
-
-                // (3) - Set the isused flag to NO as this frame may be overwritten when the file is appended
-                fileTable[the_cart][the_frame].isused = NO;
-
-                // (4) - Copy the cart_buffer extracted frame by frame into the local_file_buffer
-				if (counter >= CART_FRAME_SIZE) {
-					memcpy(&local_file_buffer[iteration * CART_FRAME_SIZE], cart_buffer, CART_FRAME_SIZE);
+				// On the FIRST WRITE to file, set the first cart/frame locations
+				if (fileSystem[fd].incart == NO) {
+					fileSystem[fd].cartIndex	= the_cart;
+					fileSystem[fd].frameIndex	= the_frame;
+					fileSystem[fd].incart		= YES;
 				}
-				else {
-					memcpy(&local_file_buffer[iteration * CART_FRAME_SIZE], cart_buffer, counter);
+				newFrame = YES;
+			}
+			else {
+				if (find_file_frame(fd, piece, &the_cart, &the_frame) != 0)
+					return (-1);
+				newFrame = NO;
+			}
+
+			// (3) - A partly written frame keeps its other bytes (the cached copy is newer if dirty), a new one starts empty
+			if (length == CART_FRAME_SIZE || newFrame == YES) {
+				memset(cart_buffer, 0x0, CART_FRAME_SIZE);
+			}
+			else if ((cache_buffer = (char *)pin_cart_cache(the_cart, the_frame)) != NULL) {
+				memcpy(cart_buffer, cache_buffer, CART_FRAME_SIZE);
+				unpin_cart_cache(the_cart, the_frame);
+			}
+			else {
+				resp = request_cart_frames(the_cart, create_cart_opcode(CART_OP_RDFRME, 0, 0, 0, the_frame, 0), cart_buffer);
+				if (extract_cart_opcode(resp, CART_REG_RT1) != 0) {
+					logMessage(LOG_ERROR_LEVEL, "Cartridge reading failed in CART_WRITE");
+					return (-1);
 				}
-                
-                // (5) - Update the counters
-                counter -= CART_FRAME_SIZE;
-                iteration++;
-            }
+			}
+			gather_iov_bytes(&cursor, &cart_buffer[offset], length);
 
-            // Now append the local_file_buffer
-            memcpy(&local_file_buffer[fileSystem[fd].fileposition], (char *) buf, the_count);
+		// WRITE BACK MODE: ONLY CACHE THE FRAME, CART MEMORY IS UPDATED ON EVICTION OR FLUSH
 
-            // Update the file properties
-			// Write request is more bytes than the file size so increase filelength
-			if (fileSystem[fd].filelength < fileSystem[fd].fileposition + buf_size) {
-				fileSystem[fd].filelength = strlen(local_file_buffer);
-				fileSystem[fd].fileposition = fileSystem[fd].filelength;
+			if (get_cart_cache_mode() == CART_CACHE_WRITEBACK) {
+				cacheResp = put_dirty_cart_cache(the_cart, the_frame, cart_buffer);
+				if (cacheResp != 0)
+					return (-1);
 			}
 			else {
-				fileSystem[fd].filelength = strlen(local_file_buffer);
-				fileSystem[fd].fileposition = fileSystem[fd].fileposition + the_count;
-			}            
-
-			// Update and reset the iterations and counter to the number of bytes to be written
-            counter = fileSystem[fd].filelength;    
-			iteration = 0;
-
-            // Get the next frame that is available to write to from fileTable
-            for(i = 0; i < CART_MAX_CARTRIDGES; i++){
-                for(j = 0; j < CART_CARTRIDGE_SIZE; j++){
-                    // (1) - Set the first frame's location that is available in CART memory
-                    if(fileTable[i][j].isused == NO){
-                        the_cart = i;
-                        the_frame = j;
-                        goto cart_write_back;
-                    }
-                }
-            }
-            
-		cart_write_back: 
-			// Write back the file when cart/frame to use is defined
-			while(counter > 0){
-
-                // (1) - Clear the buffer for good practice
-                for(i = 0; i < CART_FRAME_SIZE; i++)
-                    cart_buffer[i] = '\0'; 
-
-                // (2) - Update the local cart_buffer that is going to write exactly 1 frame for every loop iteration
-                if(counter <= CART_FRAME_SIZE){
-                    memcpy(&cart_buffer, &(local_file_buffer)[iteration * CART_FRAME_SIZE], counter);            // count bytes or counter bytes left
-                    counter -= counter;
-                }
-                else{
-                    memcpy(&cart_buffer, &(local_file_buffer)[iteration * CART_FRAME_SIZE], CART_FRAME_SIZE);    // frame sized worth of bytes
-                    counter -= CART_FRAME_SIZE;
-                }
-
-                // (3) - Load the cartridge that was previously found
-				load_this_cart(the_cart);
-
 		// WRITE THROUGH TO CART MEMORY FIRST
 
-                // (4) - Write to the first frame available that was previously found
-                resp =  client_cart_bus_request(create_cart_opcode(CART_OP_WRFRME, 0, 0, 0, the_frame, 0), cart_buffer);
-                if(extract_cart_opcode(resp, CART_REG_RT1) != 0){
-                    logMessage(LOG_ERROR_LEVEL,"Cartridge loading failed in CART_WRITE");
-                    return (-1);
-                }    
-
-		// WRITE TO CACHE FOR FASTER TEMPORAL READ ACCESSES
-
-					// Add frame to the cache
-					cacheResp = put_cart_cache(the_cart, the_frame, cart_buffer);
-					if (cacheResp != 0)
+				// (4) - Gather the frame into the run of consecutive frames written in place together
+				if (write_count > 0 && (the_cart != write_cart || the_frame != write_frame + write_count ||
+						write_count == CART_MAX_RUN_FRAMES)) {
+					if (write_frame_run(write_cart, write_frame, write_count, write_buffer) != 0)
 						return (-1);
+					write_count = 0;
+				}
+				if (write_count == 0) {
+					write_cart = the_cart;
+					write_frame = the_frame;
+				}
+				memcpy(&write_buffer[write_count++ * CART_FRAME_SIZE], cart_buffer, CART_FRAME_SIZE);
 
-                // (5) - On the FIRST WRITE to file, set the first cart/frame locations
-                if(iteration == 0){
-                    fileSystem[fd].cartIndex  = the_cart;
-                    fileSystem[fd].frameIndex = the_frame;
-					fileTable[the_cart][the_frame].filehandle = fd;
-					fileTable[the_cart][the_frame].isused = YES;
-                }
-                // (6) - On successive writes, set the next cart/frame
-                else{
-                    if(the_cart == 0 && the_frame == 0)
-                        return (-1);
-                    if(the_cart == CART_MAX_CARTRIDGES || the_frame == CART_CARTRIDGE_SIZE)
-                        return (-1);
-
-						fileTable[the_cart][the_frame].filehandle	= fd;
-						fileTable[the_cart][the_frame].isused		= YES;
-                   
-                }
-
-                // (7) - Update loop iteration
-                iteration++;
-
-                // (8) - Get the next cart/frame (while loop will exit before data is used if not needed)
-                for(i = 0; i < CART_MAX_CARTRIDGES; i++){
-                    for(j = 0; j < CART_CARTRIDGE_SIZE; j++){
-                        // Set the first frame's location that is available in CART memory
-                        if(fileTable[i][j].isused == NO){
-                            the_cart  = i;
-                            the_frame = j;
-                            goto cart_write_back;
-                        }
-                    }
-                }
+		// WRITE TO CACHE FOR FASTER TEMPORAL READ ACCESSES
 
-            }
-        }
+				cacheResp = put_cart_cache(the_cart, the_frame, cart_buffer);
+				if (cacheResp != 0)
+					return (-1);
+			}
 
-		// Free the local file buffer from the heap
-		if (local_file_buffer != NULL) {
-			free(local_file_buffer);
-			local_file_buffer = NULL;
+			// (5) - Update the counters
+			copied		+= length;
+			position	+= length;
 		}
 
-		// Free the temporary data structure from the heap
-		free(tempFile);
-		tempFile = NULL;
+		// Write through the frames still gathered
+		if (write_count > 0 && write_frame_run(write_cart, write_frame, write_count, write_buffer) != 0)
+			return (-1);
+
+		// Update the file properties; writing past the end grows the file
+		if (fileSystem[fd].filelength < position && journal_file_length(fd, position) != 0)
+			return (-1);
 
         // Return successfully
-        return (the_count);
+        return (count);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_seek
-// Description  : Seek to specific point in the file
+// Function     : cart_preadv
+// Description  : Reads from "offset" in the file into the buffers of "iov"
+//                in order, without moving the file position
 //
-// Inputs       : fd - filename of the file to write to
-//                loc - offfset of file in relation to beginning of file
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : fd - file handle of the file to read from
+//                iov - the buffers to read into
+//                iovcnt - number of buffers
+//                offset - file position to read from
+// Outputs      : bytes read if successful, -1 if failure
 //
 ////////////////////////////////////////////////////////////////////////////////
-int32_t cart_seek(int16_t fd, uint32_t loc) {
-
-    // STEP 1 - Check illegal bounds for 'loc' bytes
-    if(loc < 0 || loc > fileSystem[fd].filelength){
-        logMessage(LOG_ERROR_LEVEL, "\nIllegal attempt to change fileposition location in CART_SEEK\n");
-        return (-1);
-    }
+int32_t cart_preadv(int16_t fd, const struct iovec *iov, int iovcnt, uint32_t offset) {
 
-    // STEP 2 - Set the seek position to the current file's fileposition
-    fileSystem[fd].fileposition = loc;
+	// Local Variables
+	int32_t		result = -1;
+	int32_t		count = 0;
+	uint64_t	started = 0;
 
-    // STEP 3 - Return successfully
-    return (0);
+	if ((count = count_iov_bytes(iov, iovcnt)) < 0)
+		return (-1);
+	started = client_cart_bus_clock();
+	if (lock_cart_file(fd) != 0)
+		return (-1);
+	result = read_cart_file(fd, offset, iov, iovcnt, count);
+	unlock_cart_file(fd);
+	count_file_io(NO, result, started);
+	return (result);
 }
 
-
+////////////////////////////////////////////////////////////////////////////////
 //
-// MY FUNCTIONS
+// Function     : cart_pwritev
+// Description  : Writes the buffers of "iov" in order at "offset" in the
+//                file, without moving the file position
 //
+// Inputs       : fd - file handle of the file to write to
+//                iov - the buffers to write from
+//                iovcnt - number of buffers
+//                offset - file position to write at (at most the length)
+// Outputs      : bytes written if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int32_t cart_pwritev(int16_t fd, const struct iovec *iov, int iovcnt, uint32_t offset) {
 
-int load_this_cart(CartridgeIndex cart) {
-	CartXferRegister resp;
-
-	resp = client_cart_bus_request(create_cart_opcode(CART_OP_LDCART, 0, 0, cart, 0, 0), NULL);
+	// Local Variables
+	int32_t		result = -1;
+	int32_t		count = 0;
+	uint64_t	started = 0;
 
-	if (extract_cart_opcode(resp, CART_REG_RT1) != 0) {
-		logMessage(LOG_ERROR_LEVEL, "\nCartridge loading failed for cart: %u !\n", cart);
+	if ((count = count_iov_bytes(iov, iovcnt)) < 0)
 		return (-1);
-	}
-
-	return(0);
+	started = client_cart_bus_clock();
+	if (lock_cart_file(fd) != 0)
+		return (-1);
+	result = write_cart_file(fd, offset, iov, iovcnt, count);
+	unlock_cart_file(fd);
+	count_file_io(YES, result, started);
+	return (result);
 }
 
-int check_table_space(int16_t fd, int32_t count) {
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_mmap
+// Description  : Maps "length" bytes of the file from "offset" into memory,
+//                prefaulted through the cache in one pass, as a snapshot of
+//                the file: writes to the file after it is made are not
+//                seen, and a private mapping's changes never reach the file
+//
+// Inputs       : fd - file handle of the file to map
+//                offset - file position the mapping starts at
+//                length - bytes to map (past the end of the file they are zero)
+//                mode - CART_MAP_READONLY or CART_MAP_PRIVATE (copy on write)
+// Outputs      : the mapping if successful, NULL if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+void *cart_mmap(int16_t fd, uint32_t offset, uint32_t length, CartMapModes mode) {
 
 	// Local Variables
-	int			i = 0, j = 0, counter = 0;
-	uint32_t	length = 0;
-	double		new_frames_needed = 0.0;
-
-	// First handle obvious case where no new frames in CART will be needed
-	if (fileSystem[fd].filelength >= fileSystem[fd].fileposition + count)
-		return (0);
-	// Determine additional frames needed and search file table to see if enough space exists
-	else {
-
-		// Set parameters to check when scanning file table
-		length				= fileSystem[fd].filelength + count;
-		new_frames_needed	= ceil((double)length / (double)CART_FRAME_SIZE);
-
-		// Search the file table for number of frames available
-		for (i = 0; i < CART_MAX_CARTRIDGES; i++) {
-			for (j = 0; j < CART_CARTRIDGE_SIZE; j++) {
-				if (fileTable[i][j].isused == NO) {
-					counter++;
-				}
-			}
-		}
-
-		// If more frames are needed than available space in CART, return failure
-		if (new_frames_needed > counter)
-			return (-1);
+	void			*map = NULL;
+	int32_t			count = 0;
+	uint64_t		started = client_cart_bus_clock();
+	struct iovec	vec;
 
+	if (length == 0 || length > INT32_MAX || (mode != CART_MAP_READONLY && mode != CART_MAP_PRIVATE)) {
+		logMessage(LOG_ERROR_LEVEL, "\nBad length %u or mode %d passed to cart_mmap\n", length, mode);
+		return (NULL);
 	}
-
-	// Return successfully
-	return (0);
-}
-
-void * get_file_pieces(int16_t fd) {
-
-	// Local Variables
-	FileSystem	*tempFile = NULL;
-	int i = 0, j = 0;
-	int	counter = 0, pieces = 0;
-
-	// Check to make sure file contains some frames
-	if (fileSystem[fd].filelength < 1) {
-		logMessage(LOG_ERROR_LEVEL, "\nError in get_file_pieces() : file does not contain any frames\n");
+	if ((map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		logMessage(LOG_ERROR_LEVEL, "\nUnable to map %u bytes in cart_mmap\n", length);
 		return (NULL);
 	}
-
-	// Find out how many occurrences/pieces the file exists in the file table
-	for (i = 0; i < CART_MAX_CARTRIDGES; i++) {
-		for (j = 0; j < CART_CARTRIDGE_SIZE; j++) {
-			if (fileTable[i][j].filehandle == fd && fileTable[i][j].isused == YES) {
-					pieces++;
-			}
-		}
+	if (lock_cart_file(fd) != 0) {
+		munmap(map, length);
+		return (NULL);
 	}
 
-	// Allocate space for temporary file 'array'
-	tempFile = calloc(pieces, sizeof(FileSystem));
-
-	// Loop through pieces in CART memory to obtain file existance structure
-	while (pieces > 0) {
-		for (i = 0; i < CART_MAX_CARTRIDGES; i++) {
-			for (j = 0; j < CART_CARTRIDGE_SIZE; j++) {
-				if (fileTable[i][j].filehandle == fd && fileTable[i][j].isused == YES) {
-					tempFile[counter].cartIndex = i;
-					tempFile[counter].frameIndex = j;
-					counter++;
-					pieces--;
-				}
-			}
-		}
+	// Prefault every page of the mapping; anonymous pages already hold zeros past the file
+	if (offset > fileSystem[fd].filelength) {
+		logMessage(LOG_ERROR_LEVEL, "\nMapping offset %u is past the end of the file in cart_mmap\n", offset);
+		count = -1;
+	}
+	else if (offset < fileSystem[fd].filelength) {
+		vec.iov_base = map;
+		vec.iov_len = length;
+		fileSystem[fd].readEnd = offset;		// the pages are filled in order, so read ahead of them
+		count = read_cart_file(fd, offset, &vec, 1, length);
+		count_file_io(NO, count, started);
+	}
+	unlock_cart_file(fd);
+	if (count < 0 || (mode == CART_MAP_READONLY && mprotect(map, length, PROT_READ) != 0)) {
+		munmap(map, length);
+		return (NULL);
 	}
+	return (map);
+}
 
-	// Return successfully
-	return (tempFile);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_munmap
+// Description  : Removes a mapping made by cart_mmap
+//
+// Inputs       : addr - the mapping
+//                length - bytes it maps (as passed to cart_mmap)
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int32_t cart_munmap(void *addr, uint32_t length) {
+
+	if (addr == NULL || munmap(addr, length) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nBad mapping passed to cart_munmap\n");
+		return (-1);
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_cart_driver_stats
+// Description  : Copy out what the driver has counted since the program
+//                started
+//
+// Inputs       : stats - where the counters go
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int32_t get_cart_driver_stats(CartDriverStats *stats) {
+
+	if (stats == NULL)
+		return (-1);
+	pthread_mutex_lock(&allocLock);
+	stats->runsAllocated = driverStats.runsAllocated;
+	stats->framesAllocated = driverStats.framesAllocated;
+	stats->framesFreed = driverStats.framesFreed;
+	stats->allocTime = driverStats.allocTime;
+	pthread_mutex_unlock(&allocLock);
+	stats->reads = __atomic_load_n(&driverStats.reads, __ATOMIC_RELAXED);
+	stats->bytesRead = __atomic_load_n(&driverStats.bytesRead, __ATOMIC_RELAXED);
+	stats->readTime = __atomic_load_n(&driverStats.readTime, __ATOMIC_RELAXED);
+	stats->writes = __atomic_load_n(&driverStats.writes, __ATOMIC_RELAXED);
+	stats->bytesWritten = __atomic_load_n(&driverStats.bytesWritten, __ATOMIC_RELAXED);
+	stats->writeTime = __atomic_load_n(&driverStats.writeTime, __ATOMIC_RELAXED);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : count_file_io
+// Description  : Count a read or write call in the driver statistics (files
+//                are used by several threads at once, so atomically)
+//
+// Inputs       : writing - YES for a write
+//                bytes - bytes moved, -1 if the call failed
+//                started - client_cart_bus_clock when the call started
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void count_file_io(Flag writing, int32_t bytes, uint64_t started) {
+
+	// Local Variables
+	uint64_t	elapsed = client_cart_bus_clock() - started;
+
+	if (writing == YES) {
+		__atomic_fetch_add(&driverStats.writes, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&driverStats.bytesWritten, (bytes > 0) ? bytes : 0, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&driverStats.writeTime, elapsed, __ATOMIC_RELAXED);
+	}
+	else {
+		__atomic_fetch_add(&driverStats.reads, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&driverStats.bytesRead, (bytes > 0) ? bytes : 0, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&driverStats.readTime, elapsed, __ATOMIC_RELAXED);
+	}
+	CART_TRACE(LOG_INFO_LEVEL, "File %s of %d bytes in %lu ns", (writing == YES) ? "write" : "read", bytes,
+			(unsigned long)elapsed);
 }
 
-int get_num_pieces(int16_t fd) {
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : count_iov_bytes
+// Description  : Add up the bytes a list of buffers holds
+//
+// Inputs       : iov - the buffers
+//                iovcnt - number of buffers
+// Outputs      : the bytes, -1 if the list is bad or holds too much
+//
+////////////////////////////////////////////////////////////////////////////////
+int32_t count_iov_bytes(const struct iovec *iov, int iovcnt) {
 
 	// Local Variables
-	int i = 0, j = 0;
-	int	pieces = 0;
+	int			i = 0;
+	size_t		count = 0;
 
-	// Check to make sure file contains some frames
-	if (fileSystem[fd].filelength < 1) {
-		logMessage(LOG_ERROR_LEVEL, "\nError in get_file_pieces() : file does not contain any frames\n");
+	if (iovcnt < 0 || (iov == NULL && iovcnt > 0)) {
+		logMessage(LOG_ERROR_LEVEL, "\nBad buffer list passed to the CART driver\n");
 		return (-1);
 	}
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > INT32_MAX - count || (iov[i].iov_base == NULL && iov[i].iov_len > 0)) {
+			logMessage(LOG_ERROR_LEVEL, "\nBad buffer %d in the list passed to the CART driver\n", i);
+			return (-1);
+		}
+		count += iov[i].iov_len;
+	}
+	return ((int32_t)count);
+}
 
-	// Find out how many occurrences/pieces the file exists in the file table
-	for (i = 0; i < CART_MAX_CARTRIDGES; i++) {
-		for (j = 0; j < CART_CARTRIDGE_SIZE; j++) {
-			if (fileTable[i][j].filehandle == fd && fileTable[i][j].isused == YES) {
-				pieces++;
-			}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : scatter_iov_bytes
+// Description  : Copy bytes into a list of buffers, moving the cursor on
+//
+// Inputs       : cursor - next byte of the buffers to fill
+//                src - the bytes
+//                length - number of bytes (no more than the buffers have left)
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void scatter_iov_bytes(IovCursor *cursor, const char *src, int length) {
+
+	// Local Variables
+	size_t		part = 0;
+
+	while (length > 0 && cursor->left > 0) {
+		part = cursor->iov->iov_len - cursor->offset;
+		if (part > (size_t)length)
+			part = length;
+		memcpy((char *)cursor->iov->iov_base + cursor->offset, src, part);
+		src += part;
+		length -= part;
+		if ((cursor->offset += part) == cursor->iov->iov_len) {
+			cursor->iov++;
+			cursor->left--;
+			cursor->offset = 0;
 		}
 	}
+}
 
-	// Return successfully
-	return (pieces);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gather_iov_bytes
+// Description  : Copy bytes out of a list of buffers, moving the cursor on
+//
+// Inputs       : cursor - next byte of the buffers to take
+//                dst - where the bytes go
+//                length - number of bytes (no more than the buffers have left)
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void gather_iov_bytes(IovCursor *cursor, char *dst, int length) {
+
+	// Local Variables
+	size_t		part = 0;
+
+	while (length > 0 && cursor->left > 0) {
+		part = cursor->iov->iov_len - cursor->offset;
+		if (part > (size_t)length)
+			part = length;
+		memcpy(dst, (char *)cursor->iov->iov_base + cursor->offset, part);
+		dst += part;
+		length -= part;
+		if ((cursor->offset += part) == cursor->iov->iov_len) {
+			cursor->iov++;
+			cursor->left--;
+			cursor->offset = 0;
+		}
+	}
 }
 
-int allocateNewFile(void){
-    
-    // Local Variables
-    int i = 0;
-    int origFileCount = numFiles;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_seek
+// Description  : Seek to specific point in the file
+//
+// Inputs       : fd - filename of the file to write to
+//                loc - offfset of file in relation to beginning of file
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int32_t cart_seek(int16_t fd, uint32_t loc) {
 
-    // Allocate one new file into file system heap memory
-    numFiles++;
-    fileSystem  = realloc(fileSystem, sizeof(FileSystem)*numFiles);
+    if (lock_cart_file(fd) != 0)
+        return (-1);
 
-    // Initialize new memory allocated for the additional one file added
-    for(i = origFileCount; i < numFiles; i++){
-        strncpy(fileSystem[i].filename, "", CART_MAX_PATH_LENGTH);      // Initialize the filename for each instance of FileState struct to '\0'
-        fileSystem[i].filehandle    =   -1;          // Unused/invalid file handles will be negative numbers
-        fileSystem[i].fileposition  =    0;          // Initialize default file position to zero
-        fileSystem[i].filelength    =    0;          // Initialize default file size to zero     
-        fileSystem[i].openfile      =   NO;          // Initalize all files to not open status
-        fileSystem[i].incart        =   NO;          // Initialze all files to not incast status
-        fileSystem[i].cartIndex     =    0;          // Initialize default cartridge the file exists in to 0
-        fileSystem[i].frameIndex    =    0;          // Initialize default frame the file exists in to 0    
+    // STEP 1 - Check illegal bounds for 'loc' bytes
+    if(loc < 0 || loc > fileSystem[fd].filelength){
+        unlock_cart_file(fd);
+        logMessage(LOG_ERROR_LEVEL, "\nIllegal attempt to change fileposition location in CART_SEEK\n");
+        return (-1);
     }
 
-    // Return successfully
+    // STEP 2 - Set the seek position to the current file's fileposition
+    fileSystem[fd].fileposition = loc;
+
+    // STEP 3 - Return successfully
+    unlock_cart_file(fd);
     return (0);
-}
\ No newline at end of file
+}
+
+
+//
+// MY FUNCTIONS
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lock_cart_file
+// Description  : Lock a file for one operation, holding the file set shared so
+//                it stays in place
+//
+// Inputs       : fd - the file handle
+// Outputs      : 0 if successful, -1 if the handle is out of range
+//
+////////////////////////////////////////////////////////////////////////////////
+int lock_cart_file(int16_t fd) {
+
+	pthread_rwlock_rdlock(&fileSystemLock);
+	if (fd < 0 || fd >= numFiles) {
+		pthread_rwlock_unlock(&fileSystemLock);
+		logMessage(LOG_ERROR_LEVEL, "\nBad file handle %d passed to the CART driver\n", fd);
+		return (-1);
+	}
+	pthread_mutex_lock(&fileLocks[fd]);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unlock_cart_file
+// Description  : Release a file locked by lock_cart_file
+//
+// Inputs       : fd - the file handle
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void unlock_cart_file(int16_t fd) {
+	pthread_mutex_unlock(&fileLocks[fd]);
+	pthread_rwlock_unlock(&fileSystemLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : request_cart_frames
+// Description  : Send a frame request to a cart, loading the cart first if
+//                it isn't the one loaded.  The load and request are queued
+//                back to back under the cart lock, then waited for without it,
+//                so requests of other callers overlap on the bus.
+//
+// Inputs       : cart - the cartridge the request acts on
+//                reg - the request registers
+//                buf - the frame(s) to read into or write from
+// Outputs      : the request's response (failed if the load failed)
+//
+////////////////////////////////////////////////////////////////////////////////
+CartXferRegister request_cart_frames(CartridgeIndex cart, CartXferRegister reg, void *buf) {
+
+	// Local Variables
+	int				count = 0;
+	int				remaining = 0;
+	CartBusRequest	requests[2];
+
+	pthread_mutex_lock(&cartLock);
+	if (cart != loadedCart) {
+		requests[count].reg = create_cart_opcode(CART_OP_LDCART, 0, 0, cart, 0, 0);
+		requests[count++].buf = NULL;
+		loadedCart = cart;
+	}
+	requests[count].reg = reg;
+	requests[count++].buf = buf;
+	if (client_cart_bus_start(requests, count, &remaining) != 0)
+		loadedCart = CART_NO_CARTRIDGE;
+	pthread_mutex_unlock(&cartLock);
+
+	if (client_cart_bus_wait(&remaining) != 0)
+		return ((CartXferRegister)-1);
+
+	// The controller's loaded cart is unknown after a failed load
+	if (count == 2 && extract_cart_opcode(requests[0].resp, CART_REG_RT1) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nCartridge loading failed for cart: %u !\n", cart);
+		pthread_mutex_lock(&cartLock);
+		loadedCart = CART_NO_CARTRIDGE;
+		pthread_mutex_unlock(&cartLock);
+		return (requests[0].resp);
+	}
+	return (requests[count - 1].resp);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_this_frame
+// Description  : Write one frame to CART memory; also used by the cache to
+//                write back dirty frames
+//
+// Inputs       : cart - the cartridge to write to
+//                frame - the frame to write to
+//                buf - the frame of data to write
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int write_this_frame(CartridgeIndex cart, CartFrameIndex frame, void *buf) {
+	CartXferRegister resp;
+
+	resp = request_cart_frames(cart, create_cart_opcode(CART_OP_WRFRME, 0, 0, 0, frame, 0), buf);
+
+	if (extract_cart_opcode(resp, CART_REG_RT1) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nFrame writing failed for cart: %u frame: %u !\n", cart, frame);
+		return (-1);
+	}
+
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_frame_run
+// Description  : Write a run of consecutive frames of one cart to CART memory
+//                with a single WRFRMS (WRFRME for a lone frame)
+//
+// Inputs       : cart - the cartridge to write to
+//                frame - the first frame of the run
+//                count - frames in the run (at most CART_MAX_RUN_FRAMES)
+//                buf - the frames of data to write, back to back
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int write_frame_run(CartridgeIndex cart, CartFrameIndex frame, uint32_t count, void *buf) {
+	CartXferRegister resp;
+
+	if (count == 1)
+		return (write_this_frame(cart, frame, buf));
+
+	resp = request_cart_frames(cart, create_cart_opcode(CART_OP_WRFRMS, 0, 0, 0, frame, count), buf);
+
+	if (extract_cart_opcode(resp, CART_REG_RT1) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nFrame run writing failed for cart: %u frames: %u-%u !\n", cart, frame, frame + count - 1);
+		return (-1);
+	}
+
+	return(0);
+}
+
+int check_table_space(int16_t fd, uint32_t position, int32_t count) {
+
+	// Local Variables
+	uint32_t	frames_needed = 0;
+
+	// First handle obvious case where no new frames in CART will be needed
+	frames_needed = (position + count + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE;
+	if (frames_needed <= get_file_frames(fd))
+		return (0);
+
+	// If more frames are needed than available space in CART, return failure
+	pthread_mutex_lock(&allocLock);
+	if (frames_needed - get_file_frames(fd) > freeFrames) {
+		pthread_mutex_unlock(&allocLock);
+		return (-1);
+	}
+	pthread_mutex_unlock(&allocLock);
+
+	// Return successfully
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : append_file_extent
+// Description  : Add a newly allocated frame to the end of a file's extent
+//                map, extending the last extent when the frame follows it
+//
+// Inputs       : fd - the file the frame was allocated to
+//                cart - the frame's cartridge
+//                frame - the frame number within the cartridge
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int append_file_extent(int16_t fd, CartridgeIndex cart, CartFrameIndex frame) {
+
+	// Local Variables
+	FileSystem	*file = &fileSystem[fd];
+	FileExtent	*last = NULL;
+	FileExtent	*grown = NULL;
+	uint32_t	capacity = 0;
+
+	// The frame continues the last run, so just lengthen it
+	if (file->extentCount > 0) {
+		last = &file->extents[file->extentCount - 1];
+		if (last->cart == cart && last->frame + last->length == frame) {
+			last->length++;
+			return (0);
+		}
+	}
+
+	// Grow the extent array geometrically when full
+	if (file->extentCount == file->extentCapacity) {
+		capacity = (file->extentCapacity > 0) ? file->extentCapacity * 2 : 4;
+		grown = realloc(file->extents, sizeof(FileExtent) * capacity);
+		if (grown == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "\nUnable to grow extent map of file %d in append_file_extent\n", fd);
+			return (-1);
+		}
+		file->extents = grown;
+		file->extentCapacity = capacity;
+	}
+
+	// Start a new run at the next file frame
+	file->extents[file->extentCount].cart	= cart;
+	file->extents[file->extentCount].frame	= frame;
+	file->extents[file->extentCount].length	= 1;
+	file->extents[file->extentCount].start	= get_file_frames(fd);
+	file->extentCount++;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_file_frame
+// Description  : Map a file frame number to its cart/frame in CART memory
+//                by binary search of the file's extent map
+//
+// Inputs       : fd - the file
+//                piece - the file frame number (file offset / CART_FRAME_SIZE)
+//                cart - set to the frame's cartridge
+//                frame - set to the frame number within the cartridge
+// Outputs      : 0 if successful, -1 if the file has no such frame
+//
+////////////////////////////////////////////////////////////////////////////////
+int find_file_frame(int16_t fd, uint32_t piece, CartridgeIndex *cart, CartFrameIndex *frame) {
+
+	// Local Variables
+	FileSystem	*file = &fileSystem[fd];
+	uint32_t	low = 0, high = file->extentCount, mid = 0;
+
+	// Check to make sure file contains the frame
+	if (piece >= get_file_frames(fd)) {
+		logMessage(LOG_ERROR_LEVEL, "\nError in find_file_frame() : file %d does not contain frame %u\n", fd, piece);
+		return (-1);
+	}
+
+	// Find the last extent starting at or before the frame
+	while (high - low > 1) {
+		mid = (low + high) / 2;
+		if (file->extents[mid].start <= piece)
+			low = mid;
+		else
+			high = mid;
+	}
+
+	*cart	= file->extents[low].cart;
+	*frame	= file->extents[low].frame + (piece - file->extents[low].start);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_file_frames
+// Description  : Count the frames allocated to a file
+//
+// Inputs       : fd - the file
+// Outputs      : number of frames in the file's extent map
+//
+////////////////////////////////////////////////////////////////////////////////
+uint32_t get_file_frames(int16_t fd) {
+
+	// Local Variables
+	FileExtent	*last = NULL;
+
+	if (fileSystem[fd].extentCount == 0)
+		return (0);
+	last = &fileSystem[fd].extents[fileSystem[fd].extentCount - 1];
+	return (last->start + last->length);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_file_extents
+// Description  : Return every frame of a file to the file table and empty
+//                its extent map
+//
+// Inputs       : fd - the file
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void release_file_extents(int16_t fd) {
+
+	// Local Variables
+	uint32_t	i = 0;
+	FileExtent	*extent = NULL;
+
+	for (i = 0; i < fileSystem[fd].extentCount; i++) {
+		extent = &fileSystem[fd].extents[i];
+		free_frame_run(extent->cart, extent->frame, extent->length);
+	}
+	fileSystem[fd].extentCount = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : alloc_frame_run
+// Description  : Allocate a run of consecutive free frames within one cart,
+//                taking the first free frame found in the free-frame bitmap
+//                (of the loaded cart when it has room, to avoid a cart switch)
+//
+// Inputs       : wanted - the number of frames the caller would like
+//                cart - set to the cartridge of the run
+//                frame - set to the first frame of the run
+// Outputs      : number of frames allocated (1 to wanted), 0 if CART memory is full
+//
+////////////////////////////////////////////////////////////////////////////////
+uint32_t alloc_frame_run(uint32_t wanted, CartridgeIndex *cart, CartFrameIndex *frame) {
+
+	// Local Variables
+	uint32_t	c = 0, w = 0, bit = 0, ones = 0, run = 0;
+	uint64_t	bits = 0;
+	uint64_t	started = client_cart_bus_clock();
+	CartridgeIndex	loaded = CART_NO_CARTRIDGE;
+
+	pthread_mutex_lock(&cartLock);
+	loaded = loadedCart;
+	pthread_mutex_unlock(&cartLock);
+
+	pthread_mutex_lock(&allocLock);
+	if (wanted == 0 || freeFrames == 0) {
+		pthread_mutex_unlock(&allocLock);
+		return (0);
+	}
+
+	// Stay in the loaded cart if the whole run fits there, otherwise find the first cart with space
+	if (loaded < CART_MAX_CARTRIDGES && cartFreeFrames[loaded] >= wanted) {
+		c = loaded;
+	} else {
+		for (c = 0; c < CART_MAX_CARTRIDGES && cartFreeFrames[c] == 0; c++);
+		if (c == CART_MAX_CARTRIDGES) {
+			pthread_mutex_unlock(&allocLock);
+			return (0);
+		}
+	}
+	// Zero the cart the first time frames are handed out from it (powering on leaves them as they are)
+	if (cartZeroed[c] != YES && zero_this_cart(c) != 0) {
+		pthread_mutex_unlock(&allocLock);
+		return (0);
+	}
+	for (w = 0; frameBitmap[c][w] == 0; w++);
+	bit = __builtin_ctzll(frameBitmap[c][w]);
+	*cart = c;
+	*frame = w * 64 + bit;
+
+	// Take the free frames that follow, a word of the bitmap at a time
+	while (run < wanted && w < CART_CARTRIDGE_SIZE / 64) {
+		bits = frameBitmap[c][w] >> bit;
+		ones = (~bits == 0) ? 64 - bit : (uint32_t)__builtin_ctzll(~bits);
+		if (ones > 64 - bit)
+			ones = 64 - bit;
+		if (ones > wanted - run)
+			ones = wanted - run;
+		frameBitmap[c][w] &= ~(((ones == 64) ? ~0ULL : ((1ULL << ones) - 1)) << bit);
+		run += ones;
+		if (bit + ones < 64)
+			break;
+		w++;
+		bit = 0;
+	}
+
+	cartFreeFrames[c] -= run;
+	freeFrames -= run;
+	driverStats.runsAllocated++;
+	driverStats.framesAllocated += run;
+	driverStats.allocTime += client_cart_bus_clock() - started;
+	pthread_mutex_unlock(&allocLock);
+	return (run);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : zero_this_cart
+// Description  : Zero a cart before its frames are first used (with the
+//                allocator locked, so no one allocates from it meanwhile)
+//
+// Inputs       : cart - the cartridge to zero
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int zero_this_cart(CartridgeIndex cart) {
+	CartXferRegister resp;
+
+	resp = request_cart_frames(cart, create_cart_opcode(CART_OP_BZERO, 0, 0, 0, 0, 0), NULL);
+	if (extract_cart_opcode(resp, CART_REG_RT1) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nError zeroing catridge: %u \n", cart);
+		return (-1);
+	}
+	cartZeroed[cart] = YES;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : reset_file_table
+// Description  : Mark every frame of the file table unused, clearing the
+//                first cart's row and copying it over the others
+//
+// Inputs       : none
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void reset_file_table(void) {
+
+	// Local Variables
+	int		i = 0;
+
+	for (i = 0; i < CART_CARTRIDGE_SIZE; i++) {
+		fileTable[0][i].filehandle = -1;      // Unused/invalid file handles will be negative numbers
+		fileTable[0][i].isused = NO;          // Initialize all table slots in CART memory to not used
+	}
+	for (i = 1; i < CART_MAX_CARTRIDGES; i++)
+		memcpy(fileTable[i], fileTable[0], sizeof(fileTable[0]));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_frame_run
+// Description  : Return a run of frames within one cart to the free-frame
+//                bitmap and file table
+//
+// Inputs       : cart - the cartridge of the run
+//                frame - the first frame of the run
+//                length - the number of frames in the run
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void free_frame_run(CartridgeIndex cart, CartFrameIndex frame, uint32_t length) {
+
+	// Local Variables
+	uint32_t	i = 0;
+
+	pthread_mutex_lock(&allocLock);
+	for (i = frame; i < frame + length; i++) {
+		if (!(frameBitmap[cart][i / 64] & (1ULL << (i % 64)))) {
+			frameBitmap[cart][i / 64] |= (1ULL << (i % 64));
+			fileTable[cart][i].isused = NO;
+			cartFreeFrames[cart]++;
+			freeFrames++;
+			driverStats.framesFreed++;
+		}
+	}
+	pthread_mutex_unlock(&allocLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_file_frames
+// Description  : Read a file frame missing from the cache and cache it, then
+//                start reading the file's readahead window after it in the
+//                background
+//
+// Inputs       : fd - the file being read
+//                piece - the file frame wanted now
+//                buf - buffer receiving the wanted frame
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int read_file_frames(int16_t fd, uint32_t piece, void *buf) {
+
+	// Local Variables
+	CartXferRegister	resp = 0;
+	CartridgeIndex		the_cart = 0;
+	CartFrameIndex		the_frame = 0;
+
+	if (find_file_frame(fd, piece, &the_cart, &the_frame) != 0)
+		return (-1);
+	resp = request_cart_frames(the_cart, create_cart_opcode(CART_OP_RDFRME, 0, 0, 0, the_frame, 0), buf);
+	if (extract_cart_opcode(resp, CART_REG_RT1) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nCartridge reading failed in read_file_frames\n");
+		return (-1);
+	}
+	if (put_cart_cache(the_cart, the_frame, buf) != 0)
+		return (-1);
+
+	// Return successfully
+	return (start_read_ahead(fd, piece + 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : start_read_ahead
+// Description  : Queue reads of the uncached frames of the file's readahead
+//                window on the bus without waiting for them, a run of
+//                consecutive frames per request; they are cached by
+//                reap_read_ahead once they arrive
+//
+// Inputs       : fd - the file being read
+//                piece - the first file frame to read ahead
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int start_read_ahead(int16_t fd, uint32_t piece) {
+
+	// Local Variables
+	int					i = 0;
+	int					slot = 0;
+	int					count = 0;									// frames of the window not cached
+	int					first = 0;									// first of them in the run being queued
+	int					length = 0;									// frames in the run being queued
+	int					result = 0;
+	uint32_t			last = piece + fileSystem[fd].readAhead;	// file frame just past the window
+	CartridgeIndex		carts[CART_READAHEAD_MAX];
+	CartFrameIndex		frames[CART_READAHEAD_MAX];
+
+	// Read ahead no further than the end of the file
+	if (last > get_file_frames(fd))
+		last = get_file_frames(fd);
+
+	// Frames already cached (possibly dirty) are left as they are; the cache is probed before
+	// taking the cart lock, as it takes that lock itself to write back
+	for (; piece < last && count < CART_READAHEAD_MAX; piece++) {
+		if (find_file_frame(fd, piece, &carts[count], &frames[count]) != 0)
+			return (-1);
+		if (peek_cart_cache(carts[count], frames[count]) == NULL)
+			count++;
+	}
+
+	pthread_mutex_lock(&cartLock);
+	for (first = 0; first < count && result == 0; first += length) {
+		length = 1;
+
+		// Frames on their way already are left as they are
+		if (find_read_ahead(carts[first], frames[first]) != -1)
+			continue;
+		for (slot = 0; slot < CART_READAHEAD_SLOTS && readAheadSlots[slot].inflight == YES; slot++)
+			;
+		if (slot == CART_READAHEAD_SLOTS)
+			break;
+
+		// Grow the run over the following frames while they carry on in the same cart into free slots
+		while (first + length < count && length < CART_MAX_RUN_FRAMES && slot + length < CART_READAHEAD_SLOTS &&
+				readAheadSlots[slot + length].inflight != YES && carts[first + length] == carts[first] &&
+				frames[first + length] == frames[first] + length && find_read_ahead(carts[first], frames[first] + length) == -1)
+			length++;
+
+		// Queue a load whenever the frames move to another cart, then the run's read
+		if (carts[first] != loadedCart) {
+			if (client_cart_bus_submit(create_cart_opcode(CART_OP_LDCART, 0, 0, carts[first], 0, 0), NULL,
+					complete_read_ahead, NULL) != 0) {
+				loadedCart = CART_NO_CARTRIDGE;
+				result = -1;
+				break;
+			}
+			loadedCart = carts[first];
+		}
+		for (i = 0; i < length; i++) {
+			readAheadSlots[slot + i].cart = carts[first];
+			readAheadSlots[slot + i].frame = frames[first] + i;
+			readAheadSlots[slot + i].inflight = YES;
+			readAheadSlots[slot + i].done = NO;
+			readAheadSlots[slot + i].length = 0;
+		}
+		readAheadSlots[slot].length = length;
+		if (client_cart_bus_submit(create_cart_opcode((length > 1) ? CART_OP_RDFRMS : CART_OP_RDFRME, 0, 0, 0, frames[first],
+				(length > 1) ? length : 0), readAheadData[slot], complete_read_ahead, &readAheadSlots[slot]) != 0) {
+			for (i = 0; i < length; i++)
+				readAheadSlots[slot + i].inflight = NO;
+			result = -1;
+		}
+	}
+	pthread_mutex_unlock(&cartLock);
+
+	// Get the reads on their way
+	return ((result != 0 || client_cart_bus_poll(0) < 0) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : complete_read_ahead
+// Description  : Bus completion callback of a read ahead request
+//
+// Inputs       : tag - the first read ahead slot of the run (NULL for a cart load)
+//                resp - the response registers
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void complete_read_ahead(void *tag, CartXferRegister resp) {
+
+	// Local Variables
+	uint32_t			i = 0;
+	ReadAheadSlot		*slot = (ReadAheadSlot *)tag;
+
+	// Runs on whichever thread progresses the bus, so the flags are published atomically
+	if (extract_cart_opcode(resp, CART_REG_RT1) != 0)
+		__atomic_store_n(&readAheadFailed, YES, __ATOMIC_RELEASE);
+	for (i = 0; slot != NULL && i < slot->length; i++) {
+		slot[i].resp = resp;
+		__atomic_store_n(&slot[i].done, YES, __ATOMIC_RELEASE);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : reap_read_ahead
+// Description  : Cache the read ahead frames that have arrived.  Read ahead is
+//                only a hint, so frames that failed (or were read after a
+//                failed request) are dropped rather than reported.
+//
+// Inputs       : wait - YES to wait for every read ahead frame in flight
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int reap_read_ahead(Flag wait) {
+
+	// Local Variables
+	int		i = 0;
+	int		count = 0;
+	int		result = 0;
+	int		ready[CART_READAHEAD_SLOTS];		// slots whose frames arrived, being cached by this call
+	Flag	pending = NO;
+	Flag	failed = NO;
+
+	if (((wait == YES) ? client_cart_bus_drain() : client_cart_bus_poll(0)) < 0)
+		__atomic_store_n(&readAheadFailed, YES, __ATOMIC_RELEASE);
+
+	// Take the slots that have arrived
+	pthread_mutex_lock(&cartLock);
+	for (i = 0; i < CART_READAHEAD_SLOTS; i++) {
+		if (readAheadSlots[i].inflight != YES || readAheadSlots[i].reaping == YES)
+			continue;
+		if (__atomic_load_n(&readAheadSlots[i].done, __ATOMIC_ACQUIRE) != YES) {
+			pending = YES;
+			continue;
+		}
+		readAheadSlots[i].reaping = YES;
+		ready[count++] = i;
+	}
+	failed = __atomic_load_n(&readAheadFailed, __ATOMIC_ACQUIRE);
+	pthread_mutex_unlock(&cartLock);
+
+	// Cache them with the cart lock released (caching may write back dirty frames through it)
+	for (i = 0; i < count && result == 0; i++) {
+		if (failed != YES && peek_cart_cache(readAheadSlots[ready[i]].cart, readAheadSlots[ready[i]].frame) == NULL &&
+				put_cart_cache(readAheadSlots[ready[i]].cart, readAheadSlots[ready[i]].frame, readAheadData[ready[i]]) != 0)
+			result = -1;
+	}
+
+	pthread_mutex_lock(&cartLock);
+	for (i = 0; i < count; i++) {
+		readAheadSlots[ready[i]].reaping = NO;
+		readAheadSlots[ready[i]].inflight = NO;
+	}
+
+	// The controller's state is unknown after a failure, start over once nothing is in flight
+	if (failed == YES && pending == NO) {
+		loadedCart = CART_NO_CARTRIDGE;
+		__atomic_store_n(&readAheadFailed, NO, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&cartLock);
+
+	// Return successfully
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_read_ahead
+// Description  : Find the read ahead slot holding a frame not yet cached
+//                (with the cart lock held)
+//
+// Inputs       : cart - the cartridge of the frame
+//                frame - the frame
+// Outputs      : slot number, -1 if the frame is not being read ahead
+//
+////////////////////////////////////////////////////////////////////////////////
+int find_read_ahead(CartridgeIndex cart, CartFrameIndex frame) {
+
+	// Local Variables
+	int		i = 0;
+
+	for (i = 0; i < CART_READAHEAD_SLOTS; i++) {
+		if (readAheadSlots[i].inflight == YES && readAheadSlots[i].cart == cart && readAheadSlots[i].frame == frame)
+			return (i);
+	}
+	return (-1);
+}
+
+int allocateNewFile(void){
+    
+    // Local Variables
+    int i = 0;
+    int origFileCount = numFiles;
+    int capacity = 0;
+    FileSystem *grown = NULL;
+
+    // Each file has its own lock, so there can be no more files than locks
+    if (numFiles >= CART_MAX_TOTAL_FILES) {
+        logMessage(LOG_ERROR_LEVEL, "\nCannot allocate more than %d files\n", CART_MAX_TOTAL_FILES);
+        return (-1);
+    }
+
+    // Grow the file system heap memory geometrically when full
+    if (numFiles == fileCapacity) {
+        capacity = (fileCapacity > 0) ? fileCapacity * 2 : 16;
+        if (capacity > CART_MAX_TOTAL_FILES)
+            capacity = CART_MAX_TOTAL_FILES;
+        grown = realloc(fileSystem, sizeof(FileSystem)*capacity);
+        if (grown == NULL) {
+            logMessage(LOG_ERROR_LEVEL, "\nUnable to grow the file system in allocateNewFile\n");
+            return (-1);
+        }
+        fileSystem = grown;
+        fileCapacity = capacity;
+    }
+    numFiles++;
+
+    // Initialize new memory allocated for the additional one file added
+    for(i = origFileCount; i < numFiles; i++){
+        strncpy(fileSystem[i].filename, "", CART_MAX_PATH_LENGTH);      // Initialize the filename for each instance of FileState struct to '\0'
+        fileSystem[i].filehandle    =   -1;          // Unused/invalid file handles will be negative numbers
+        fileSystem[i].fileposition  =    0;          // Initialize default file position to zero
+        fileSystem[i].filelength    =    0;          // Initialize default file size to zero     
+        fileSystem[i].openfile      =   NO;          // Initalize all files to not open status
+        fileSystem[i].incart        =   NO;          // Initialze all files to not incast status
+        fileSystem[i].stored        =   NO;          // Initialize all files to not stored
+        fileSystem[i].cartIndex     =    0;          // Initialize default cartridge the file exists in to 0
+        fileSystem[i].frameIndex    =    0;          // Initialize default frame the file exists in to 0    
+        fileSystem[i].extents       = NULL;          // Initialize the file to hold no frames
+        fileSystem[i].extentCount   =    0;
+        fileSystem[i].extentCapacity =   0;
+        fileSystem[i].readEnd       =    0;          // Initialize the file to have no sequential reader
+        fileSystem[i].readAhead     =    0;
+        fileSystem[i].nextFile      = CART_NO_FILE;  // Initialize the file to be in no chain
+    }
+
+    // Return successfully
+    return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hash_file_name
+// Description  : Pick the directory bucket of a filename (FNV-1a, as the
+//                metadata checksums)
+//
+// Inputs       : path - the filename
+// Outputs      : the bucket
+//
+////////////////////////////////////////////////////////////////////////////////
+uint32_t hash_file_name(const char *path) {
+	return (meta_checksum(path, strlen(path)) & (CART_DIRECTORY_BUCKETS - 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_file_name
+// Description  : Find the stored file of a filename through the directory
+//
+// Inputs       : path - the filename
+// Outputs      : the file handle, CART_NO_FILE if no file has the name
+//
+////////////////////////////////////////////////////////////////////////////////
+int16_t find_file_name(const char *path) {
+
+	// Local Variables
+	int16_t		fd = fileDirectory[hash_file_name(path)];
+
+	while (fd != CART_NO_FILE && strncmp(path, fileSystem[fd].filename, CART_MAX_PATH_LENGTH) != 0)
+		fd = fileSystem[fd].nextFile;
+	return (fd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : insert_file_name
+// Description  : Add a file to the directory under its filename
+//
+// Inputs       : fd - the file
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void insert_file_name(int16_t fd) {
+
+	// Local Variables
+	uint32_t	bucket = hash_file_name(fileSystem[fd].filename);
+
+	fileSystem[fd].nextFile = fileDirectory[bucket];
+	fileDirectory[bucket] = fd;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : remove_file_name
+// Description  : Take a file out of the directory (before its name is cleared)
+//
+// Inputs       : fd - the file
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void remove_file_name(int16_t fd) {
+
+	// Local Variables
+	int16_t		*link = &fileDirectory[hash_file_name(fileSystem[fd].filename)];
+
+	while (*link != CART_NO_FILE && *link != fd)
+		link = &fileSystem[*link].nextFile;
+	if (*link == fd)
+		*link = fileSystem[fd].nextFile;
+	fileSystem[fd].nextFile = CART_NO_FILE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : take_free_file
+// Description  : Take a free file handle, reusing the last one closed or
+//                growing the file system when none is free
+//
+// Inputs       : none
+// Outputs      : the file handle, CART_NO_FILE if there are no more
+//
+////////////////////////////////////////////////////////////////////////////////
+int16_t take_free_file(void) {
+
+	// Local Variables
+	int16_t		fd = freeFileHead;
+
+	if (fd == CART_NO_FILE) {
+		if (allocateNewFile() != 0)
+			return (CART_NO_FILE);
+		return (numFiles - 1);
+	}
+	freeFileHead = fileSystem[fd].nextFile;
+	fileSystem[fd].nextFile = CART_NO_FILE;
+	return (fd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : rebuild_file_directory
+// Description  : Index the stored files by filename and put every other
+//                handle on the free list (lowest handles are handed out first)
+//
+// Inputs       : none
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void rebuild_file_directory(void) {
+
+	// Local Variables
+	int		i = 0;
+
+	memset(fileDirectory, 0xff, sizeof(fileDirectory));		// every bucket CART_NO_FILE
+	freeFileHead = CART_NO_FILE;
+	for (i = numFiles - 1; i >= 0; i--) {
+		if (fileSystem[i].stored == YES) {
+			insert_file_name(i);
+		} else {
+			fileSystem[i].nextFile = freeFileHead;
+			freeFileHead = i;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : meta_checksum
+// Description  : Checksum metadata read back from the cart (FNV-1a)
+//
+// Inputs       : data - the bytes to checksum
+//                size - the number of bytes
+// Outputs      : the checksum
+//
+////////////////////////////////////////////////////////////////////////////////
+uint32_t meta_checksum(const void *data, size_t size) {
+
+	// Local Variables
+	const unsigned char	*bytes = (const unsigned char *)data;
+	uint32_t			sum = 2166136261U;
+	size_t				i = 0;
+
+	for (i = 0; i < size; i++) {
+		sum ^= bytes[i];
+		sum *= 16777619U;
+	}
+	return (sum);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : reserve_meta_frames
+// Description  : Take the frames of the metadata store out of the free frame
+//                bitmap (the metadata cart is zeroed when formatted)
+//
+// Inputs       : none
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void reserve_meta_frames(void) {
+
+	// Local Variables
+	uint32_t	i = 0;
+
+	for (i = 0; i < CART_META_FRAMES; i++)
+		frameBitmap[CART_META_CART][i / 64] &= ~(1ULL << (i % 64));
+	cartFreeFrames[CART_META_CART] -= CART_META_FRAMES;
+	freeFrames -= CART_META_FRAMES;
+	cartZeroed[CART_META_CART] = YES;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : format_meta_store
+// Description  : Start an empty metadata store: zero the metadata cart and
+//                write an empty checkpoint
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int format_meta_store(void) {
+
+	if (zero_this_cart(CART_META_CART) != 0)
+		return (-1);
+	reserve_meta_frames();
+
+	// The first checkpoint lands in region 0 as generation 1
+	metaGeneration = 0;
+	metaRegion = 1;
+	return (checkpoint_meta_store());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mount_meta_store
+// Description  : Recreate the files of the metadata store left in CART
+//                memory: replay the last checkpoint, then the journal written
+//                since, then checkpoint the result so the journal starts over
+//
+// Inputs       : none
+// Outputs      : 0 if mounted, 1 if there is no store to mount, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int mount_meta_store(void) {
+
+	// Local Variables
+	int					result = 0;
+	uint32_t			i = 0;
+	uint32_t			sum = 0;
+	char				*buf = NULL;
+	char				*frame = NULL;
+	CartSuperblock		super;
+	CartJournalHeader	header;
+
+	// Look for a superblock this driver wrote
+	if ((buf = malloc(CART_META_CHECKPOINT_FRAMES * CART_FRAME_SIZE)) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "\nUnable to allocate a buffer to mount the metadata store\n");
+		return (-1);
+	}
+	if (read_meta_frames(CART_META_SUPERBLOCK, 1, buf) != 0) {
+		free(buf);
+		return (-1);
+	}
+	memcpy(&super, buf, sizeof(CartSuperblock));
+	if (super.magic != CART_META_MAGIC || super.version != CART_META_VERSION || super.region > 1 ||
+			super.checkpointBytes > CART_META_CHECKPOINT_FRAMES * CART_FRAME_SIZE ||
+			super.checksum != meta_checksum(&super, offsetof(CartSuperblock, checksum))) {
+		logMessage(LOG_INFO_LEVEL, "\nNo metadata store found in CART memory, formatting\n");
+		free(buf);
+		return (1);
+	}
+	reserve_meta_frames();
+
+	// Replay the checkpoint
+	if (read_meta_frames(CART_META_CHECKPOINT(super.region), (super.checkpointBytes + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE, buf) != 0 ||
+			meta_checksum(buf, super.checkpointBytes) != super.checkpointSum ||
+			replay_meta_records(buf, super.checkpointBytes) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nBad checkpoint %lu in the metadata store\n", (unsigned long)super.generation);
+		free(buf);
+		return (-1);
+	}
+	metaGeneration = super.generation;
+	metaRegion = super.region;
+
+	// Then the journal frames written after it, up to the first left from an earlier generation
+	if (read_meta_frames(CART_META_JOURNAL, CART_META_JOURNAL_FRAMES, buf) != 0) {
+		free(buf);
+		return (-1);
+	}
+	for (i = 0; i < CART_META_JOURNAL_FRAMES && result == 0; i++) {
+		frame = &buf[i * CART_FRAME_SIZE];
+		memcpy(&header, frame, sizeof(CartJournalHeader));
+		sum = header.checksum;
+		header.checksum = 0;
+		memcpy(frame, &header, sizeof(CartJournalHeader));
+		if (header.generation != metaGeneration || header.sequence != i ||
+				header.bytes > CART_FRAME_SIZE - sizeof(CartJournalHeader) ||
+				meta_checksum(frame, sizeof(CartJournalHeader) + header.bytes) != sum)
+			break;
+		result = replay_meta_records(&frame[sizeof(CartJournalHeader)], header.bytes);
+	}
+	free(buf);
+	if (result != 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nBad journal frame %u in the metadata store\n", i - 1);
+		return (-1);
+	}
+	logMessage(LOG_INFO_LEVEL, "\nMounted the metadata store: checkpoint %lu and %u journal frames\n",
+			(unsigned long)metaGeneration, i);
+	rebuild_file_directory();
+
+	// Fold the journal into a new checkpoint
+	return ((checkpoint_meta_store() == 0) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : read_meta_frames
+// Description  : Read consecutive frames of the metadata cart, a run at a time
+//
+// Inputs       : first - the first frame
+//                frames - the number of frames
+//                buf - the buffer to read them into
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int read_meta_frames(CartFrameIndex first, uint32_t frames, char *buf) {
+
+	// Local Variables
+	uint32_t			i = 0;
+	uint32_t			count = 0;
+	CartXferRegister	resp = 0;
+
+	for (i = 0; i < frames; i += count) {
+		count = (frames - i > CART_MAX_RUN_FRAMES) ? CART_MAX_RUN_FRAMES : frames - i;
+		resp = request_cart_frames(CART_META_CART, create_cart_opcode((count > 1) ? CART_OP_RDFRMS : CART_OP_RDFRME,
+				0, 0, 0, first + i, (count > 1) ? count : 0), &buf[i * CART_FRAME_SIZE]);
+		if (extract_cart_opcode(resp, CART_REG_RT1) != 0) {
+			logMessage(LOG_ERROR_LEVEL, "\nError reading frame %u of the metadata store\n", first + i);
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_meta_records
+// Description  : Apply a stream of metadata records in order
+//
+// Inputs       : records - the record stream
+//                bytes - the length of the stream
+// Outputs      : 0 if successful, -1 if the stream is malformed
+//
+////////////////////////////////////////////////////////////////////////////////
+int replay_meta_records(const char *records, uint32_t bytes) {
+
+	// Local Variables
+	uint32_t		used = 0;
+	CartMetaRecord	record;
+
+	while (used < bytes) {
+		if (bytes - used < sizeof(CartMetaRecord))
+			return (-1);
+		memcpy(&record, &records[used], sizeof(CartMetaRecord));
+		if (bytes - used - sizeof(CartMetaRecord) < record.size ||
+				apply_meta_record(&record, &records[used + sizeof(CartMetaRecord)]) != 0)
+			return (-1);
+		used += sizeof(CartMetaRecord) + record.size;
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : apply_meta_record
+// Description  : Apply one metadata record to the file system being mounted;
+//                files come back closed, in the slots they were stored from
+//
+// Inputs       : record - the record
+//                name - the filename following a CREATE
+// Outputs      : 0 if successful, -1 if the record is malformed
+//
+////////////////////////////////////////////////////////////////////////////////
+int apply_meta_record(CartMetaRecord *record, const char *name) {
+
+	// Local Variables
+	uint32_t	i = 0;
+	uint32_t	frame = 0;
+	FileSystem	*file = NULL;
+
+	if (record->slot >= CART_MAX_TOTAL_FILES)
+		return (-1);
+	while (record->slot >= numFiles) {
+		if (allocateNewFile() != 0)
+			return (-1);
+	}
+	file = &fileSystem[record->slot];
+
+	switch (record->type) {
+	case CART_META_CREATE:
+		if (file->stored == YES || record->size == 0 || record->size >= CART_MAX_PATH_LENGTH)
+			return (-1);
+		memcpy(file->filename, name, record->size);
+		file->filename[record->size] = '\0';
+		file->stored = YES;
+		break;
+
+	case CART_META_EXTENT:
+		if (file->stored != YES || record->cart >= CART_MAX_CARTRIDGES || record->length == 0 ||
+				record->frame + record->length > CART_CARTRIDGE_SIZE)
+			return (-1);
+
+		// Take the run's frames from the free frame bitmap; a frame can only belong to one file
+		for (i = 0; i < record->length; i++) {
+			frame = record->frame + i;
+			if (!(frameBitmap[record->cart][frame / 64] & (1ULL << (frame % 64))))
+				return (-1);
+			frameBitmap[record->cart][frame / 64] &= ~(1ULL << (frame % 64));
+			cartFreeFrames[record->cart]--;
+			freeFrames--;
+			fileTable[record->cart][frame].filehandle = record->slot;
+			fileTable[record->cart][frame].isused = YES;
+			if (append_file_extent(record->slot, record->cart, frame) != 0)
+				return (-1);
+		}
+		if (file->incart != YES) {
+			file->cartIndex = record->cart;
+			file->frameIndex = record->frame;
+			file->incart = YES;
+		}
+		cartZeroed[record->cart] = YES;
+		break;
+
+	case CART_META_LENGTH:
+		if (file->stored != YES || record->length > get_file_frames(record->slot) * CART_FRAME_SIZE)
+			return (-1);
+		file->filelength = record->length;
+		break;
+
+	case CART_META_DELETE:
+		if (file->stored != YES)
+			return (-1);
+		release_file_extents(record->slot);
+		*(file->filename) = '\0';
+		file->filelength = 0;
+		file->incart = NO;
+		file->stored = NO;
+		break;
+
+	default:
+		return (-1);
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pack_meta_record
+// Description  : Append a record (and the filename of a CREATE) to a buffer
+//
+// Inputs       : buf - the buffer
+//                used - bytes of the buffer in use, advanced past the record
+//                size - the size of the buffer
+//                record - the record
+//                name - the filename of a CREATE (NULL otherwise)
+// Outputs      : 0 if successful, -1 if the record does not fit
+//
+////////////////////////////////////////////////////////////////////////////////
+int pack_meta_record(char *buf, uint32_t *used, uint32_t size, CartMetaRecord *record, const char *name) {
+
+	if (size - *used < sizeof(CartMetaRecord) + record->size)
+		return (-1);
+	memcpy(&buf[*used], record, sizeof(CartMetaRecord));
+	if (record->size > 0)
+		memcpy(&buf[*used + sizeof(CartMetaRecord)], name, record->size);
+	*used += sizeof(CartMetaRecord) + record->size;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : checkpoint_meta_store
+// Description  : Write every stored file to the checkpoint region not holding
+//                the last checkpoint, then point the superblock at it and
+//                start the journal over (with the journal locked, or powered
+//                on or off by a single caller)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int checkpoint_meta_store(void) {
+
+	// Local Variables
+	int				i = 0;
+	int				result = 0;
+	uint32_t		j = 0;
+	uint32_t		bytes = 0;
+	uint32_t		count = 0;
+	uint32_t		frames = 0;
+	uint32_t		region = 1 - metaRegion;
+	char			*stream = NULL;
+	char			frame[CART_FRAME_SIZE];
+	CartSuperblock	super;
+	CartMetaRecord	record;
+
+	if ((stream = calloc(CART_META_CHECKPOINT_FRAMES, CART_FRAME_SIZE)) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "\nUnable to allocate a buffer to checkpoint the metadata store\n");
+		return (-1);
+	}
+
+	// Describe each stored file by the records that would recreate it
+	for (i = 0; i < numFiles && result == 0; i++) {
+		if (fileSystem[i].stored != YES)
+			continue;
+		memset(&record, 0x0, sizeof(CartMetaRecord));
+		record.slot = i;
+		record.type = CART_META_CREATE;
+		record.size = strlen(fileSystem[i].filename);
+		result = pack_meta_record(stream, &bytes, CART_META_CHECKPOINT_FRAMES * CART_FRAME_SIZE, &record, fileSystem[i].filename);
+		record.size = 0;
+		for (j = 0; j < fileSystem[i].extentCount && result == 0; j++) {
+			record.type = CART_META_EXTENT;
+			record.cart = fileSystem[i].extents[j].cart;
+			record.frame = fileSystem[i].extents[j].frame;
+			record.length = fileSystem[i].extents[j].length;
+			result = pack_meta_record(stream, &bytes, CART_META_CHECKPOINT_FRAMES * CART_FRAME_SIZE, &record, NULL);
+		}
+		record.type = CART_META_LENGTH;
+		record.length = fileSystem[i].filelength;
+		if (result == 0)
+			result = pack_meta_record(stream, &bytes, CART_META_CHECKPOINT_FRAMES * CART_FRAME_SIZE, &record, NULL);
+	}
+	if (result != 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nThe files no longer fit in a checkpoint of the metadata store\n");
+		free(stream);
+		return (-1);
+	}
+
+	// Write the checkpoint, then the superblock naming it
+	frames = (bytes + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE;
+	for (j = 0; j < frames && result == 0; j += count) {
+		count = (frames - j > CART_MAX_RUN_FRAMES) ? CART_MAX_RUN_FRAMES : frames - j;
+		result = write_frame_run(CART_META_CART, CART_META_CHECKPOINT(region) + j, count, &stream[j * CART_FRAME_SIZE]);
+	}
+	memset(&super, 0x0, sizeof(CartSuperblock));
+	super.magic = CART_META_MAGIC;
+	super.version = CART_META_VERSION;
+	super.region = region;
+	super.generation = metaGeneration + 1;
+	super.checkpointBytes = bytes;
+	super.checkpointSum = meta_checksum(stream, bytes);
+	super.checksum = meta_checksum(&super, offsetof(CartSuperblock, checksum));
+	memset(frame, 0x0, CART_FRAME_SIZE);
+	memcpy(frame, &super, sizeof(CartSuperblock));
+	free(stream);
+	if (result != 0 || write_this_frame(CART_META_CART, CART_META_SUPERBLOCK, frame) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nError writing checkpoint %lu of the metadata store\n", (unsigned long)super.generation);
+		return (-1);
+	}
+
+	// Journal frames of the old generation are ignored from now on
+	metaGeneration = super.generation;
+	metaRegion = region;
+	memset(journalFrame, 0x0, CART_FRAME_SIZE);
+	journalSequence = 0;
+	journalBytes = sizeof(CartJournalHeader);
+	journalLast = 0;
+	journalDirty = NO;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : log_meta_record
+// Description  : Append a record to the journal (with the journal locked),
+//                folding it into the last record when it carries on the same
+//                file's run or replaces its length; a full journal is folded
+//                into a checkpoint instead
+//
+// Inputs       : record - the record, already applied to the file system
+//                name - the filename of a CREATE (NULL otherwise)
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int log_meta_record(CartMetaRecord *record, const char *name) {
+
+	// Local Variables
+	CartMetaRecord	last;
+
+	if (journalLast != 0) {
+		memcpy(&last, &journalFrame[journalLast], sizeof(CartMetaRecord));
+		if (last.type == record->type && last.slot == record->slot &&
+				((record->type == CART_META_LENGTH) ||
+				(record->type == CART_META_EXTENT && last.cart == record->cart && last.frame + last.length == record->frame))) {
+			last.length = (record->type == CART_META_LENGTH) ? record->length : last.length + record->length;
+			memcpy(&journalFrame[journalLast], &last, sizeof(CartMetaRecord));
+			journalDirty = YES;
+			return (0);
+		}
+	}
+
+	// Move on to the next journal frame when this one is full
+	if (CART_FRAME_SIZE - journalBytes < sizeof(CartMetaRecord) + record->size) {
+		if (commit_meta_journal() != 0)
+			return (-1);
+		if (++journalSequence == CART_META_JOURNAL_FRAMES)
+			return (checkpoint_meta_store());
+		memset(journalFrame, 0x0, CART_FRAME_SIZE);
+		journalBytes = sizeof(CartJournalHeader);
+	}
+	journalLast = journalBytes;
+	journalDirty = YES;
+	return (pack_meta_record(journalFrame, &journalBytes, CART_FRAME_SIZE, record, name));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : commit_meta_journal
+// Description  : Write the journal frame being filled to the cart if it has
+//                records not written yet (with the journal locked)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int commit_meta_journal(void) {
+
+	// Local Variables
+	CartJournalHeader	header;
+
+	if (journalDirty != YES)
+		return (0);
+	header.generation = metaGeneration;
+	header.sequence = journalSequence;
+	header.bytes = journalBytes - sizeof(CartJournalHeader);
+	header.checksum = 0;
+	memcpy(journalFrame, &header, sizeof(CartJournalHeader));
+	header.checksum = meta_checksum(journalFrame, journalBytes);
+	memcpy(journalFrame, &header, sizeof(CartJournalHeader));
+	if (write_this_frame(CART_META_CART, CART_META_JOURNAL + journalSequence, journalFrame) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nError writing journal frame %u of the metadata store\n", journalSequence);
+		return (-1);
+	}
+	journalDirty = NO;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_file_create
+// Description  : Journal a file newly stored under its name
+//
+// Inputs       : fd - the file
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int journal_file_create(int16_t fd) {
+
+	// Local Variables
+	int				result = 0;
+	CartMetaRecord	record;
+
+	memset(&record, 0x0, sizeof(CartMetaRecord));
+	record.type = CART_META_CREATE;
+	record.slot = fd;
+	record.size = strlen(fileSystem[fd].filename);
+	pthread_mutex_lock(&journalLock);
+	result = log_meta_record(&record, fileSystem[fd].filename);
+	pthread_mutex_unlock(&journalLock);
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_file_extent
+// Description  : Add a newly allocated frame to the end of a file and journal
+//                it (see append_file_extent)
+//
+// Inputs       : fd - the file the frame was allocated to
+//                cart - the frame's cartridge
+//                frame - the frame number within the cartridge
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int journal_file_extent(int16_t fd, CartridgeIndex cart, CartFrameIndex frame) {
+
+	// Local Variables
+	int				result = 0;
+	CartMetaRecord	record;
+
+	memset(&record, 0x0, sizeof(CartMetaRecord));
+	record.type = CART_META_EXTENT;
+	record.slot = fd;
+	record.cart = cart;
+	record.frame = frame;
+	record.length = 1;
+	pthread_mutex_lock(&journalLock);
+	result = append_file_extent(fd, cart, frame);
+	if (result == 0)
+		result = log_meta_record(&record, NULL);
+	pthread_mutex_unlock(&journalLock);
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_file_length
+// Description  : Set a file's length and journal it
+//
+// Inputs       : fd - the file
+//                length - its new length in bytes
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int journal_file_length(int16_t fd, uint32_t length) {
+
+	// Local Variables
+	int				result = 0;
+	CartMetaRecord	record;
+
+	memset(&record, 0x0, sizeof(CartMetaRecord));
+	record.type = CART_META_LENGTH;
+	record.slot = fd;
+	record.length = length;
+	pthread_mutex_lock(&journalLock);
+	fileSystem[fd].filelength = length;
+	result = log_meta_record(&record, NULL);
+	pthread_mutex_unlock(&journalLock);
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : journal_file_delete
+// Description  : Free a file's frames and drop it from the store, then
+//                journal it, writing the journal out so the frames are not
+//                handed back on a later mount.  The file is gone before the
+//                record is logged, so a checkpoint taken for a full journal
+//                leaves it out.
+//
+// Inputs       : fd - the file
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int journal_file_delete(int16_t fd) {
+
+	// Local Variables
+	int				result = 0;
+	CartMetaRecord	record;
+
+	memset(&record, 0x0, sizeof(CartMetaRecord));
+	record.type = CART_META_DELETE;
+	record.slot = fd;
+	pthread_mutex_lock(&journalLock);
+	release_file_extents(fd);
+	fileSystem[fd].stored = NO;
+	fileSystem[fd].filelength = 0;
+	fileSystem[fd].incart = NO;
+	result = log_meta_record(&record, NULL);
+	if (result == 0)
+		result = commit_meta_journal();
+	pthread_mutex_unlock(&journalLock);
+	return (result);
+}
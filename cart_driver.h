@@ -13,14 +13,44 @@
 
 // Include files
 #include <stdint.h>
+#include <sys/uio.h>
 
 // Defines
 #define CART_MAX_TOTAL_FILES 1024 // Maximum number of files ever
 #define CART_MAX_PATH_LENGTH 128 // Maximum length of filename length
 
+// What cart_poweron does with the metadata store in CART memory
+typedef enum {
+	CART_POWERON_FORMAT = 0, // Start with an empty store
+	CART_POWERON_MOUNT  = 1, // Mount the files left open by the last poweroff (or journaled since), format if there is no store
+} CartPoweronModes;
+
+// How cart_mmap maps a file
+typedef enum {
+	CART_MAP_READONLY = 0, // Pages can only be read
+	CART_MAP_PRIVATE  = 1, // Pages can be written, copy on write (changes never reach the file)
+} CartMapModes;
+
+// What the driver has counted since the program started (times in ns)
+typedef struct {
+	uint64_t reads;           // cart_read and cart_preadv calls (and cart_mmap prefaults)
+	uint64_t bytesRead;       // bytes they returned
+	uint64_t readTime;        // time spent in them
+	uint64_t writes;          // cart_write and cart_pwritev calls
+	uint64_t bytesWritten;    // bytes they wrote
+	uint64_t writeTime;       // time spent in them
+	uint64_t runsAllocated;   // runs of frames handed out by the allocator
+	uint64_t framesAllocated; // frames in those runs
+	uint64_t framesFreed;     // frames given back by closed files
+	uint64_t allocTime;       // time spent allocating (cart zeroing included)
+} CartDriverStats;
+
 //
 // Interface functions
 
+int32_t set_cart_poweron_mode(CartPoweronModes mode);
+	// Select whether cart_poweron formats or mounts the store (must be called before poweron)
+
 int32_t cart_poweron(void);
 	// Startup up the CART interface, initialize filesystem
 
@@ -42,6 +72,21 @@ int32_t cart_write(int16_t fd, void *buf, int32_t count);
 int32_t cart_seek(int16_t fd, uint32_t loc);
 	// Seek to specific point in the file
 
+int32_t cart_preadv(int16_t fd, const struct iovec *iov, int iovcnt, uint32_t offset);
+	// Reads from "offset" in the file into the buffers of "iov", leaving the file position alone
+
+int32_t cart_pwritev(int16_t fd, const struct iovec *iov, int iovcnt, uint32_t offset);
+	// Writes the buffers of "iov" at "offset" (at most the file length), leaving the file position alone
+
+void *cart_mmap(int16_t fd, uint32_t offset, uint32_t length, CartMapModes mode);
+	// Maps "length" bytes of the file from "offset" into memory, prefaulted (a snapshot of the file)
+
+int32_t cart_munmap(void *addr, uint32_t length);
+	// Removes a mapping made by cart_mmap
+
+int32_t get_cart_driver_stats(CartDriverStats *stats);
+	// Copy out what the driver has counted so far
+
 
 #endif
 
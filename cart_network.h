@@ -20,11 +20,88 @@
 #define CART_NET_HEADER_SIZE sizeof(CartXferRegister)
 #define CART_DEFAULT_IP "127.0.0.1"
 #define CART_DEFAULT_PORT 21785
+#define CART_MAX_BATCH 64       // requests sent by one writev
+#define CART_BUS_QUEUE 256      // requests the bus engine can hold in flight per server
+#define CART_MAX_SERVERS 8      // servers the cartridges can be striped over
+#define CART_MAX_RUN_FRAMES 32  // frames moved by one RDFRMS/WRFRMS
+#define CART_RECV_BUFFER (2 * (CART_NET_HEADER_SIZE + CART_NET_ENCODED_MAX(CART_MAX_RUN_FRAMES)))  // responses taken by one read
+#define CART_SOCKET_BUFFER (CART_BUS_QUEUE * (CART_NET_HEADER_SIZE + CART_FRAME_SIZE))  // kernel socket buffer size
+
+/*
+
+ Network protocol
+
+ A request is the 8 byte CartXferRegister in network byte order, followed by
+ the frame for WRFRME.  The response is the 8 byte register, followed by the
+ frame for a successful (RT1 = 0) RDFRME.  Responses come back in request order.
+
+ Multi-frame extension: RDFRMS and WRFRMS move the run of frames FM1 ..
+ FM1 + n - 1 of the loaded cartridge, n being the request's bits 0-14 (at most
+ CART_MAX_RUN_FRAMES, within the cartridge).  A WRFRMS request carries the n
+ frames, a successful RDFRMS response returns them.  The client sets
+ CART_NET_CAP_MULTIFRAME in bits 0-14 of its INITMS and a server that supports
+ the extension echoes it in its response; servers clear those bits, so the
+ client falls back to one RDFRME/WRFRME per frame without it.
+
+ Compression extension: negotiated the same way with CART_NET_CAP_COMPRESS.
+ Once the server has echoed it, every frame carried by a request or response
+ is encoded as a 16 bit length L in network byte order followed by L bytes.
+ L = CART_FRAME_SIZE is the frame as is; otherwise the L bytes are runs, each a
+ 16 bit count in network byte order and the byte repeated count times, adding
+ up to the frame.  The workload frames are mostly one character followed by a
+ zero tail, which is two runs (8 bytes instead of a full frame).
+
+*/
+#define CART_NET_RUN_MASK 0x7fff          // bits holding the frame count / capabilities
+#define CART_NET_CAP_MULTIFRAME 0x0001    // server takes RDFRMS/WRFRMS
+#define CART_NET_CAP_COMPRESS 0x0002      // server takes and sends run length encoded frames
+#define CART_NET_CAPABILITIES (CART_NET_CAP_MULTIFRAME | CART_NET_CAP_COMPRESS)  // extensions the client asks for
+#define CART_NET_FRAME_HEADER 2           // length in front of an encoded frame
+#define CART_NET_RUN_SIZE 3               // count and byte of one run of an encoded frame
+#define CART_NET_ENCODED_MAX(n) ((n) * (CART_NET_FRAME_HEADER + CART_FRAME_SIZE))  // worst case encoding of n frames
+#define CART_BUS_LATENCY_SUB_BITS 4       // latency histogram buckets split each power of two in 16 (about 6% wide)
+#define CART_BUS_LATENCY_BITS 40          // latencies are counted up to 2^40 ns (about 18 minutes)
+#define CART_BUS_LATENCY_BUCKETS ((CART_BUS_LATENCY_BITS - CART_BUS_LATENCY_SUB_BITS + 1) << CART_BUS_LATENCY_SUB_BITS)
+
+// One request of a batch sent to the CART server
+typedef struct CartBusRequest {
+	CartXferRegister  reg;      // request registers for the command
+	void             *buf;      // frame(s) to write from (WRFRME/WRFRMS) or read into (RDFRME/RDFRMS)
+	CartXferRegister  resp;     // response registers, filled in by the batch
+	int              *remaining;  // batch requests still in flight, counted down by the bus
+} CartBusRequest;
+
+// What the bus engine has seen of one opcode since the program started: a
+// request is timed from being queued to its response arriving, and bucketed
+// by the log-linear histogram of cart_bus_latency_bucket
+typedef struct CartBusOpStats {
+	uint64_t  requests;       // requests completed
+	uint64_t  failures;       // of which answered with RT1 set
+	uint64_t  bytesSent;      // bytes of the requests on the wire (registers and frames, as encoded)
+	uint64_t  bytesReceived;  // bytes of the responses on the wire
+	uint64_t  latencyTotal;   // sum of the latencies in ns
+	uint64_t  latencyMax;     // longest latency in ns
+	uint64_t  latency[CART_BUS_LATENCY_BUCKETS];  // requests by latency bucket
+} CartBusOpStats;
+
+// What the bus engine has seen, by opcode
+typedef struct CartBusStats {
+	CartBusOpStats  ops[CART_OP_MAXVAL];
+} CartBusStats;
+
+// Called by the bus engine when the response to a queued request arrives (with
+// the engine locked, so it must not call into the bus itself)
+typedef void (*CartBusCallback)(void *tag, CartXferRegister resp);
+
+// Called at INITMS with one end of a connected socket pair, to serve the carts
+// over it in process (cart_server_loopback on a thread of its own)
+typedef int (*CartBusLoopback)(int sock);
 
 // Global data
 extern int            cart_network_shutdown; // Flag indicating shutdown
 extern unsigned char *cart_network_address;  // Address of CART server
 extern unsigned short cart_network_port;     // Port of CART server
+extern char          *cart_server_store;     // Backing file of the server's cartridges (cart_server.c)
 
 //
 // Functional Prototypes
@@ -32,7 +109,61 @@ extern unsigned short cart_network_port;     // Port of CART server
 CartXferRegister client_cart_bus_request(CartXferRegister reg, void *buf);
 	// This is the implementation of the client operation (cart_client.c)
 
+size_t cart_net_encode_frames(const char *frames, uint32_t count, char *out);
+	// Run length encode count frames into out (room for CART_NET_ENCODED_MAX(count)), returning its size (cart_client.c)
+
+int cart_net_encoded_size(const char *in, size_t avail, uint32_t count, size_t *size);
+	// Size of the count encoded frames at in: 0 if found, 1 if not all within avail bytes yet, -1 if malformed (cart_client.c)
+
+int cart_net_decode_frames(const char *in, uint32_t count, char *frames);
+	// Decode count encoded frames (measured by cart_net_encoded_size) into frames, -1 if malformed (cart_client.c)
+
+int client_cart_bus_servers(const char *addresses, const char *ports);
+	// Set the servers (comma separated addresses and ports) the carts are striped over (cart_client.c)
+
+int client_cart_bus_loopback(CartBusLoopback attach);
+	// Serve the carts in process instead of over the network, through one end of a socket pair given to attach (cart_client.c)
+
+int client_cart_bus_transfer_limit(size_t bytes);
+	// Cut every send and read of the bus to at most bytes (0 for no limit), to test transfers in pieces (cart_client.c)
+
+int client_cart_bus_batch(CartBusRequest *reqs, int count);
+	// Send a batch of requests in order, collecting each response (cart_client.c)
+
+int client_cart_bus_start(CartBusRequest *reqs, int count, int *remaining);
+	// Queue a batch of requests back to back without waiting, counting them in remaining (cart_client.c)
+
+int client_cart_bus_wait(int *remaining);
+	// Wait until the requests of client_cart_bus_start have completed (cart_client.c)
+
+int client_cart_bus_submit(CartXferRegister reg, void *buf, CartBusCallback done, void *tag);
+	// Queue a request without waiting, done is called when it completes (cart_client.c)
+
+int client_cart_bus_poll(int timeout);
+	// Progress queued requests, waiting up to timeout ms; returns number still queued (cart_client.c)
+
+int client_cart_bus_drain(void);
+	// Wait for every queued request to complete (cart_client.c)
+
+int client_cart_bus_stats(CartBusStats *stats);
+	// Copy out what the bus engine has counted so far (cart_client.c)
+
+uint64_t client_cart_bus_requests(void);
+	// Requests the bus engine has completed so far, over every opcode (cart_client.c)
+
+uint64_t client_cart_bus_clock(void);
+	// Monotonic time in ns, the clock the statistics are kept with (cart_client.c)
+
+uint32_t cart_bus_latency_bucket(uint64_t latency);
+	// Histogram bucket counting a latency in ns (cart_client.c)
+
+uint64_t cart_bus_latency_percentile(const CartBusOpStats *op, double percentile);
+	// Latency in ns (upper bound of its bucket) under which percentile % of the requests completed (cart_client.c)
+
 int cart_server( void );
-	// This is the implementation of the server application (cart_server.c)
+	// This is the implementation of the server application, serving the cartridges mapped from cart_server_store (cart_server.c)
+
+int cart_server_loopback(int sock);
+	// Serve the one client connected through sock until it disconnects, on zeroed carts if cart_server_store is NULL (cart_server.c)
 
 #endif
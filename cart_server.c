@@ -0,0 +1,697 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : cart_server.c
+//  Description   : This is the server side of the CART communication protocol:
+//                  a frame store engine keeping the cartridges in a memory
+//                  mapped backing file, serving any number of clients from one
+//                  event loop.
+//
+//   Author       : Eric Traister
+//  Last Modified : 12/09/2016
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Project Include Files
+#include "cart_network.h"
+#include "cart_controller.h"
+#include "cmpsc311_log.h"
+#include "cmpsc311_util.h"
+
+// Defines
+#define CART_SERVER_STORE "cart_store.dat"	// default backing file of the cartridges
+#define CART_SERVER_MAX_CLIENTS 64			// clients served at once
+#define CART_SERVER_MAX_EVENTS 64			// socket events taken by one epoll_wait
+#define CART_SERVER_STORE_SIZE ((size_t)CART_MAX_CARTRIDGES * CART_CARTRIDGE_SIZE * CART_FRAME_SIZE)
+#define CART_SERVER_MESSAGE_MAX (CART_NET_HEADER_SIZE + CART_NET_ENCODED_MAX(CART_MAX_RUN_FRAMES))  // largest request or response
+#define CART_SERVER_RECV_BUFFER (4 * CART_SERVER_MESSAGE_MAX)	// requests taken by one read
+#define CART_SERVER_SEND_BUFFER CART_SOCKET_BUFFER				// responses waiting for the socket
+#define CART_SERVER_RT1 ((CartXferRegister)1 << 47)				// return code bit of a register
+
+// Enumerations
+typedef enum Flag {
+	YES = 0,
+	NO = 1
+} Flag;
+
+// A client connection and the requests and responses passing through it
+typedef struct CartServerClient {
+	int					socket;							// connection to the client
+	CartridgeIndex		loadedCart;						// cartridge the client last loaded, CART_NO_CARTRIDGE if none
+	CartXferRegister	capabilities;					// protocol extensions the client took at INITMS
+	uint32_t			events;							// epoll events being waited for
+	size_t				recvEnd;						// end of the bytes received into recvBuffer
+	size_t				sendStart;						// first byte of sendBuffer not yet sent
+	size_t				sendEnd;						// end of the responses in sendBuffer
+	char				recvBuffer[CART_SERVER_RECV_BUFFER];	// requests received but not yet served
+	char				sendBuffer[CART_SERVER_SEND_BUFFER];	// responses not yet sent
+} CartServerClient;
+
+// Global data
+char				*cart_server_store = CART_SERVER_STORE;	// backing file of the cartridges
+char				*cartStore = NULL;			// the cartridges, mapped from the backing file
+int					storeFile = -1;				// the backing file
+int					serverEpoll = -1;			// event loop of the listening socket and the clients
+int					serverSocket = -1;			// socket the clients connect to
+CartServerClient	*serverClients[CART_SERVER_MAX_CLIENTS];	// clients connected, NULL for a free slot
+int					clientCount = 0;			// clients connected
+uint64_t			serverOperations = 0;		// requests served
+
+// Functional Prototypes
+int open_cart_store(const char *path);
+void close_cart_store(void);
+int serve_cart_events(void);
+void release_cart_server(void);
+int open_server_socket(void);
+int accept_cart_clients(void);
+int add_cart_client(int sock);
+void close_cart_client(CartServerClient *client);
+int serve_cart_client(CartServerClient *client);
+int serve_cart_requests(CartServerClient *client);
+size_t serve_cart_request(CartServerClient *client, CartXferRegister reg, const char *payload, char *out);
+uint32_t request_frames(CartXferRegister reg);
+char * cart_store_frames(CartServerClient *client, CartXferRegister reg, uint32_t frames);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_server
+// Description  : Serve CART requests from the clients until shut down
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int cart_server(void) {
+
+	// Local Variables
+	int		result = 0;
+
+	if (open_cart_store(cart_server_store) != 0)
+		return (-1);
+	if ((serverEpoll = epoll_create1(0)) == -1 || open_server_socket() != 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nUnable to set up the CART server\n");
+		release_cart_server();
+		return (-1);
+	}
+
+	while (!cart_network_shutdown && result == 0)
+		result = serve_cart_events();
+	release_cart_server();
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_server_loopback
+// Description  : Serve the one client at the other end of a connected socket
+//                (a socket pair in the client's process) until it
+//                disconnects, on cartridges that start out zeroed when
+//                cart_server_store is NULL
+//
+// Inputs       : sock - the server's end of the connection
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int cart_server_loopback(int sock) {
+
+	// Local Variables
+	int		result = 0;
+
+	if (open_cart_store(cart_server_store) != 0) {
+		close(sock);
+		return (-1);
+	}
+	if ((serverEpoll = epoll_create1(0)) == -1 || add_cart_client(sock) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nUnable to set up the loopback CART server\n");
+		release_cart_server();
+		return (-1);
+	}
+
+	while (clientCount > 0 && result == 0)
+		result = serve_cart_events();
+	release_cart_server();
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serve_cart_events
+// Description  : Wait for the listening socket and the clients, then serve
+//                whichever clients have requests, or room for responses
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if the event loop or listening socket failed
+//
+////////////////////////////////////////////////////////////////////////////////
+int serve_cart_events(void) {
+
+	// Local Variables
+	int					i = 0;
+	int					ready = 0;
+	struct epoll_event	events[CART_SERVER_MAX_EVENTS];
+	CartServerClient	*client = NULL;
+
+	if ((ready = epoll_wait(serverEpoll, events, CART_SERVER_MAX_EVENTS, -1)) == -1) {
+		if (errno == EINTR)
+			return (0);
+		logMessage(LOG_ERROR_LEVEL, "\nCART server event loop failed [%s]\n", strerror(errno));
+		return (-1);
+	}
+	for (i = 0; i < ready; i++) {
+		client = events[i].data.ptr;
+		if (client == NULL) {
+			if (accept_cart_clients() != 0)
+				return (-1);
+		}
+		else if ((events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN)) {
+			close_cart_client(client);
+		}
+		else if (serve_cart_client(client) != 0) {
+			close_cart_client(client);
+		}
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : release_cart_server
+// Description  : Drop the clients left, close the sockets, then write the
+//                cartridges back
+//
+// Inputs       : none
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void release_cart_server(void) {
+
+	// Local Variables
+	int		i = 0;
+
+	for (i = 0; i < CART_SERVER_MAX_CLIENTS; i++) {
+		if (serverClients[i] != NULL)
+			close_cart_client(serverClients[i]);
+	}
+	logMessage(LOG_INFO_LEVEL, "\nCART server shutting down after %lu operations\n", (unsigned long)serverOperations);
+	if (serverSocket != -1)
+		close(serverSocket);
+	if (serverEpoll != -1)
+		close(serverEpoll);
+	serverSocket = serverEpoll = -1;
+	close_cart_store();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : open_cart_store
+// Description  : Map the backing file of the cartridges, creating it (all
+//                zero) if it is missing
+//
+// Inputs       : path - the backing file, NULL for zeroed memory kept by no file
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int open_cart_store(const char *path) {
+
+	// Local Variables
+	struct stat		stats;
+
+	if (path == NULL) {
+		cartStore = mmap(NULL, CART_SERVER_STORE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (cartStore == MAP_FAILED) {
+			logMessage(LOG_ERROR_LEVEL, "\nUnable to map the cartridge store : %s\n", strerror(errno));
+			cartStore = NULL;
+			return (-1);
+		}
+		return (0);
+	}
+	if ((storeFile = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) == -1 || fstat(storeFile, &stats) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nUnable to open the cartridge store [%s] : %s\n", path, strerror(errno));
+		return (-1);
+	}
+	if ((size_t)stats.st_size < CART_SERVER_STORE_SIZE && ftruncate(storeFile, CART_SERVER_STORE_SIZE) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nUnable to size the cartridge store [%s] : %s\n", path, strerror(errno));
+		close(storeFile);
+		return (-1);
+	}
+	cartStore = mmap(NULL, CART_SERVER_STORE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, storeFile, 0);
+	if (cartStore == MAP_FAILED) {
+		logMessage(LOG_ERROR_LEVEL, "\nUnable to map the cartridge store [%s] : %s\n", path, strerror(errno));
+		cartStore = NULL;
+		close(storeFile);
+		return (-1);
+	}
+
+	logMessage(LOG_INFO_LEVEL, "\nMapped the cartridge store [%s]\n", path);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : close_cart_store
+// Description  : Write the cartridges back to the backing file and unmap it
+//
+// Inputs       : none
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void close_cart_store(void) {
+
+	if (cartStore != NULL) {
+		msync(cartStore, CART_SERVER_STORE_SIZE, MS_SYNC);
+		munmap(cartStore, CART_SERVER_STORE_SIZE);
+	}
+	if (storeFile != -1)
+		close(storeFile);
+	cartStore = NULL;
+	storeFile = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : open_server_socket
+// Description  : Listen for clients on the server's address and port
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int open_server_socket(void) {
+
+	// Local Variables
+	int					reuse = 1;
+	struct sockaddr_in	saddr;
+	struct epoll_event	event;
+
+	memset(&saddr, 0x0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons((cart_network_port != 0) ? cart_network_port : CART_DEFAULT_PORT);
+	saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (cart_network_address != NULL && inet_aton((char *)cart_network_address, &saddr.sin_addr) == 0) {
+		logMessage(LOG_ERROR_LEVEL, "\nBad CART server address [%s]\n", cart_network_address);
+		return (-1);
+	}
+
+	if ((serverSocket = socket(PF_INET, SOCK_STREAM, 0)) == -1 ||
+			setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1 ||
+			bind(serverSocket, (struct sockaddr *)&saddr, sizeof(saddr)) == -1 ||
+			listen(serverSocket, CART_MAX_BACKLOG) == -1 ||
+			fcntl(serverSocket, F_SETFL, fcntl(serverSocket, F_GETFL, 0) | O_NONBLOCK) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "\nUnable to listen on port %hu : %s\n", ntohs(saddr.sin_port), strerror(errno));
+		return (-1);
+	}
+
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (epoll_ctl(serverEpoll, EPOLL_CTL_ADD, serverSocket, &event) == -1)
+		return (-1);
+
+	logMessage(LOG_INFO_LEVEL, "\nCART server listening on port %hu\n", ntohs(saddr.sin_port));
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : accept_cart_clients
+// Description  : Take every client waiting to connect into the event loop
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if the listening socket failed
+//
+////////////////////////////////////////////////////////////////////////////////
+int accept_cart_clients(void) {
+
+	// Local Variables
+	int		sock = -1;
+	int		nodelay = 1;
+
+	while ((sock = accept(serverSocket, NULL, NULL)) != -1) {
+
+		// Responses are pipelined like the requests, so send them without waiting on Nagle
+		if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1)
+			logMessage(LOG_WARNING_LEVEL, "\nUnable to tune the client connection, continuing\n");
+		add_cart_client(sock);
+	}
+
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED)
+		return (0);
+	logMessage(LOG_ERROR_LEVEL, "\nUnable to accept CART clients : %s\n", strerror(errno));
+	return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : add_cart_client
+// Description  : Take a connected client into the event loop (closing its
+//                socket if it can't be)
+//
+// Inputs       : sock - the connection to the client
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int add_cart_client(int sock) {
+
+	// Local Variables
+	int					i = 0;
+	int					buffer = CART_SOCKET_BUFFER;
+	struct epoll_event	event;
+	CartServerClient	*client = NULL;
+
+	if (clientCount == CART_SERVER_MAX_CLIENTS || (client = malloc(sizeof(CartServerClient))) == NULL) {
+		logMessage(LOG_WARNING_LEVEL, "\nRefusing a CART client, %d are connected\n", clientCount);
+		close(sock);
+		return (-1);
+	}
+	if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer)) == -1 ||
+			setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer)) == -1) {
+		logMessage(LOG_WARNING_LEVEL, "\nUnable to size the client connection buffers, continuing\n");
+	}
+
+	client->socket = sock;
+	client->loadedCart = CART_NO_CARTRIDGE;
+	client->capabilities = 0;
+	client->events = EPOLLIN;
+	client->recvEnd = client->sendStart = client->sendEnd = 0;
+	event.events = client->events;
+	event.data.ptr = client;
+	if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) == -1 ||
+			epoll_ctl(serverEpoll, EPOLL_CTL_ADD, sock, &event) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "\nUnable to watch the client connection\n");
+		close(sock);
+		free(client);
+		return (-1);
+	}
+	for (i = 0; serverClients[i] != NULL; i++)
+		;
+	serverClients[i] = client;
+	clientCount++;
+	logMessage(LOG_INFO_LEVEL, "\nCART client connected (%d connected)\n", clientCount);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : close_cart_client
+// Description  : Drop a client connection
+//
+// Inputs       : client - the client
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void close_cart_client(CartServerClient *client) {
+
+	// Local Variables
+	int		i = 0;
+
+	for (i = 0; i < CART_SERVER_MAX_CLIENTS; i++) {
+		if (serverClients[i] == client)
+			serverClients[i] = NULL;
+	}
+	epoll_ctl(serverEpoll, EPOLL_CTL_DEL, client->socket, NULL);
+	close(client->socket);
+	free(client);
+	clientCount--;
+	logMessage(LOG_INFO_LEVEL, "\nCART client disconnected (%d connected)\n", clientCount);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serve_cart_client
+// Description  : Read what a client sent, serve its complete requests and
+//                send what the socket takes of the responses, then wait for
+//                more requests and/or room for the rest of the responses
+//
+// Inputs       : client - the client
+// Outputs      : 0 if successful, -1 if the connection is to be closed
+//
+////////////////////////////////////////////////////////////////////////////////
+int serve_cart_client(CartServerClient *client) {
+
+	// Local Variables
+	ssize_t				got = 0;
+	uint32_t			events = 0;
+	struct epoll_event	event;
+
+	// Take what has arrived, if there is room for it
+	if (client->recvEnd < CART_SERVER_RECV_BUFFER) {
+		got = read(client->socket, &client->recvBuffer[client->recvEnd], CART_SERVER_RECV_BUFFER - client->recvEnd);
+		if (got == 0)
+			return (-1);
+		if (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			logMessage(LOG_ERROR_LEVEL, "\nError reading from a CART client : %s\n", strerror(errno));
+			return (-1);
+		}
+		if (got > 0)
+			client->recvEnd += got;
+	}
+
+	// Serve and send until the requests or the socket run out
+	do {
+		if (serve_cart_requests(client) != 0)
+			return (-1);
+		if (client->sendEnd > client->sendStart) {
+			got = write(client->socket, &client->sendBuffer[client->sendStart], client->sendEnd - client->sendStart);
+			if (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				logMessage(LOG_ERROR_LEVEL, "\nError writing to a CART client : %s\n", strerror(errno));
+				return (-1);
+			}
+			if (got > 0)
+				client->sendStart += got;
+		}
+		if (client->sendStart == client->sendEnd)
+			client->sendStart = client->sendEnd = 0;
+	} while (got > 0 && client->sendEnd > client->sendStart);
+
+	// Wait for requests while there is room for them, and for the socket while responses are left
+	events = (client->recvEnd < CART_SERVER_RECV_BUFFER) ? EPOLLIN : 0;
+	if (client->sendEnd > client->sendStart)
+		events |= EPOLLOUT;
+	if (events != client->events) {
+		event.events = events;
+		event.data.ptr = client;
+		if (epoll_ctl(serverEpoll, EPOLL_CTL_MOD, client->socket, &event) == -1)
+			return (-1);
+		client->events = events;
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serve_cart_requests
+// Description  : Serve the complete requests received from a client, in
+//                order, while there is room for their responses
+//
+// Inputs       : client - the client
+// Outputs      : 0 if successful, -1 if the client broke the protocol
+//
+////////////////////////////////////////////////////////////////////////////////
+int serve_cart_requests(CartServerClient *client) {
+
+	// Local Variables
+	size_t				used = 0;		// bytes of recvBuffer served
+	size_t				payload = 0;	// bytes of the request after its registers
+	uint32_t			frames = 0;		// frames the request carries
+	int					measured = 0;
+	CartXferRegister	reg = 0;
+
+	while (client->recvEnd - used >= CART_NET_HEADER_SIZE) {
+
+		// Make room for the largest response first, so a request once taken is always answered
+		if (CART_SERVER_SEND_BUFFER - client->sendEnd < CART_SERVER_MESSAGE_MAX) {
+			if (client->sendStart == 0)
+				break;
+			memmove(client->sendBuffer, &client->sendBuffer[client->sendStart], client->sendEnd - client->sendStart);
+			client->sendEnd -= client->sendStart;
+			client->sendStart = 0;
+			continue;
+		}
+
+		// The request is complete once its frame(s), raw or encoded, are all here
+		memcpy(&reg, &client->recvBuffer[used], sizeof(reg));
+		reg = ntohll64(reg);
+		frames = request_frames(reg);
+		if (frames > CART_MAX_RUN_FRAMES) {
+			logMessage(LOG_ERROR_LEVEL, "\nCART client sent a run of %u frames, dropping it\n", frames);
+			return (-1);
+		}
+		payload = (size_t)frames * CART_FRAME_SIZE;
+		if (frames > 0 && (client->capabilities & CART_NET_CAP_COMPRESS)) {
+			measured = cart_net_encoded_size(&client->recvBuffer[used + CART_NET_HEADER_SIZE],
+					client->recvEnd - used - CART_NET_HEADER_SIZE, frames, &payload);
+			if (measured < 0) {
+				logMessage(LOG_ERROR_LEVEL, "\nMalformed encoded frames from a CART client, dropping it\n");
+				return (-1);
+			}
+			if (measured > 0)
+				break;
+		}
+		if (client->recvEnd - used < CART_NET_HEADER_SIZE + payload)
+			break;
+
+		client->sendEnd += serve_cart_request(client, reg, &client->recvBuffer[used + CART_NET_HEADER_SIZE],
+				&client->sendBuffer[client->sendEnd]);
+		used += CART_NET_HEADER_SIZE + payload;
+		serverOperations++;
+	}
+
+	// Keep what is left of a partial request at the front
+	if (used > 0) {
+		memmove(client->recvBuffer, &client->recvBuffer[used], client->recvEnd - used);
+		client->recvEnd -= used;
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serve_cart_request
+// Description  : Carry out one request on the cartridges and write its
+//                response: the registers (RT1 set on failure), then the
+//                frame(s) of a successful read
+//
+// Inputs       : client - the client
+//                reg - the request registers
+//                payload - the frame(s) of a write, raw or encoded
+//                out - where the response goes (CART_SERVER_MESSAGE_MAX bytes)
+// Outputs      : size of the response
+//
+////////////////////////////////////////////////////////////////////////////////
+size_t serve_cart_request(CartServerClient *client, CartXferRegister reg, const char *payload, char *out) {
+
+	// Local Variables
+	size_t				used = CART_NET_HEADER_SIZE;
+	uint32_t			frames = 0;
+	CartXferRegister	resp = reg | CART_SERVER_RT1;
+	char				*store = NULL;
+
+	switch ((CartOpCodes)(reg >> 56)) {
+	case(CART_OP_INITMS) :
+		// Take the extensions asked for that this server has, and start with no cart loaded
+		client->capabilities = reg & CART_NET_CAPABILITIES;
+		client->loadedCart = CART_NO_CARTRIDGE;
+		resp = (reg & ~(CartXferRegister)CART_NET_RUN_MASK & ~CART_SERVER_RT1) | client->capabilities;
+		break;
+
+	case(CART_OP_LDCART) :
+		if (((reg >> 31) & 0xFFFF) < CART_MAX_CARTRIDGES) {
+			client->loadedCart = (reg >> 31) & 0xFFFF;
+			resp = reg & ~CART_SERVER_RT1;
+		}
+		break;
+
+	case(CART_OP_BZERO) :
+		if (client->loadedCart < CART_MAX_CARTRIDGES) {
+			memset(&cartStore[(size_t)client->loadedCart * CART_CARTRIDGE_SIZE * CART_FRAME_SIZE], 0x0,
+					(size_t)CART_CARTRIDGE_SIZE * CART_FRAME_SIZE);
+			resp = reg & ~CART_SERVER_RT1;
+		}
+		break;
+
+	case(CART_OP_RDFRME) :
+	case(CART_OP_RDFRMS) :
+		// Send the frames straight from the mapping, encoded if the client takes that
+		frames = ((reg >> 56) == CART_OP_RDFRME) ? 1 : (reg & CART_NET_RUN_MASK);
+		if ((store = cart_store_frames(client, reg, frames)) != NULL) {
+			if (client->capabilities & CART_NET_CAP_COMPRESS)
+				used += cart_net_encode_frames(store, frames, &out[used]);
+			else {
+				memcpy(&out[used], store, (size_t)frames * CART_FRAME_SIZE);
+				used += (size_t)frames * CART_FRAME_SIZE;
+			}
+			resp = reg & ~CART_SERVER_RT1;
+		}
+		break;
+
+	case(CART_OP_WRFRME) :
+	case(CART_OP_WRFRMS) :
+		// Put the frames straight into the mapping (the encoding was measured when the request came in)
+		frames = request_frames(reg);
+		if ((store = cart_store_frames(client, reg, frames)) != NULL) {
+			if (!(client->capabilities & CART_NET_CAP_COMPRESS))
+				memcpy(store, payload, (size_t)frames * CART_FRAME_SIZE);
+			else if (cart_net_decode_frames(payload, frames, store) != 0)
+				break;
+			resp = reg & ~CART_SERVER_RT1;
+		}
+		break;
+
+	case(CART_OP_POWOFF) :
+		// Power off puts the cartridges in the backing file, where the next power on finds them
+		if (msync(cartStore, CART_SERVER_STORE_SIZE, MS_SYNC) == 0)
+			resp = reg & ~CART_SERVER_RT1;
+		client->loadedCart = CART_NO_CARTRIDGE;
+		logMessage(LOG_INFO_LEVEL, "\nCART client powered off, %lu operations served\n", (unsigned long)serverOperations + 1);
+		break;
+
+	default:
+		logMessage(LOG_WARNING_LEVEL, "\nCART client sent unknown opcode %u\n", (unsigned)(reg >> 56));
+		break;
+	}
+
+	resp = htonll64(resp);
+	memcpy(out, &resp, sizeof(resp));
+	return (used);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : request_frames
+// Description  : Number of frames sent after a request's registers
+//
+// Inputs       : reg - the request registers
+// Outputs      : number of frames
+//
+////////////////////////////////////////////////////////////////////////////////
+uint32_t request_frames(CartXferRegister reg) {
+
+	switch (reg >> 56) {
+	case(CART_OP_WRFRME) :
+		return (1);
+	case(CART_OP_WRFRMS) :
+		return (reg & CART_NET_RUN_MASK);
+	default:
+		return (0);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_store_frames
+// Description  : Find the frames a read or write request moves in the
+//                mapping, checking they are all on the client's loaded cart
+//                (and that a run is one the client negotiated)
+//
+// Inputs       : client - the client
+//                reg - the request registers
+//                frames - number of frames moved
+// Outputs      : the first frame, NULL if the request is bad
+//
+////////////////////////////////////////////////////////////////////////////////
+char * cart_store_frames(CartServerClient *client, CartXferRegister reg, uint32_t frames) {
+
+	// Local Variables
+	uint32_t	frame = (reg >> 15) & 0xFFFF;
+
+	if (client->loadedCart >= CART_MAX_CARTRIDGES || frames == 0 || frames > CART_MAX_RUN_FRAMES ||
+			frame + frames > CART_CARTRIDGE_SIZE)
+		return (NULL);
+	if ((reg >> 56) >= CART_OP_RDFRMS && !(client->capabilities & CART_NET_CAP_MULTIFRAME))
+		return (NULL);
+	return (&cartStore[((size_t)client->loadedCart * CART_CARTRIDGE_SIZE + frame) * CART_FRAME_SIZE]);
+}
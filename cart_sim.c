@@ -20,28 +20,42 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 
 // Project Includes
 #include <cart_driver.h>
 #include <cart_cache.h>
 #include <cart_network.h>
+#include <cart_trace.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 
 // Defines
 #define CART_WORKLOAD_DIR "workload"
 #define CART_SIM_MAX_OPEN_FILES 128
-#define CART_ARGUMENTS "huvl:c:i:p:"
+#define CART_SIM_MAX_THREADS 64
+#define CART_SIM_VALIDATE_READ 0                // validate through cart_seek and cart_read
+#define CART_SIM_VALIDATE_VECTOR 1              // validate through cart_preadv, then rewrite with cart_pwritev
+#define CART_SIM_VALIDATE_MAP 2                 // validate through a cart_mmap snapshot of the file
+#define CART_SIM_VECTOR_PARTS 4                 // buffers a vectored validation splits the file over
+#define CART_ARGUMENTS "huvwml:c:r:i:p:t:T:V:"
 #define USAGE \
-	"USAGE: cart_sim [-h] [-v] [-l <logfile>] [-c <sz>] <workload-file>\n" \
+	"USAGE: cart_sim [-h] [-v] [-w] [-m] [-l <logfile>] [-c <sz>] [-r <policy>] [-t <threads>] [-T <entries>] [-V <method>] <workload-file>\n" \
 	"\n" \
 	"where:\n" \
 	"    -h - help mode (display this message)\n" \
 	"    -v - verbose output\n" \
+	"    -w - write-back cache mode (written frames reach CART memory on eviction, flush or poweroff)\n" \
+	"    -m - mount the files left in CART memory by an earlier run (instead of formatting)\n" \
 	"    -l - write log messages to the filename <logfile>\n" \
 	"    -c - set the cart block cache to size <sz> (disabled for assign #2)\n" \
-	"    -i - IP address of server to connect to.\n" \
-	"    -p - port number of server to connect to.\n" \
+	"    -r - set the cache replacement policy to <policy> (lru, clock, 2q, arc)\n" \
+	"    -i - IP address of server to connect to (comma separated list to stripe carts over servers).\n" \
+	"    -p - port number of server to connect to (comma separated list, one per server).\n" \
+	"    -t - replay each file's operations in order on a pool of <threads> workers (files run concurrently).\n" \
+	"    -T - keep the last <entries> hot path traces (bus requests, file I/O, ...) in memory, logged at exit.\n" \
+	"    -V - validate the files by <method>: read (cart_read, the default), vector (cart_preadv, then\n" \
+	"         rewritten in place by cart_pwritev and read back) or map (a cart_mmap snapshot).\n" \
 	"\n" \
 	"    <workload-file> - file contain the workload to simulate\n" \
 	"\n" \
@@ -50,17 +64,31 @@
 typedef struct {
 	char     *filename;  // This is the filename for the test file
 	int16_t   fhandle;   // This is a file handle for the opened file
+	char    **lines;     // The file's workload lines, in trace order (parallel replay)
+	int       lineCount; // Number of lines queued for the file
+	int       lineMax;   // Number of lines the queue has room for
 } CartSimulationTable;
 
 //
 // Global Data
 int verbose;
+int replayThreads = 1;                        // workers replaying the files (1 replays the trace in order)
+int replayNext = 0;                           // next file table entry a worker takes
+int replayFailed = 0;                         // a worker failed, the others stop
+int validateMethod = CART_SIM_VALIDATE_READ;  // how validate_file reads the files back
 
 //
 // Functional Prototypes
 
 int simulate_CART( char *wload );             // control loop of the CART simulation
+int replay_command(CartSimulationTable *file, char *command, int32_t len, int32_t off, char *sep);
+                                              // perform one workload operation on a file
+int queue_workload_line(CartSimulationTable *file, char *line);  // queue a line for parallel replay
+void *replay_files(void *arg);                // worker replaying whole files from the table
+int replay_parallel(CartSimulationTable *ftable);  // replay the queued files on the worker pool
 int validate_file(char *fname, int16_t mfh);  // Validate a file in the filesystem
+void split_vector(struct iovec *iov, char *buf, int32_t size);  // spread a buffer over the validation's buffers
+void report_cart_stats(void);                 // log what the driver, cache and bus counted
 
 //
 // Functions
@@ -78,7 +106,8 @@ int main( int argc, char *argv[] ) {
 
 	// Local variables
 	int ch, verbose = 0, log_initialized = 0, unit_tests = 0;
-	uint32_t cache_size = 0;
+	uint32_t cache_size = 0, trace_entries = 0;
+	char *ports = NULL;
 
 	// Process the command line parameters
 	while ((ch = getopt(argc, argv, CART_ARGUMENTS)) != -1) {
@@ -92,6 +121,14 @@ int main( int argc, char *argv[] ) {
 			verbose = 1;
 			break;
 
+		case 'w': // Write-back cache mode
+			set_cart_cache_mode( CART_CACHE_WRITEBACK );
+			break;
+
+		case 'm': // Mount the store of an earlier run
+			set_cart_poweron_mode( CART_POWERON_MOUNT );
+			break;
+
 		case 'u': // Unit test Flag
 			unit_tests = 1;
 			break;
@@ -107,21 +144,49 @@ int main( int argc, char *argv[] ) {
 			}
 			break;
 
-        case 'i': // Get the IP address
-            if (inet_addr(optarg) == INADDR_NONE) {
-			    logMessage( LOG_ERROR_LEVEL, "Bad IP address [%s]", argv[optind] );
-                return(-1);
-            }
+		case 'r': // Set the cache replacement policy
+			if ( set_cart_cache_policy( optarg ) != 0 ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad cache policy [%s]", optarg );
+			    return( -1 );
+			}
+			break;
+
+        case 'i': // Get the IP address(es), checked with the ports below
             cart_network_address = (unsigned char *)strdup(optarg);
 			break;
 
-        case 'p': // Set the network port number
-			if ( sscanf(optarg, "%hu", &cart_network_port) != 1 ) {
-			    logMessage( LOG_ERROR_LEVEL, "Bad  port number [%s]", argv[optind] );
-                return(-1);
-			}
+        case 'p': // Set the network port number(s)
+			ports = optarg;
             break;			
 
+		case 't': // Set the number of replay workers
+			if ( (sscanf( optarg, "%d", &replayThreads ) != 1) || (replayThreads < 1) ||
+					(replayThreads > CART_SIM_MAX_THREADS) ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad replay thread count [%s]", optarg );
+			    return( -1 );
+			}
+			break;
+
+		case 'T': // Trace into a ring buffer
+			if ( (sscanf( optarg, "%u", &trace_entries ) != 1) || (set_cart_trace_ring( trace_entries ) != 0) ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad trace buffer size [%s]", optarg );
+			    return( -1 );
+			}
+			break;
+
+		case 'V': // Set the validation method
+			if ( strcmp( optarg, "read" ) == 0 ) {
+				validateMethod = CART_SIM_VALIDATE_READ;
+			} else if ( strcmp( optarg, "vector" ) == 0 ) {
+				validateMethod = CART_SIM_VALIDATE_VECTOR;
+			} else if ( strcmp( optarg, "map" ) == 0 ) {
+				validateMethod = CART_SIM_VALIDATE_MAP;
+			} else {
+			    logMessage( LOG_ERROR_LEVEL, "Bad validation method [%s]", optarg );
+			    return( -1 );
+			}
+			break;
+
 		default:  // Default (unknown)
 			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
 			return( -1 );
@@ -134,6 +199,15 @@ int main( int argc, char *argv[] ) {
 	}
 	if ( verbose ) {
 		enableLogLevels(LOG_INFO_LEVEL);
+		set_cart_trace_levels(LOG_INFO_LEVEL);
+	}
+
+	// Stripe the cartridges over the servers given (one address and/or port per server)
+	if ( client_cart_bus_servers( (char *)cart_network_address, ports ) != 0 ) {
+	    logMessage( LOG_ERROR_LEVEL, "Bad server addresses [%s] or ports [%s]",
+			(cart_network_address != NULL) ? (char *)cart_network_address : CART_DEFAULT_IP,
+			(ports != NULL) ? ports : "default" );
+	    return( -1 );
 	}
 
 	// Setup the cache size as needed
@@ -141,11 +215,17 @@ int main( int argc, char *argv[] ) {
 		set_cart_cache_size(cache_size);
 	}
 
+	// Give each replay worker its own cache shard to contend on
+	if ( (replayThreads > 1) && (set_cart_cache_shards(replayThreads) != 0) ) {
+		return( -1 );
+	}
+
 	// If exgtracting file from data
 	if (unit_tests) {
 
 		// Run the unit tests
 		enableLogLevels( LOG_INFO_LEVEL );
+		set_cart_trace_levels( LOG_INFO_LEVEL );
 		logMessage(LOG_INFO_LEVEL, "Running unit tests ....\n\n");
 		if ( (cartCacheUnitTest() == 0) && (cartCacheUnitTest() == 0) ) {
 			logMessage(LOG_INFO_LEVEL, "Unit tests completed successfully.\n\n");
@@ -170,6 +250,8 @@ int main( int argc, char *argv[] ) {
 		} else {
 			logMessage( LOG_INFO_LEVEL, "CART simulation failed.\n\n" );
 		}
+		report_cart_stats();
+		dump_cart_trace();
 	}
 
 	// Return successfully
@@ -188,7 +270,7 @@ int main( int argc, char *argv[] ) {
 int simulate_CART( char *wload ) {
 
 	// Local variables
-	char line[1024], fname[128], command[128], text[1025], *sep, *rbuf;
+	char line[1024], fname[128], command[128], *sep;
 	FILE *fhandle = NULL;
 	int32_t err=0, len, off, fields, linecount;
 	CartSimulationTable ftable[CART_SIM_MAX_OPEN_FILES];
@@ -231,7 +313,7 @@ int simulate_CART( char *wload ) {
 			}
 
 			// Just log the contents
-			logMessage(CartSimulatorLLevel, "File [%s], command [%s], len=%d, offset=%d",
+			CART_TRACE(CartSimulatorLLevel, "File [%s], command [%s], len=%d, offset=%d",
 					fname, command, len, off);
 
 			// Now walk the the table looking for the file
@@ -248,7 +330,7 @@ int simulate_CART( char *wload ) {
 			if (idx == -1) {
 
 				// Log message, find unused index and save filename for later use
-				logMessage(CartSimulatorLLevel, "CART_SIM : Opening file [%s]", fname);
+				CART_TRACE(CartSimulatorLLevel, "CART_SIM : Opening file [%s]", fname);
 				idx = 0;
 				while ((ftable[idx].filename != NULL) && (idx < CART_SIM_MAX_OPEN_FILES)) {
 					idx++;
@@ -266,94 +348,15 @@ int simulate_CART( char *wload ) {
 
 			}
 
-			// Now execute the specific command
-			if (strncmp(command, "WRITEAT", 7) == 0) {
-
-				// Log the command executed
-				logMessage(CartSimulatorLLevel, "CART_SIM : Writing %d bytes at position %d from file [%s]", len, off, fname);
-
-				// First perform the seek
-				if (cart_seek(ftable[idx].fhandle, off)) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Seek/WriteAt file [%s] to position %d failed, aborting simulation.", fname, off);
-					return(-1);
-				}
-
-				// Now see if we need more data to fill, terminate the lines
-				CMPSC_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
-				CMPSC_ASSERT2((strlen(sep+1)>=len), "Workload str [%d<%d]", strlen(sep+1), len);
-				strncpy(text, sep+1, len);
-				text[len] = 0x0;
-				for (i=0; i<strlen(text); i++) {
-					if (text[i] == '^') {
-						text[i] = '\n';
-					}
-				}
-
-				// Now perform the write
-				if (cart_write(ftable[idx].fhandle, text, len) != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "WriteAt of file [%s], length %d failed, aborting simulation.", fname, len);
-					return(-1);
-				}
-
-
-			} else if (strncmp(command, "WRITE", 5) == 0) {
-
-				// Now see if we need more data to fill, terminate the lines
-				CMPSC_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
-				CMPSC_ASSERT2((strlen(sep+1)>=len), "Workload str [%d<%d]", strlen(sep+1), len);
-				strncpy(text, sep+1, len);
-				text[len] = 0x0;
-				for (i=0; i<strlen(text); i++) {
-					if (text[i] == '^') {
-						text[i] = '\n';
-					}
-				}
-
-				// Log the command executed
-				logMessage(CartSimulatorLLevel, "CART_SIM : Writing %d bytes to file [%s]", len, fname);
-
-				// Now perform the write
-				if (cart_write(ftable[idx].fhandle, text, len) != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Write of file [%s], length %d failed, aborting simulation.", fname, len);
-					return(-1);
+			// Queue the line behind the file's others, or execute it now
+			if (replayThreads > 1) {
+				if (queue_workload_line(&ftable[idx], line) != 0) {
+					fclose( fhandle );
+					return( -1 );
 				}
-
-
-			} else if (strncmp(command, "SEEK", 4) == 0) {
-
-				// Log the command executed
-				logMessage(CartSimulatorLLevel, "CART_SIM : Seeking to position %d in file [%s]", off, fname);
-
-				// Now perform the seek
-				if (cart_seek(ftable[idx].fhandle, off) != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Seek in file [%s] to position %d failed, aborting simulation.", fname, off);
-					return(-1);
-				}
-
-			} else if (strncmp(command, "READ", 4) == 0) {
-
-				// Log the command executed
-				logMessage(CartSimulatorLLevel, "CART_SIM : Reading %d bytes from file [%s]", len, fname);
-
-				// Now perform the read
-				rbuf = malloc(len);
-				if (cart_read(ftable[idx].fhandle, rbuf, len) != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Read file [%s] of length %d failed, aborting simulation.", fname, off);
-					return(-1);
-				}
-				free(rbuf);
-				rbuf = NULL;
-
-			} else {
-
-				// Bomb out, don't understand the command
-				CMPSC_ASSERT1(0, "CART_SIM : Failed, unknown command [%s]", command);
-
+			} else if (replay_command(&ftable[idx], command, len, off, sep) != 0) {
+				fclose( fhandle );
+				return( -1 );
 			}
 		}
 
@@ -365,6 +368,12 @@ int simulate_CART( char *wload ) {
 		}
 	}
 
+	// Replay the files in parallel once the whole trace is partitioned
+	if ( (replayThreads > 1) && (replay_parallel(ftable) != 0) ) {
+		fclose( fhandle );
+		return( -1 );
+	}
+
 	// Now walk the the table of files to validate
 	for (i=0; i<CART_SIM_MAX_OPEN_FILES; i++) {
 		if (ftable[i].filename != NULL) {
@@ -390,6 +399,233 @@ int simulate_CART( char *wload ) {
 	return( 0 );
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_command
+// Description  : Perform one workload operation on an open file
+//
+// Inputs       : file - the file table entry of the file operated on
+//                command - the operation (WRITEAT, WRITE, SEEK or READ)
+//                len - the length of the operation
+//                off - the position of the operation
+//                sep - the ':' ahead of the operation's text
+// Outputs      : 0 if successful, -1 if failure
+
+int replay_command(CartSimulationTable *file, char *command, int32_t len, int32_t off, char *sep) {
+
+	// Local variables
+	char text[1025], *rbuf;
+	int i;
+
+	if (strncmp(command, "WRITEAT", 7) == 0) {
+
+		// Log the command executed
+		CART_TRACE(CartSimulatorLLevel, "CART_SIM : Writing %d bytes at position %d from file [%s]", len, off, file->filename);
+
+		// First perform the seek
+		if (cart_seek(file->fhandle, off)) {
+			// Failed, error out
+			logMessage(LOG_ERROR_LEVEL, "Seek/WriteAt file [%s] to position %d failed, aborting simulation.", file->filename, off);
+			return(-1);
+		}
+
+		// Now see if we need more data to fill, terminate the lines
+		CMPSC_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
+		CMPSC_ASSERT2((strnlen(sep+1, len)>=len), "Workload str [%d<%d]", strnlen(sep+1, len), len);
+		memcpy(text, sep+1, len);
+		text[len] = 0x0;
+		for (i=0; i<len; i++) {
+			if (text[i] == '^') {
+				text[i] = '\n';
+			}
+		}
+
+		// Now perform the write
+		if (cart_write(file->fhandle, text, len) != len) {
+			// Failed, error out
+			logMessage(LOG_ERROR_LEVEL, "WriteAt of file [%s], length %d failed, aborting simulation.", file->filename, len);
+			return(-1);
+		}
+
+
+	} else if (strncmp(command, "WRITE", 5) == 0) {
+
+		// Now see if we need more data to fill, terminate the lines
+		CMPSC_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
+		CMPSC_ASSERT2((strnlen(sep+1, len)>=len), "Workload str [%d<%d]", strnlen(sep+1, len), len);
+		memcpy(text, sep+1, len);
+		text[len] = 0x0;
+		for (i=0; i<len; i++) {
+			if (text[i] == '^') {
+				text[i] = '\n';
+			}
+		}
+
+		// Log the command executed
+		CART_TRACE(CartSimulatorLLevel, "CART_SIM : Writing %d bytes to file [%s]", len, file->filename);
+
+		// Now perform the write
+		if (cart_write(file->fhandle, text, len) != len) {
+			// Failed, error out
+			logMessage(LOG_ERROR_LEVEL, "Write of file [%s], length %d failed, aborting simulation.", file->filename, len);
+			return(-1);
+		}
+
+
+	} else if (strncmp(command, "SEEK", 4) == 0) {
+
+		// Log the command executed
+		CART_TRACE(CartSimulatorLLevel, "CART_SIM : Seeking to position %d in file [%s]", off, file->filename);
+
+		// Now perform the seek
+		if (cart_seek(file->fhandle, off) != len) {
+			// Failed, error out
+			logMessage(LOG_ERROR_LEVEL, "Seek in file [%s] to position %d failed, aborting simulation.", file->filename, off);
+			return(-1);
+		}
+
+	} else if (strncmp(command, "READ", 4) == 0) {
+
+		// Log the command executed
+		CART_TRACE(CartSimulatorLLevel, "CART_SIM : Reading %d bytes from file [%s]", len, file->filename);
+
+		// Now perform the read
+		rbuf = malloc(len);
+		if (cart_read(file->fhandle, rbuf, len) != len) {
+			// Failed, error out
+			logMessage(LOG_ERROR_LEVEL, "Read file [%s] of length %d failed, aborting simulation.", file->filename, off);
+			return(-1);
+		}
+		free(rbuf);
+		rbuf = NULL;
+
+	} else {
+
+		// Bomb out, don't understand the command
+		CMPSC_ASSERT1(0, "CART_SIM : Failed, unknown command [%s]", command);
+
+	}
+
+	// Return successfully
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : queue_workload_line
+// Description  : Queue a workload line behind the earlier lines of its file
+//
+// Inputs       : file - the file table entry of the line's file
+//                line - the workload line
+// Outputs      : 0 if successful, -1 if failure
+
+int queue_workload_line(CartSimulationTable *file, char *line) {
+
+	// Local variables
+	char **grown;
+
+	// Double the queue when it is full
+	if (file->lineCount == file->lineMax) {
+		grown = realloc(file->lines, sizeof(char *) * ((file->lineMax == 0) ? 64 : file->lineMax * 2));
+		if (grown == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Failure queueing workload line of file [%s].", file->filename);
+			return(-1);
+		}
+		file->lines = grown;
+		file->lineMax = (file->lineMax == 0) ? 64 : file->lineMax * 2;
+	}
+	if ((file->lines[file->lineCount] = strdup(line)) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failure queueing workload line of file [%s].", file->filename);
+		return(-1);
+	}
+	file->lineCount++;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_files
+// Description  : Worker that takes files from the table one at a time and
+//                replays each one's lines in order, until none are left or
+//                some worker fails
+//
+// Inputs       : arg - the file table
+// Outputs      : NULL
+
+void *replay_files(void *arg) {
+
+	// Local variables
+	CartSimulationTable *ftable = (CartSimulationTable *)arg, *file;
+	char fname[128], command[128], *sep;
+	int32_t len, off;
+	int idx, i;
+
+	while ( (idx = __atomic_fetch_add(&replayNext, 1, __ATOMIC_RELAXED)) < CART_SIM_MAX_OPEN_FILES ) {
+		file = &ftable[idx];
+		for (i=0; (i<file->lineCount) && !__atomic_load_n(&replayFailed, __ATOMIC_RELAXED); i++) {
+
+			// The lines parsed when they were queued, so they parse again here
+			sscanf(file->lines[i], "%s %s %d %d", fname, command, &len, &off);
+			sep = strchr(file->lines[i], ':');
+			if (replay_command(file, command, len, off, sep) != 0) {
+				__atomic_store_n(&replayFailed, 1, __ATOMIC_RELAXED);
+			}
+			free(file->lines[i]);
+			file->lines[i] = NULL;
+		}
+	}
+	return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_parallel
+// Description  : Replay the lines queued for each file on the worker pool;
+//                each file's operations run in trace order on one worker,
+//                different files run concurrently
+//
+// Inputs       : ftable - the file table, lines queued
+// Outputs      : 0 if successful test, -1 if failure
+
+int replay_parallel(CartSimulationTable *ftable) {
+
+	// Local variables
+	pthread_t workers[CART_SIM_MAX_THREADS];
+	int i, j, started = 0;
+
+	// Start the workers, running with those started if some fail to
+	replayNext = 0;
+	replayFailed = 0;
+	for (started=0; started<replayThreads; started++) {
+		if (pthread_create(&workers[started], NULL, replay_files, ftable) != 0) {
+			logMessage(LOG_ERROR_LEVEL, "Failure starting replay worker %d: %s.", started, strerror(errno));
+			break;
+		}
+	}
+	if (started == 0) {
+		return(-1);
+	}
+	for (i=0; i<started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	// Release the lines of files left behind by a failure
+	for (i=0; i<CART_SIM_MAX_OPEN_FILES; i++) {
+		for (j=0; j<ftable[i].lineCount; j++) {
+			free(ftable[i].lines[j]);
+		}
+		free(ftable[i].lines);
+		ftable[i].lines = NULL;
+		ftable[i].lineCount = ftable[i].lineMax = 0;
+	}
+	if (replayFailed) {
+		logMessage(LOG_ERROR_LEVEL, "CART parallel replay failed, aborting simulation.");
+		return(-1);
+	}
+	logMessage(CartSimulatorLLevel, "CART_SIM : Replayed files on %d workers.", started);
+	return( 0 );
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : validate_file
@@ -404,7 +640,8 @@ int validate_file(char *fname, int16_t mfh) {
 	// Local variables
 	char filename[256], bkfile[256], *filbuf, *membuf;
 	struct stat stats;
-	int idx, fh;
+	struct iovec iov[CART_SIM_VECTOR_PARTS];
+	int idx, fh, half;
 
 	// First figure out how big the file is, setup buffer
 	snprintf(filename, 256, "%s/%s", CART_WORKLOAD_DIR, fname);
@@ -431,13 +668,40 @@ int validate_file(char *fname, int16_t mfh) {
 	}
 	close(fh);
 
+	// Read the whole memory file in one vectored read, leaving the file position alone
+	if (validateMethod == CART_SIM_VALIDATE_VECTOR) {
+		split_vector(iov, membuf, stats.st_size);
+		if (cart_preadv(mfh, iov, CART_SIM_VECTOR_PARTS, 0) != stats.st_size) {
+			logMessage(LOG_ERROR_LEVEL, "Vectored read of cart file [%s] of length %d failed.", fname, stats.st_size);
+			return(-1);
+		}
+	}
+
+	// Map the back half privately (from inside a frame) and change it, which must not reach the
+	// file, then validate against a read-only snapshot of the whole file
+	else if (validateMethod == CART_SIM_VALIDATE_MAP) {
+		half = stats.st_size / 2;
+		free(membuf);
+		if (((membuf = cart_mmap(mfh, half, stats.st_size - half, CART_MAP_PRIVATE)) == NULL) ||
+				(memcmp(membuf, filbuf + half, stats.st_size - half) != 0)) {
+			logMessage(LOG_ERROR_LEVEL, "Private mapping of cart file [%s] failed or differs.", fname);
+			return(-1);
+		}
+		membuf[0] ^= 0xff;
+		if ((cart_munmap(membuf, stats.st_size - half) != 0) ||
+				((membuf = cart_mmap(mfh, 0, stats.st_size, CART_MAP_READONLY)) == NULL)) {
+			logMessage(LOG_ERROR_LEVEL, "Mapping cart file [%s] of length %d failed.", fname, stats.st_size);
+			return(-1);
+		}
+	}
+
 	// Seek to the beginning of the memory file, read the contents
-	if (cart_seek(mfh, 0) == -1) {
+	else if (cart_seek(mfh, 0) == -1) {
 		// Failed, error out
 		logMessage(LOG_ERROR_LEVEL, "Read cart file [%s] see to zero failed.", fname);
 		return(-1);
 	}
-	if (cart_read(mfh, membuf, stats.st_size) != stats.st_size) {
+	else if (cart_read(mfh, membuf, stats.st_size) != stats.st_size) {
 		// Failed, error out
 		logMessage(LOG_ERROR_LEVEL, "Read cart file [%s] of length %d failed.", fname, stats.st_size);
 		return(-1);
@@ -466,9 +730,107 @@ int validate_file(char *fname, int16_t mfh) {
 		}
 	}
 
+	// Rewrite the file in place from differently split buffers, it must read back the same
+	if (validateMethod == CART_SIM_VALIDATE_VECTOR) {
+		split_vector(iov, filbuf + 1, stats.st_size - 1);
+		if (cart_pwritev(mfh, iov, CART_SIM_VECTOR_PARTS, 1) != stats.st_size - 1) {
+			logMessage(LOG_ERROR_LEVEL, "Vectored rewrite of cart file [%s] failed.", fname);
+			return(-1);
+		}
+		memset(membuf, 0x0, stats.st_size);
+		split_vector(iov, membuf, stats.st_size);
+		if ((cart_preadv(mfh, iov, CART_SIM_VECTOR_PARTS, 0) != stats.st_size) ||
+				(memcmp(membuf, filbuf, stats.st_size) != 0)) {
+			logMessage(LOG_ERROR_LEVEL, "Vectored rewrite of cart file [%s] did not read back.", fname);
+			return(-1);
+		}
+	}
+
 	// Free the buffers, log success, and return successfully
 	free(filbuf);
-	free(membuf);
+	if (validateMethod == CART_SIM_VALIDATE_MAP) {
+		cart_munmap(membuf, stats.st_size);
+	} else {
+		free(membuf);
+	}
 	logMessage(LOG_OUTPUT_LEVEL, "Validation of [%s], length %d sucessful.", fname, stats.st_size);
 	return( 0 );
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : split_vector
+// Description  : Spread a buffer over the buffers of a vectored validation,
+//                in uneven parts so they start and end inside frames
+//
+// Inputs       : iov - the CART_SIM_VECTOR_PARTS buffers to set up
+//                buf - the buffer to spread
+//                size - bytes of the buffer
+// Outputs      : none
+
+void split_vector(struct iovec *iov, char *buf, int32_t size) {
+
+	// Local variables
+	int32_t i, start = 0, end;
+
+	// Each part ends a little past its even share (the last one takes the rest)
+	for (i=0; i<CART_SIM_VECTOR_PARTS; i++) {
+		end = (i == CART_SIM_VECTOR_PARTS-1) ? size : (int32_t)(((int64_t)size * (i+1)) / CART_SIM_VECTOR_PARTS) + 3;
+		if (end > size) {
+			end = size;
+		}
+		iov[i].iov_base = buf + start;
+		iov[i].iov_len = end - start;
+		start = end;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : report_cart_stats
+// Description  : Log what the driver, cache and bus counted over the run:
+//                where the time went and how many round trips it cost
+//
+// Inputs       : none
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void report_cart_stats(void) {
+
+	// Local variables
+	static const char *opnames[CART_OP_MAXVAL] = { "INITMS", "BZERO", "LDCART", "RDFRME",
+		"WRFRME", "POWOFF", "RDFRMS", "WRFRMS" };
+	static CartBusStats bus;
+	CartDriverStats driver;
+	CartCacheStats cache;
+	CartBusOpStats *op;
+	int i;
+
+	if ( (get_cart_driver_stats(&driver) != 0) || (get_cart_cache_stats(&cache) != 0) ||
+			(client_cart_bus_stats(&bus) != 0) ) {
+		return;
+	}
+
+	logMessage( LOG_OUTPUT_LEVEL, "Driver : %lu reads (%lu bytes, %.3f s), %lu writes (%lu bytes, %.3f s), "
+		"%lu runs allocated (%lu frames, %.3f s), %lu frames freed",
+		(unsigned long)driver.reads, (unsigned long)driver.bytesRead, driver.readTime / 1e9,
+		(unsigned long)driver.writes, (unsigned long)driver.bytesWritten, driver.writeTime / 1e9,
+		(unsigned long)driver.runsAllocated, (unsigned long)driver.framesAllocated, driver.allocTime / 1e9,
+		(unsigned long)driver.framesFreed );
+	logMessage( LOG_OUTPUT_LEVEL, "Cache : %lu hits, %lu misses, %lu inserts, %lu evictions, %lu writebacks",
+		(unsigned long)cache.hits, (unsigned long)cache.misses, (unsigned long)cache.inserts,
+		(unsigned long)cache.evictions, (unsigned long)cache.writebacks );
+	for ( i = 0; i < CART_OP_MAXVAL; i++ ) {
+		op = &bus.ops[i];
+		if ( op->requests == 0 ) {
+			continue;
+		}
+		logMessage( LOG_OUTPUT_LEVEL, "Bus [%s] : %lu requests (%lu failed), %lu bytes out, %lu bytes in, "
+			"latency us mean %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f", opnames[i],
+			(unsigned long)op->requests, (unsigned long)op->failures,
+			(unsigned long)op->bytesSent, (unsigned long)op->bytesReceived,
+			op->latencyTotal / 1e3 / op->requests, cart_bus_latency_percentile(op, 50) / 1e3,
+			cart_bus_latency_percentile(op, 90) / 1e3, cart_bus_latency_percentile(op, 99) / 1e3,
+			op->latencyMax / 1e3 );
+	}
+}
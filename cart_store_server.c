@@ -0,0 +1,131 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File          : cart_store_server.c
+//  Description   : This is the main program of the CART frame store server,
+//                  running the cart_server engine on a listening socket.
+//
+//   Author       : Eric Traister
+//  Last Modified : 12/09/2016
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Include Files
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+// Project Include Files
+#include "cart_network.h"
+#include "cmpsc311_log.h"
+
+// Defines
+#define CART_SERVER_ARGUMENTS "hvl:i:p:f:"
+#define USAGE \
+	"USAGE: cart_store_server [-h] [-v] [-l <logfile>] [-i <address>] [-p <port>] [-f <store>]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -v - verbose output\n" \
+	"    -l - write log messages to the filename <logfile>\n" \
+	"    -i - IP address to listen on (all addresses by default).\n" \
+	"    -p - port number to listen on.\n" \
+	"    -f - backing file holding the cartridges (created if missing, kept between runs).\n" \
+	"\n" \
+
+// Functional Prototypes
+void stop_cart_server(int sig);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stop_cart_server
+// Description  : Signal handler asking the event loop to shut down
+//
+// Inputs       : sig - the signal caught
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void stop_cart_server(int sig) {
+	cart_network_shutdown = 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the CART frame store server
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int main( int argc, char *argv[] ) {
+
+	// Local variables
+	int ch, verbose = 0, log_initialized = 0;
+	unsigned short port = 0;
+	struct sigaction stop;
+
+	// Process the command line parameters
+	while ((ch = getopt(argc, argv, CART_SERVER_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'v': // Verbose Flag
+			verbose = 1;
+			break;
+
+		case 'l': // Set the log filename
+			initializeLogWithFilename( optarg );
+			log_initialized = 1;
+			break;
+
+		case 'i': // Set the address to listen on
+			cart_network_address = (unsigned char *)optarg;
+			break;
+
+		case 'p': // Set the network port number
+			if ( sscanf( optarg, "%hu", &port ) != 1 ) {
+				fprintf( stderr, "Bad port number [%s], aborting.\n", optarg );
+				return( -1 );
+			}
+			cart_network_port = port;
+			break;
+
+		case 'f': // Set the backing file of the cartridges
+			cart_server_store = optarg;
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+
+	// Setup the log as needed
+	if ( ! log_initialized ) {
+		initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	}
+	if ( verbose ) {
+		enableLogLevels(LOG_INFO_LEVEL);
+	}
+
+	// Shut down cleanly (with the cartridges written back) when interrupted or killed
+	memset( &stop, 0x0, sizeof(stop) );
+	stop.sa_handler = stop_cart_server;
+	sigaction( SIGINT, &stop, NULL );
+	sigaction( SIGTERM, &stop, NULL );
+	signal( SIGPIPE, SIG_IGN );
+
+	// Run the server
+	if ( cart_server() != 0 ) {
+		logMessage( LOG_ERROR_LEVEL, "CART server failed.\n\n" );
+		return( -1 );
+	}
+
+	// Return successfully
+	return( 0 );
+}
@@ -0,0 +1,177 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_trace.c
+//  Description    : This is the implementation of the trace layer for the hot
+//                   paths of the CART system: the log sink, and the lock-free
+//                   ring buffer sink dumped at exit.
+//
+//  Author         : Eric Traister
+//  Last Modified  : 11/14/2016
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+// Project includes
+#include "cart_trace.h"
+#include "cmpsc311_log.h"
+
+// Defines
+#define CART_TRACE_MAX_RING (1 << 24)	// most entries the ring buffer can keep
+
+// Structures
+//   An entry of the ring buffer.  The writer of trace n marks the entry 2n+1
+//   while it fills it and 2n+2 once it is done, so the dump can skip an entry
+//   taken over by a later trace (or still being written).
+typedef struct CartTraceEntry {
+		uint64_t			sequence;						// 2n+1 while trace n is written, 2n+2 once it is
+		uint64_t			time;							// monotonic time of the trace in ns
+		unsigned long		level;							// log level of the trace
+		char				message[CART_TRACE_MESSAGE];	// the message, truncated to fit
+} CartTraceEntry;
+
+// Global Variables
+unsigned long		cartTraceLevels = 0;		// log levels traced
+CartTraceEntry		*traceRing = NULL;			// ring buffer, NULL to log the traces as they happen
+uint64_t			traceMask = 0;				// entries of the ring buffer, less one
+uint64_t			traceHead = 0;				// traces put in the ring buffer so far
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_trace_levels
+// Description  : Set the log levels the trace points fire at
+//
+// Inputs       : lvl - the levels traced
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void set_cart_trace_levels(unsigned long lvl) {
+
+	cartTraceLevels = lvl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_trace_ring
+// Description  : Keep the traces in a ring buffer holding the last entries
+//                (rounded up to a power of two) instead of logging them; the
+//                oldest are overwritten once it is full.  Must be called
+//                before anything is traced.
+//
+// Inputs       : entries - traces the ring buffer keeps
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int set_cart_trace_ring(uint32_t entries) {
+
+	// Local Variables
+	uint64_t			size = 1;
+
+	if (entries == 0 || entries > CART_TRACE_MAX_RING || traceRing != NULL) {
+		logMessage(LOG_ERROR_LEVEL, "\nBad trace ring buffer size %u (1 to %d, set once)\n", entries, CART_TRACE_MAX_RING);
+		return (-1);
+	}
+	while (size < entries)
+		size <<= 1;
+	if ((traceRing = calloc(size, sizeof(CartTraceEntry))) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "\nUnable to allocate the trace ring buffer\n");
+		return (-1);
+	}
+	traceMask = size - 1;
+	traceHead = 0;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_trace_message
+// Description  : Log a trace message, or format it into the next entry of
+//                the ring buffer: taking the entry is one atomic add, and
+//                nothing is locked or written out
+//
+// Inputs       : lvl - the log level of the trace
+//                fmt - the "printf"-style format, followed by its arguments
+// Outputs      : none
+//
+////////////////////////////////////////////////////////////////////////////////
+void cart_trace_message(unsigned long lvl, const char *fmt, ...) {
+
+	// Local Variables
+	va_list				args;
+	uint64_t			trace = 0;
+	struct timespec		now;
+	CartTraceEntry		*entry = NULL;
+
+	va_start(args, fmt);
+	if (traceRing == NULL) {
+		vlogMessage(lvl, fmt, args);
+		va_end(args);
+		return;
+	}
+
+	trace = __atomic_fetch_add(&traceHead, 1, __ATOMIC_RELAXED);
+	entry = &traceRing[trace & traceMask];
+	__atomic_exchange_n(&entry->sequence, 2 * trace + 1, __ATOMIC_ACQ_REL);	// filling can't start before the mark
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	entry->time = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	entry->level = lvl;
+	vsnprintf(entry->message, CART_TRACE_MESSAGE, fmt, args);
+	va_end(args);
+
+	__atomic_store_n(&entry->sequence, 2 * trace + 2, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dump_cart_trace
+// Description  : Log the traces kept in the ring buffer, oldest first (with
+//                their time since the oldest), and empty it.  Traces written
+//                while the dump runs may be skipped.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+//
+////////////////////////////////////////////////////////////////////////////////
+int dump_cart_trace(void) {
+
+	// Local Variables
+	uint64_t			trace = 0;
+	uint64_t			head = 0;
+	uint64_t			first = 0;
+	uint64_t			start = 0;
+	CartTraceEntry		copy;
+	CartTraceEntry		*entry = NULL;
+
+	if (traceRing == NULL)
+		return (0);
+
+	head = __atomic_load_n(&traceHead, __ATOMIC_ACQUIRE);
+	first = (head > traceMask + 1) ? head - traceMask - 1 : 0;
+	if (first > 0)
+		logMessage(LOG_OUTPUT_LEVEL, "Trace : %lu oldest entries overwritten", (unsigned long)first);
+
+	for (trace = first; trace < head; trace++) {
+		entry = &traceRing[trace & traceMask];
+		if (__atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) != 2 * trace + 2)
+			continue;
+		memcpy(&copy, entry, sizeof(copy));
+		if (__atomic_fetch_add(&entry->sequence, 0, __ATOMIC_ACQ_REL) != 2 * trace + 2)	// after the copy
+			continue;
+
+		copy.message[CART_TRACE_MESSAGE - 1] = '\0';
+		if (start == 0)
+			start = copy.time;
+		logMessage(copy.level, "[+%.6f s] %s", (copy.time - start) / 1e9, copy.message);
+	}
+
+	__atomic_store_n(&traceHead, 0, __ATOMIC_RELEASE);
+	memset(traceRing, 0x0, sizeof(CartTraceEntry) * (traceMask + 1));
+	return (0);
+}
@@ -0,0 +1,64 @@
+#ifndef CART_TRACE_INCLUDED
+#define CART_TRACE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_trace.h
+//  Description    : This is the trace layer for the hot paths of the CART
+//                   system (every frame, cache placement and bus request).
+//                   A trace point is a log message that costs one predictable
+//                   branch while its level is off, and nothing at all in a
+//                   build with CART_TRACE_ENABLED set to 0 (make TRACE=0).
+//                   Traces go to the log, or to a lock-free ring buffer
+//                   dumped at exit so tracing a run doesn't distort it.
+//
+//  Author         : Patrick McDaniel
+//  Last Modified  : Thu Sep 15 15:05:53 EDT 2016
+//
+
+// Include files
+#include <stdint.h>
+
+// Defines
+#ifndef CART_TRACE_ENABLED
+#define CART_TRACE_ENABLED 1      // trace points compiled in (0 compiles them out)
+#endif
+#define CART_TRACE_MESSAGE 112    // bytes of a message kept in the ring buffer
+
+// Log a "printf"-style trace message if lvl is traced; the arguments are only
+// evaluated then (and are still type checked when compiled out)
+#if CART_TRACE_ENABLED
+#define CART_TRACE(lvl, ...) \
+	do { \
+		if (__builtin_expect((cartTraceLevels & (lvl)) != 0, 0)) \
+			cart_trace_message((lvl), __VA_ARGS__); \
+	} while (0)
+#else
+#define CART_TRACE(lvl, ...) \
+	do { \
+		if (0) \
+			cart_trace_message((lvl), __VA_ARGS__); \
+	} while (0)
+#endif
+
+//
+// Global data
+
+extern unsigned long cartTraceLevels;  // log levels traced, tested by CART_TRACE
+
+//
+// Interface functions
+
+void set_cart_trace_levels(unsigned long lvl);
+	// Trace the log levels lvl (the ones enabled in the log, normally)
+
+int set_cart_trace_ring(uint32_t entries);
+	// Keep the traces in a ring buffer of the last entries (rounded up to a power of two) instead of logging them
+
+void cart_trace_message(unsigned long lvl, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+	// Log a trace message, or put it in the ring buffer (use CART_TRACE)
+
+int dump_cart_trace(void);
+	// Log the traces in the ring buffer, oldest first, and empty it
+
+#endif